@@ -0,0 +1,408 @@
+/* Copying the entire contents of one volume to another.
+
+The stretches of the source that need copying are worked out first, as a list
+of extents; they are then streamed across by a reader thread and a writer
+thread, passing chunks through a ring of buffers so that reading the next
+chunk overlaps with writing the last one. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "volume_container.h"
+#include "image_file.h"
+#include "image_util.h"
+#include "clone.h"
+
+/* Granularity at which runs of zeroes are spotted and left unwritten */
+#define CLONE_ZERO_CHUNK_SIZE 65536
+/* Minimum time between progress updates, in microseconds */
+#define CLONE_PROGRESS_INTERVAL 250000
+
+typedef struct st_clone_extent {
+	off_t start;
+	off_t end;
+} clone_extent;
+
+typedef struct st_clone_extent_list {
+	clone_extent *extents;
+	int count;
+	int capacity;
+	off_t total_size; /* sum of the extent lengths */
+} clone_extent_list;
+
+/* One buffer in the ring between reader and writer */
+typedef struct st_clone_slot {
+	unsigned char *buf;
+	off_t position;
+	size_t length;
+} clone_slot;
+
+typedef struct st_clone_pipe {
+	volume_container *dest;
+	volume_container *source;
+	clone_extent_list *list;
+	const clone_options *options;
+	clone_stats *stats;
+
+	clone_slot *slots;
+	int head; /* next slot for the reader to fill */
+	int tail; /* next slot for the writer to empty */
+	int filled; /* number of slots waiting for the writer */
+	int reader_done;
+	int failed;
+	int copy_in_kernel; /* still worth trying image_file_copy_range */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t slot_filled;
+	pthread_cond_t slot_emptied;
+#endif
+
+	off_t bytes_done; /* progress through the extents, in bytes */
+	struct timeval start_time;
+	struct timeval last_progress;
+} clone_pipe;
+
+static int extent_add(clone_extent_list *list, off_t start, off_t end) {
+	clone_extent *extents;
+
+	if (end <= start) return 0;
+	list->total_size += end - start;
+	if (list->count > 0 && list->extents[list->count - 1].end == start) {
+		list->extents[list->count - 1].end = end;
+		return 0;
+	}
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		extents = realloc(list->extents, list->capacity * sizeof(clone_extent));
+		if (!extents) {
+			fprintf(stderr, "Out of memory listing extents to copy\n");
+			return -1;
+		}
+		list->extents = extents;
+	}
+	list->extents[list->count].start = start;
+	list->extents[list->count].end = end;
+	list->count++;
+	return 0;
+}
+
+/* Write out one run of non-zero data, letting the kernel copy it across from
+the source (or share it, on filesystems that can) when both are plain image
+files, and writing it from the buffer otherwise */
+static int write_run(clone_pipe *pipe, clone_slot *slot, size_t offset, size_t count) {
+	if (pipe->copy_in_kernel) {
+		if (image_file_copy_range(pipe->dest, pipe->source, slot->position + offset, count) == 0) return 0;
+		/* no point trying again for the rest of the clone */
+		pipe->copy_in_kernel = 0;
+	}
+	if (pipe->dest->write(pipe->dest, slot->position + offset, slot->buf + offset, count) < 0) return -1;
+	return 0;
+}
+
+/* Write out a chunk that has been read from the source, leaving out runs of
+zeroes and writing each run of non-zero data in one go */
+static int write_nonzero(clone_pipe *pipe, clone_slot *slot) {
+	size_t chunk_size, offset, run_start = 0;
+	int in_run = 0;
+
+	for (offset = 0; offset < slot->length; offset += chunk_size) {
+		chunk_size = slot->length - offset;
+		if (chunk_size > CLONE_ZERO_CHUNK_SIZE) chunk_size = CLONE_ZERO_CHUNK_SIZE;
+		if (!buffer_is_zero(slot->buf + offset, chunk_size)) {
+			if (!in_run) run_start = offset;
+			in_run = 1;
+			continue;
+		}
+		if (in_run) {
+			if (write_run(pipe, slot, run_start, offset - run_start) == -1) return -1;
+			pipe->stats->bytes_copied += offset - run_start;
+			in_run = 0;
+		}
+		pipe->stats->bytes_skipped += chunk_size;
+	}
+	if (in_run) {
+		if (write_run(pipe, slot, run_start, slot->length - run_start) == -1) return -1;
+		pipe->stats->bytes_copied += slot->length - run_start;
+	}
+	return 0;
+}
+
+static double elapsed_seconds(struct timeval *from, struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1000000.0;
+}
+
+static void show_progress(clone_pipe *pipe, int final) {
+	struct timeval now;
+	double elapsed;
+	off_t total = pipe->list->total_size;
+
+	gettimeofday(&now, NULL);
+	if (!final && elapsed_seconds(&pipe->last_progress, &now) * 1000000 < CLONE_PROGRESS_INTERVAL) return;
+	pipe->last_progress = now;
+	elapsed = elapsed_seconds(&pipe->start_time, &now);
+	fprintf(stderr, "\r%3d%%  %llu / %llu MiB  %.1f MiB/s ",
+		total ? (int)(pipe->bytes_done * 100 / total) : 100,
+		(unsigned long long)(pipe->bytes_done >> 20), (unsigned long long)(total >> 20),
+		elapsed > 0 ? pipe->bytes_done / elapsed / 1048576 : 0.0);
+	if (final) fprintf(stderr, "\n");
+}
+
+#ifdef HAVE_PTHREAD
+static void *clone_reader(void *arg) {
+	clone_pipe *pipe = arg;
+	clone_slot *slot;
+	off_t position;
+	int i;
+
+	for (i = 0; i < pipe->list->count; i++) {
+		for (position = pipe->list->extents[i].start; position < pipe->list->extents[i].end; ) {
+			pthread_mutex_lock(&pipe->lock);
+			while (pipe->filled == pipe->options->depth && !pipe->failed) {
+				pthread_cond_wait(&pipe->slot_emptied, &pipe->lock);
+			}
+			if (pipe->failed) {
+				pthread_mutex_unlock(&pipe->lock);
+				return NULL;
+			}
+			slot = &pipe->slots[pipe->head];
+			pthread_mutex_unlock(&pipe->lock);
+
+			slot->position = position;
+			slot->length = pipe->options->chunk_size;
+			if ((off_t)slot->length > pipe->list->extents[i].end - position) {
+				slot->length = pipe->list->extents[i].end - position;
+			}
+			if (pipe->source->read(pipe->source, position, slot->buf, slot->length) < 0) {
+				pthread_mutex_lock(&pipe->lock);
+				pipe->failed = 1;
+				pthread_cond_signal(&pipe->slot_filled);
+				pthread_mutex_unlock(&pipe->lock);
+				return NULL;
+			}
+			position += slot->length;
+
+			pthread_mutex_lock(&pipe->lock);
+			pipe->head = (pipe->head + 1) % pipe->options->depth;
+			pipe->filled++;
+			pthread_cond_signal(&pipe->slot_filled);
+			pthread_mutex_unlock(&pipe->lock);
+		}
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->reader_done = 1;
+	pthread_cond_signal(&pipe->slot_filled);
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+/* Run the reader in a thread of its own, writing out chunks on this one as
+they arrive */
+static int clone_pipe_run(clone_pipe *pipe) {
+	pthread_t reader;
+	clone_slot *slot;
+
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->slot_filled, NULL);
+	pthread_cond_init(&pipe->slot_emptied, NULL);
+	if (pthread_create(&reader, NULL, clone_reader, pipe) != 0) {
+		fprintf(stderr, "Cannot start reader thread\n");
+		return -1;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&pipe->lock);
+		while (pipe->filled == 0 && !pipe->reader_done && !pipe->failed) {
+			pthread_cond_wait(&pipe->slot_filled, &pipe->lock);
+		}
+		if (pipe->failed || pipe->filled == 0) {
+			pthread_mutex_unlock(&pipe->lock);
+			break;
+		}
+		slot = &pipe->slots[pipe->tail];
+		pthread_mutex_unlock(&pipe->lock);
+
+		if (write_nonzero(pipe, slot) == -1) {
+			pthread_mutex_lock(&pipe->lock);
+			pipe->failed = 1;
+			pthread_cond_signal(&pipe->slot_emptied);
+			pthread_mutex_unlock(&pipe->lock);
+			break;
+		}
+		pipe->bytes_done += slot->length;
+		if (pipe->options->progress) show_progress(pipe, 0);
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->tail = (pipe->tail + 1) % pipe->options->depth;
+		pipe->filled--;
+		pthread_cond_signal(&pipe->slot_emptied);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+
+	pthread_join(reader, NULL);
+	pthread_cond_destroy(&pipe->slot_emptied);
+	pthread_cond_destroy(&pipe->slot_filled);
+	pthread_mutex_destroy(&pipe->lock);
+	return pipe->failed ? -1 : 0;
+}
+#else
+/* Without threads, read and write each chunk in turn through the first slot */
+static int clone_pipe_run(clone_pipe *pipe) {
+	clone_slot *slot = &pipe->slots[0];
+	off_t position;
+	int i;
+
+	for (i = 0; i < pipe->list->count; i++) {
+		for (position = pipe->list->extents[i].start; position < pipe->list->extents[i].end; ) {
+			slot->position = position;
+			slot->length = pipe->options->chunk_size;
+			if ((off_t)slot->length > pipe->list->extents[i].end - position) {
+				slot->length = pipe->list->extents[i].end - position;
+			}
+			if (pipe->source->read(pipe->source, position, slot->buf, slot->length) < 0) return -1;
+			if (write_nonzero(pipe, slot) == -1) return -1;
+			position += slot->length;
+			pipe->bytes_done += slot->length;
+			if (pipe->options->progress) show_progress(pipe, 0);
+		}
+	}
+	return 0;
+}
+#endif
+
+/* Copy each extent in the list from source to dest */
+static int clone_extents(volume_container *dest, volume_container *source,
+	clone_extent_list *list, const clone_options *options, clone_stats *stats) {
+	clone_pipe pipe;
+	int i, res;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.dest = dest;
+	pipe.source = source;
+	pipe.list = list;
+	pipe.options = options;
+	pipe.stats = stats;
+	pipe.copy_in_kernel = 1;
+
+	pipe.slots = calloc(options->depth, sizeof(clone_slot));
+	if (!pipe.slots) {
+		fprintf(stderr, "Out of memory allocating clone buffers\n");
+		return -1;
+	}
+	for (i = 0; i < options->depth; i++) {
+		/* page-aligned, so that direct I/O can go straight to and from them */
+		if (posix_memalign((void **)&pipe.slots[i].buf, 4096, options->chunk_size) != 0) {
+			fprintf(stderr, "Out of memory allocating clone buffers\n");
+			while (i-- > 0) free(pipe.slots[i].buf);
+			free(pipe.slots);
+			return -1;
+		}
+	}
+
+	gettimeofday(&pipe.start_time, NULL);
+	pipe.last_progress = pipe.start_time;
+	res = clone_pipe_run(&pipe);
+	if (options->progress && res == 0) show_progress(&pipe, 1);
+
+	for (i = 0; i < options->depth; i++) free(pipe.slots[i].buf);
+	free(pipe.slots);
+	return res;
+}
+
+/* Copy the contents of source to dest, which must be the same size and read
+as all zeroes to begin with (as a newly created image does). Holes in the
+source and zero-filled chunks are skipped, leaving the destination sparse */
+int clone_volume(volume_container *dest, volume_container *source,
+	const clone_options *options, clone_stats *stats) {
+	clone_extent_list list;
+	off_t total_size, position, data_start, data_end;
+	int res;
+
+	memset(stats, 0, sizeof(clone_stats));
+	memset(&list, 0, sizeof(list));
+	total_size = (off_t)source->bytes_per_sector * source->sector_count;
+
+	if (image_file_reflink(dest, source) == 0) {
+		stats->reflinked = 1;
+		return 0;
+	}
+
+	/* list the stretches of the source that hold data */
+	position = 0;
+	while (position < total_size) {
+		if (source->find_data != NULL) {
+			if (source->find_data(source, position, &data_start, &data_end) == -1) {
+				free(list.extents);
+				return -1;
+			}
+		} else {
+			data_start = position;
+			data_end = total_size;
+		}
+		if (data_start >= total_size) break;
+		if (extent_add(&list, data_start, data_end) == -1) {
+			free(list.extents);
+			return -1;
+		}
+		position = data_end;
+	}
+	stats->bytes_skipped = total_size - list.total_size;
+
+	res = clone_extents(dest, source, &list, options, stats);
+	free(list.extents);
+	return res;
+}
+
+/* Copy just the parts of source that are in use by the FAT filesystem mounted
+from it as fatfs: everything up to the start of the data area (partition
+table, boot sector, reserved sectors, FATs and, below FAT32, the root
+directory), the clusters that the FAT marks as allocated, and anything after
+the end of the data area. Free clusters are left unwritten, which as with
+clone_volume means that dest must read as all zeroes to begin with */
+int clone_volume_used(volume_container *dest, volume_container *source, FATFS *fatfs,
+	const clone_options *options, clone_stats *stats) {
+	clone_extent_list list;
+	off_t total_size, cluster_size, data_area_start, data_area_end, cluster_start;
+	DWORD cluster, value;
+	int res;
+
+	memset(stats, 0, sizeof(clone_stats));
+	memset(&list, 0, sizeof(list));
+	total_size = (off_t)source->bytes_per_sector * source->sector_count;
+	cluster_size = (off_t)source->bytes_per_sector * fatfs->csize;
+	data_area_start = (off_t)source->bytes_per_sector * fatfs->database;
+	data_area_end = data_area_start + cluster_size * (fatfs->max_clust - 2);
+	if (data_area_end > total_size) {
+		fprintf(stderr, "Filesystem is larger than the image holding it\n");
+		return -1;
+	}
+
+	res = extent_add(&list, 0, data_area_start);
+	for (cluster = 2; cluster < fatfs->max_clust && res == 0; cluster++) {
+		value = get_fat(fatfs, cluster);
+		if (value == 1 || value == 0xFFFFFFFF) {
+			fprintf(stderr, "Error reading FAT entry for cluster %lu\n", (unsigned long)cluster);
+			res = -1;
+		} else if (value != 0) {
+			cluster_start = (off_t)source->bytes_per_sector * clust2sect(fatfs, cluster);
+			res = extent_add(&list, cluster_start, cluster_start + cluster_size);
+		}
+	}
+	if (res == 0) res = extent_add(&list, data_area_end, total_size);
+	if (res == -1) {
+		free(list.extents);
+		return -1;
+	}
+	stats->bytes_skipped = total_size - list.total_size;
+
+	res = clone_extents(dest, source, &list, options, stats);
+	free(list.extents);
+	return res;
+}
@@ -0,0 +1,30 @@
+#ifndef __CLONE_H
+#define __CLONE_H
+
+#include "volume_container.h"
+
+#define DIR FATDIR
+#include "ff.h"
+#undef DIR
+
+#define CLONE_DEFAULT_CHUNK_SIZE 1048576
+#define CLONE_DEFAULT_DEPTH 8
+
+typedef struct st_clone_options {
+	size_t chunk_size; /* bytes per read/write; a multiple of the sector size */
+	int depth; /* number of chunk buffers passed between reader and writer */
+	int progress; /* nonzero to show progress on stderr */
+} clone_options;
+
+typedef struct st_clone_stats {
+	off_t bytes_copied; /* bytes read from the source and written out */
+	off_t bytes_skipped; /* holes and zeroes left unwritten */
+	int reflinked; /* nonzero if the destination shares the source's storage */
+} clone_stats;
+
+int clone_volume(volume_container *dest, volume_container *source,
+	const clone_options *options, clone_stats *stats);
+int clone_volume_used(volume_container *dest, volume_container *source, FATFS *fatfs,
+	const clone_options *options, clone_stats *stats);
+
+#endif /* #ifdef __CLONE_H */
@@ -0,0 +1,461 @@
+/* Compressed image files.
+
+The volume is divided into fixed-size blocks, each compressed separately with
+zlib so that any one of them can be read or rewritten without touching the
+rest. The file consists of:
+
+	0x00	signature "HDFMZ\x1a\0\0"
+	0x08	format version (4 bytes)
+	0x0c	block size in bytes (4 bytes)
+	0x10	bytes per sector (4 bytes)
+	0x14	reserved
+	0x18	sector count (8 bytes)
+	0x20	reserved, up to COMPRESSED_HEADER_SIZE
+	0x40	block index: for each block, the file offset (8 bytes) and length
+		(4 bytes) of its compressed data
+	...	compressed blocks, in no particular order
+
+All values are little-endian. A length of 0 stands for a block of zeroes,
+which takes up no space; a length equal to the block size means the block is
+stored uncompressed, because compressing it didn't help. A rewritten block
+goes back in its old place if it still fits, and on the end of the file if
+not; the space that it leaves behind is only reclaimed by cloning the image
+into a new file. */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include "volume_container.h"
+#include "compressed_image.h"
+#include "image_util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static char *compressed_signature = "HDFMZ\x1a\0\0";
+#define COMPRESSED_SIGNATURE_LENGTH 8
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_HEADER_SIZE 0x40
+#define COMPRESSED_INDEX_ENTRY_SIZE 12
+#define COMPRESSED_BLOCK_SIZE 65536
+/* Number of uncompressed blocks kept in memory */
+#define COMPRESSED_CACHE_BLOCKS 16
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+
+typedef struct st_compressed_index_entry {
+	off_t offset;
+	unsigned long length;
+} compressed_index_entry;
+
+typedef struct st_compressed_cache_block {
+	unsigned long block; /* block number held, or NO_BLOCK */
+	int dirty;
+	unsigned long last_used;
+	unsigned char *data;
+} compressed_cache_block;
+
+#define NO_BLOCK ((unsigned long)-1)
+
+typedef struct st_compressed_image {
+	int writeable;
+	unsigned long block_size;
+	unsigned long block_count;
+	compressed_index_entry *index;
+	unsigned long index_dirty_first; /* range of index entries to write back */
+	unsigned long index_dirty_last;
+	off_t file_end; /* where blocks that don't fit in their old place go */
+	compressed_cache_block cache[COMPRESSED_CACHE_BLOCKS];
+	unsigned long use_counter;
+	unsigned char *compressed; /* scratch buffer, compressBound(block_size) bytes */
+	unsigned long compressed_size;
+} compressed_image;
+
+/* Write out the index entries that have changed since the last time */
+static int write_index(volume_container *v) {
+	compressed_image *image = v->data.image.state;
+	unsigned long i, count;
+	unsigned char *buf;
+	int res;
+
+	if (image->index_dirty_first > image->index_dirty_last) return 0;
+	count = image->index_dirty_last - image->index_dirty_first + 1;
+	buf = malloc(count * COMPRESSED_INDEX_ENTRY_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Out of memory writing compressed image index\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		put_le64(buf + i * COMPRESSED_INDEX_ENTRY_SIZE, image->index[image->index_dirty_first + i].offset);
+		put_le32(buf + i * COMPRESSED_INDEX_ENTRY_SIZE + 8, image->index[image->index_dirty_first + i].length);
+	}
+	res = write_fully(v->data.image.fd, buf, count * COMPRESSED_INDEX_ENTRY_SIZE,
+		COMPRESSED_HEADER_SIZE + (off_t)image->index_dirty_first * COMPRESSED_INDEX_ENTRY_SIZE);
+	free(buf);
+	if (res == -1) return -1;
+
+	image->index_dirty_first = image->block_count;
+	image->index_dirty_last = 0;
+	return 0;
+}
+
+/* Compress a block held in the cache and write it to the file */
+static int flush_block(volume_container *v, compressed_cache_block *c) {
+	compressed_image *image = v->data.image.state;
+	compressed_index_entry *entry;
+	uLongf length = image->compressed_size;
+	unsigned char *data = image->compressed;
+	off_t offset;
+
+	if (!c->dirty) return 0;
+	entry = &image->index[c->block];
+
+	if (buffer_is_zero(c->data, image->block_size)) {
+		length = 0;
+	} else if (compress2(image->compressed, &length, c->data, image->block_size, Z_DEFAULT_COMPRESSION) != Z_OK
+		|| length >= image->block_size) {
+		/* store it as it is */
+		length = image->block_size;
+		data = c->data;
+	}
+
+	if (length == 0) {
+		offset = 0;
+	} else if (entry->length != 0 && length <= entry->length) {
+		offset = entry->offset;
+	} else {
+		offset = image->file_end;
+		image->file_end += length;
+	}
+	if (length != 0 && write_fully(v->data.image.fd, data, length, offset) == -1) return -1;
+
+	entry->offset = offset;
+	entry->length = length;
+	if (c->block < image->index_dirty_first) image->index_dirty_first = c->block;
+	if (c->block > image->index_dirty_last) image->index_dirty_last = c->block;
+	c->dirty = 0;
+	return 0;
+}
+
+static int flush_all(volume_container *v) {
+	compressed_image *image = v->data.image.state;
+	int i;
+
+	for (i = 0; i < COMPRESSED_CACHE_BLOCKS; i++) {
+		if (image->cache[i].dirty && flush_block(v, &image->cache[i]) == -1) return -1;
+	}
+	return 0;
+}
+
+/* Bring a block into the cache, evicting the least recently used one; if the
+caller is about to overwrite all of it, its old contents aren't read */
+static compressed_cache_block *get_block(volume_container *v, unsigned long block, int overwrite) {
+	compressed_image *image = v->data.image.state;
+	compressed_index_entry *entry = &image->index[block];
+	compressed_cache_block *c = NULL;
+	uLongf length;
+	int i;
+
+	for (i = 0; i < COMPRESSED_CACHE_BLOCKS; i++) {
+		if (image->cache[i].block == block) {
+			c = &image->cache[i];
+			c->last_used = ++image->use_counter;
+			return c;
+		}
+		if (c == NULL || image->cache[i].last_used < c->last_used) c = &image->cache[i];
+	}
+
+	if (flush_block(v, c) == -1) return NULL;
+	c->block = NO_BLOCK;
+
+	if (overwrite) {
+		/* nothing to do */
+	} else if (entry->length == 0) {
+		memset(c->data, 0, image->block_size);
+	} else if (entry->length == image->block_size) {
+		if (read_fully(v->data.image.fd, c->data, image->block_size, entry->offset) == -1) return NULL;
+	} else {
+		if (entry->length > image->compressed_size) {
+			fprintf(stderr, "Corrupt block index in compressed image\n");
+			return NULL;
+		}
+		if (read_fully(v->data.image.fd, image->compressed, entry->length, entry->offset) == -1) return NULL;
+		length = image->block_size;
+		if (uncompress(c->data, &length, image->compressed, entry->length) != Z_OK || length != image->block_size) {
+			fprintf(stderr, "Corrupt block %lu in compressed image\n", block);
+			return NULL;
+		}
+	}
+	c->block = block;
+	c->last_used = ++image->use_counter;
+	return c;
+}
+
+static ssize_t compressed_image_read(volume_container *v, off_t position, void *buf, size_t count) {
+	compressed_image *image = v->data.image.state;
+	compressed_cache_block *c;
+	size_t done = 0, offset, len;
+
+	while (done < count) {
+		offset = (position + done) % image->block_size;
+		len = image->block_size - offset;
+		if (len > count - done) len = count - done;
+		c = get_block(v, (position + done) / image->block_size, 0);
+		if (c == NULL) return -1;
+		memcpy((char *)buf + done, c->data + offset, len);
+		done += len;
+	}
+	return done;
+}
+
+static ssize_t compressed_image_write(volume_container *v, off_t position, void *buf, size_t count) {
+	compressed_image *image = v->data.image.state;
+	compressed_cache_block *c;
+	size_t done = 0, offset, len;
+
+	if (!image->writeable) {
+		fprintf(stderr, "Compressed image is open read-only\n");
+		return -1;
+	}
+	while (done < count) {
+		offset = (position + done) % image->block_size;
+		len = image->block_size - offset;
+		if (len > count - done) len = count - done;
+		c = get_block(v, (position + done) / image->block_size, len == image->block_size);
+		if (c == NULL) return -1;
+		memcpy(c->data + offset, (char *)buf + done, len);
+		c->dirty = 1;
+		done += len;
+	}
+	return done;
+}
+
+static int compressed_image_sync(volume_container *v) {
+	if (flush_all(v) == -1) return -1;
+	return write_index(v);
+}
+
+/* Blocks of zeroes take no space in the file, and count as holes */
+static int compressed_image_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	compressed_image *image = v->data.image.state;
+	off_t end = (off_t)v->sector_count * v->bytes_per_sector;
+	unsigned long block;
+
+	if (flush_all(v) == -1) return -1;
+	block = position / image->block_size;
+	while (block < image->block_count && image->index[block].length == 0) block++;
+	*data_start = (off_t)block * image->block_size;
+	while (block < image->block_count && image->index[block].length != 0) block++;
+	*data_end = (off_t)block * image->block_size;
+
+	if (*data_start < position) *data_start = position;
+	if (*data_start > end) *data_start = end;
+	if (*data_end > end) *data_end = end;
+	return 0;
+}
+
+static void compressed_image_free(compressed_image *image) {
+	int i;
+
+	for (i = 0; i < COMPRESSED_CACHE_BLOCKS; i++) free(image->cache[i].data);
+	free(image->compressed);
+	free(image->index);
+	free(image);
+}
+
+static int compressed_image_close(volume_container *v) {
+	int res = 0;
+
+	if (((compressed_image *)v->data.image.state)->writeable) res = compressed_image_sync(v);
+	compressed_image_free(v->data.image.state);
+	close(v->data.image.fd);
+	return res;
+}
+
+/* Set up the container for an open compressed image file, whose index is read
+in from the file unless it is newly created */
+static int compressed_image_init(volume_container *v, int fd, int writeable, int created,
+	unsigned long block_size, unsigned int bytes_per_sector, unsigned long long sector_count) {
+	compressed_image *image;
+	unsigned char *buf;
+	unsigned long i;
+	struct stat file_stat;
+
+	image = calloc(1, sizeof(compressed_image));
+	if (!image) {
+		fprintf(stderr, "Out of memory opening compressed image\n");
+		return -1;
+	}
+	image->writeable = writeable;
+	image->block_size = block_size;
+	image->block_count = (sector_count * bytes_per_sector + block_size - 1) / block_size;
+	image->index_dirty_first = image->block_count;
+	image->index_dirty_last = 0;
+	image->compressed_size = compressBound(block_size);
+	image->index = calloc(image->block_count ? image->block_count : 1, sizeof(compressed_index_entry));
+	image->compressed = malloc(image->compressed_size);
+	for (i = 0; i < COMPRESSED_CACHE_BLOCKS; i++) {
+		image->cache[i].block = NO_BLOCK;
+		image->cache[i].data = malloc(block_size);
+	}
+	for (i = 0; i < COMPRESSED_CACHE_BLOCKS; i++) {
+		if (!image->cache[i].data) break;
+	}
+	if (!image->index || !image->compressed || i < COMPRESSED_CACHE_BLOCKS) {
+		fprintf(stderr, "Out of memory opening compressed image\n");
+		compressed_image_free(image);
+		return -1;
+	}
+
+	if (!created) {
+		buf = malloc(image->block_count * COMPRESSED_INDEX_ENTRY_SIZE + 1);
+		if (!buf) {
+			fprintf(stderr, "Out of memory opening compressed image\n");
+			compressed_image_free(image);
+			return -1;
+		}
+		if (read_fully(fd, buf, image->block_count * COMPRESSED_INDEX_ENTRY_SIZE, COMPRESSED_HEADER_SIZE) == -1) {
+			free(buf);
+			compressed_image_free(image);
+			return -1;
+		}
+		for (i = 0; i < image->block_count; i++) {
+			image->index[i].offset = get_le64(buf + i * COMPRESSED_INDEX_ENTRY_SIZE);
+			image->index[i].length = get_le32(buf + i * COMPRESSED_INDEX_ENTRY_SIZE + 8);
+		}
+		free(buf);
+	}
+	if ( fstat(fd, &file_stat) == -1 ) {
+		perror("fstat() error");
+		compressed_image_free(image);
+		return -1;
+	}
+	image->file_end = file_stat.st_size;
+
+	v->data.image.fd = fd;
+	v->data.image.state = image;
+	v->bytes_per_sector = bytes_per_sector;
+	v->sector_count = sector_count;
+	v->read = &compressed_image_read;
+	v->write = &compressed_image_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &compressed_image_close;
+	v->sync = &compressed_image_sync;
+	v->find_data = &compressed_image_find_data;
+	return 0;
+}
+
+int compressed_image_open(volume_container *v, char *pathname, int writeable) {
+	int fd;
+	unsigned char header[COMPRESSED_HEADER_SIZE];
+	unsigned long block_size, bytes_per_sector;
+	unsigned long long sector_count;
+
+	if (writeable) {
+		if ( (fd = open(pathname, O_RDWR | O_BINARY)) == -1 ) {
+			perror("open() (RDWR) error");
+			return -1;
+		}
+	} else {
+		if ( (fd = open(pathname, O_RDONLY | O_BINARY)) == -1 ) {
+			perror("open() (RDONLY) error");
+			return -1;
+		}
+	}
+	if (read_fully(fd, header, COMPRESSED_HEADER_SIZE, 0) == -1) {
+		close(fd);
+		return -1;
+	}
+	block_size = get_le32(header + 0x0c);
+	bytes_per_sector = get_le32(header + 0x10);
+	sector_count = get_le64(header + 0x18);
+	if (memcmp(header, compressed_signature, COMPRESSED_SIGNATURE_LENGTH) != 0
+		|| get_le32(header + 0x08) != COMPRESSED_VERSION
+		|| bytes_per_sector == 0 || block_size == 0 || block_size % bytes_per_sector != 0) {
+		fprintf(stderr, "Unsupported compressed image format\n");
+		close(fd);
+		return -1;
+	}
+	if (compressed_image_init(v, fd, writeable, 0, block_size, bytes_per_sector, sector_count) == -1) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+int compressed_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector) {
+	int fd;
+	unsigned char header[COMPRESSED_HEADER_SIZE];
+	unsigned long long block_count;
+
+	if ( (fd = open(pathname,
+			O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 ) {
+		perror("open() (RDWR) error");
+		return -1;
+	}
+
+	memset(header, 0, COMPRESSED_HEADER_SIZE);
+	memcpy(header, compressed_signature, COMPRESSED_SIGNATURE_LENGTH);
+	put_le32(header + 0x08, COMPRESSED_VERSION);
+	put_le32(header + 0x0c, COMPRESSED_BLOCK_SIZE);
+	put_le32(header + 0x10, bytes_per_sector);
+	put_le64(header + 0x18, sector_count);
+	if (write_fully(fd, header, COMPRESSED_HEADER_SIZE, 0) == -1) {
+		close(fd);
+		return -1;
+	}
+	/* an index of zeroes says that every block is empty */
+	block_count = (sector_count * bytes_per_sector + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+	if ( ftruncate(fd, COMPRESSED_HEADER_SIZE + (off_t)block_count * COMPRESSED_INDEX_ENTRY_SIZE) == -1 ) {
+		perror("ftruncate() error");
+		close(fd);
+		return -1;
+	}
+
+	if (compressed_image_init(v, fd, 1, 1, COMPRESSED_BLOCK_SIZE, bytes_per_sector, sector_count) == -1) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+int compressed_image_open(volume_container *v, char *pathname, int writeable) {
+	fprintf(stderr, "Compressed images are not supported in this build (zlib not found)\n");
+	return -1;
+}
+
+int compressed_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector) {
+	fprintf(stderr, "Compressed images are not supported in this build (zlib not found)\n");
+	return -1;
+}
+
+#endif
+
+int image_file_is_compressed(char *pathname) {
+	int fd;
+	char actual_signature[COMPRESSED_SIGNATURE_LENGTH];
+
+	if ( (fd = open(pathname, O_RDONLY | O_BINARY)) == -1 ) {
+		return 0;
+	}
+	if (read(fd, actual_signature, COMPRESSED_SIGNATURE_LENGTH) != COMPRESSED_SIGNATURE_LENGTH) {
+		close(fd);
+		return 0; /* EOF or error */
+	}
+	close(fd);
+	return (memcmp(compressed_signature, actual_signature, COMPRESSED_SIGNATURE_LENGTH) == 0);
+}
@@ -0,0 +1,10 @@
+#ifndef __COMPRESSED_IMAGE_H
+#define __COMPRESSED_IMAGE_H
+
+#include "volume_container.h"
+
+int compressed_image_open(volume_container *v, char *pathname, int writeable);
+int compressed_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector);
+int image_file_is_compressed(char *pathname);
+
+#endif /* #ifdef __COMPRESSED_IMAGE_H */
@@ -0,0 +1,854 @@
+/* Deduplicating image store.
+
+A store is a directory holding a pool of fixed-size chunks shared between any
+number of images, where each distinct chunk is kept only once however many
+images (or places in one image) contain it. It consists of two files:
+
+	chunks	signature "HDFMP\x1a\0\0", format version (4 bytes) and chunk size
+		(4 bytes), padded out to DEDUP_POOL_HEADER_SIZE; then the chunks
+		one after another, numbered from 1
+	hashes	the hash of each chunk in turn (8 bytes each)
+
+An image in the store is an index file, which may live anywhere:
+
+	0x000	signature "HDFMD\x1a\0\0"
+	0x008	format version (4 bytes)
+	0x00c	bytes per sector (4 bytes)
+	0x010	sector count (8 bytes)
+	0x018	chunk size (4 bytes)
+	0x01c	length of the store's pathname (4 bytes)
+	0x020	store pathname, up to DEDUP_INDEX_HEADER_SIZE
+	0x1000	for each chunk of the volume, the number of the pool chunk holding
+		its contents (8 bytes), or 0 for a chunk of zeroes
+
+All values are little-endian. Chunks are looked up by hash and compared in full
+before being shared, so a hash collision can only cost space. Nothing is ever
+removed from the pool: a chunk that is no longer used by any image stays where
+it is, and shows up in the report as space that could be reclaimed. Only one
+process should write to a store at a time. */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "volume_container.h"
+#include "dedup_image.h"
+#include "image_util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static char *dedup_pool_signature = "HDFMP\x1a\0\0";
+static char *dedup_index_signature = "HDFMD\x1a\0\0";
+#define DEDUP_SIGNATURE_LENGTH 8
+#define DEDUP_VERSION 1
+#define DEDUP_POOL_HEADER_SIZE 0x1000
+#define DEDUP_INDEX_HEADER_SIZE 0x1000
+#define DEDUP_PATH_OFFSET 0x20
+#define DEDUP_MAX_PATH (DEDUP_INDEX_HEADER_SIZE - DEDUP_PATH_OFFSET)
+#define DEDUP_HASH_SIZE 8
+#define DEDUP_INDEX_ENTRY_SIZE 8
+/* One cluster on most volumes, so that identical files line up */
+#define DEDUP_CHUNK_SIZE 4096
+/* Number of chunks being modified that are kept in memory */
+#define DEDUP_CACHE_CHUNKS 64
+
+/* Open-addressed hash table from chunk hash to chunk number */
+typedef struct st_dedup_slot {
+	unsigned long long hash;
+	unsigned long long chunk; /* 0 for an empty slot */
+} dedup_slot;
+
+typedef struct st_dedup_pool {
+	int chunks_fd;
+	int hashes_fd;
+	unsigned long chunk_size;
+	unsigned long long chunk_count;
+	dedup_slot *slots; /* only built if the pool is writeable */
+	unsigned long slot_count; /* a power of two */
+	unsigned char *compare_buf; /* one chunk, for checking matches */
+	unsigned long long chunks_added; /* since the pool was opened */
+	unsigned long long chunks_shared;
+} dedup_pool;
+
+typedef struct st_dedup_cache_chunk {
+	unsigned long chunk; /* chunk of the volume held, or NO_CHUNK */
+	int dirty;
+	unsigned long last_used;
+	unsigned char *data;
+} dedup_cache_chunk;
+
+#define NO_CHUNK ((unsigned long)-1)
+
+typedef struct st_dedup_image {
+	int writeable;
+	dedup_pool *pool;
+	unsigned long chunk_size;
+	unsigned long chunk_count;
+	unsigned long long *index;
+	unsigned long index_dirty_first; /* range of index entries to write back */
+	unsigned long index_dirty_last;
+	dedup_cache_chunk cache[DEDUP_CACHE_CHUNKS];
+	unsigned long use_counter;
+} dedup_image;
+
+/* 64-bit hash of a chunk, a multiply-and-rotate mix taken eight bytes at a
+time; chunk sizes are always a multiple of eight */
+static unsigned long long chunk_hash(unsigned char *data, size_t length) {
+	unsigned long long h = 0x9e3779b97f4a7c15ULL ^ length, w;
+	size_t i;
+
+	for (i = 0; i < length; i += 8) {
+		w = get_le64(data + i) * 0x87c37b91114253d5ULL;
+		w = (w << 31) | (w >> 33);
+		h ^= w * 0x4cf5ad432745937fULL;
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static char *store_file_pathname(char *store_pathname, char *name) {
+	char *pathname = malloc(strlen(store_pathname) + strlen(name) + 2);
+
+	if (!pathname) {
+		fprintf(stderr, "Out of memory opening store\n");
+		return NULL;
+	}
+	sprintf(pathname, "%s/%s", store_pathname, name);
+	return pathname;
+}
+
+static int pool_insert(dedup_pool *pool, unsigned long long hash, unsigned long long chunk) {
+	dedup_slot *old_slots = pool->slots;
+	unsigned long old_count = pool->slot_count, i;
+
+	/* keep the table no more than half full */
+	if ((chunk + 1) * 2 > pool->slot_count) {
+		pool->slot_count = pool->slot_count ? pool->slot_count * 2 : 1024;
+		pool->slots = calloc(pool->slot_count, sizeof(dedup_slot));
+		if (!pool->slots) {
+			pool->slots = old_slots;
+			pool->slot_count = old_count;
+			fprintf(stderr, "Out of memory indexing store\n");
+			return -1;
+		}
+		for (i = 0; i < old_count; i++) {
+			if (old_slots[i].chunk != 0) pool_insert(pool, old_slots[i].hash, old_slots[i].chunk);
+		}
+		free(old_slots);
+	}
+
+	i = hash & (pool->slot_count - 1);
+	while (pool->slots[i].chunk != 0) i = (i + 1) & (pool->slot_count - 1);
+	pool->slots[i].hash = hash;
+	pool->slots[i].chunk = chunk;
+	return 0;
+}
+
+static void pool_close(dedup_pool *pool) {
+	if (pool->chunks_fd != -1) close(pool->chunks_fd);
+	if (pool->hashes_fd != -1) close(pool->hashes_fd);
+	free(pool->slots);
+	free(pool->compare_buf);
+	free(pool);
+}
+
+/* Open the pool in the store directory at store_pathname. If chunk_size is
+non-zero, the store is created if it doesn't exist yet, and must use chunks of
+that size */
+static dedup_pool *pool_open(char *store_pathname, int writeable, unsigned long chunk_size) {
+	dedup_pool *pool;
+	char *chunks_pathname, *hashes_pathname;
+	unsigned char header[DEDUP_POOL_HEADER_SIZE];
+	unsigned char *hashes;
+	struct stat chunks_stat, hashes_stat;
+	int flags = writeable ? O_RDWR | O_BINARY : O_RDONLY | O_BINARY;
+	unsigned long long i;
+
+	if (chunk_size != 0) {
+		flags |= O_CREAT;
+#ifdef COMPAT_WIN32
+		if ( mkdir(store_pathname) == -1 && errno != EEXIST ) {
+#else
+		if ( mkdir(store_pathname, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST ) {
+#endif
+			perror("mkdir() error");
+			return NULL;
+		}
+	}
+
+	pool = calloc(1, sizeof(dedup_pool));
+	if (!pool) {
+		fprintf(stderr, "Out of memory opening store\n");
+		return NULL;
+	}
+	pool->chunks_fd = -1;
+	pool->hashes_fd = -1;
+
+	chunks_pathname = store_file_pathname(store_pathname, "chunks");
+	hashes_pathname = store_file_pathname(store_pathname, "hashes");
+	if (chunks_pathname && hashes_pathname) {
+		pool->chunks_fd = open(chunks_pathname, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (pool->chunks_fd == -1) {
+			perror(chunks_pathname);
+		} else {
+			pool->hashes_fd = open(hashes_pathname, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (pool->hashes_fd == -1) perror(hashes_pathname);
+		}
+	}
+	free(chunks_pathname);
+	free(hashes_pathname);
+	if (pool->hashes_fd == -1) {
+		pool_close(pool);
+		return NULL;
+	}
+
+	if ( fstat(pool->chunks_fd, &chunks_stat) == -1 || fstat(pool->hashes_fd, &hashes_stat) == -1 ) {
+		perror("fstat() error");
+		pool_close(pool);
+		return NULL;
+	}
+
+	if (chunks_stat.st_size == 0 && chunk_size != 0) {
+		/* new store */
+		memset(header, 0, DEDUP_POOL_HEADER_SIZE);
+		memcpy(header, dedup_pool_signature, DEDUP_SIGNATURE_LENGTH);
+		put_le32(header + 0x08, DEDUP_VERSION);
+		put_le32(header + 0x0c, chunk_size);
+		if (write_fully(pool->chunks_fd, header, DEDUP_POOL_HEADER_SIZE, 0) == -1) {
+			pool_close(pool);
+			return NULL;
+		}
+		chunks_stat.st_size = DEDUP_POOL_HEADER_SIZE;
+	} else {
+		if (read_fully(pool->chunks_fd, header, DEDUP_POOL_HEADER_SIZE, 0) == -1) {
+			pool_close(pool);
+			return NULL;
+		}
+		if (memcmp(header, dedup_pool_signature, DEDUP_SIGNATURE_LENGTH) != 0
+			|| get_le32(header + 0x08) != DEDUP_VERSION || get_le32(header + 0x0c) == 0
+			|| get_le32(header + 0x0c) % 8 != 0) {
+			fprintf(stderr, "Unsupported store format\n");
+			pool_close(pool);
+			return NULL;
+		}
+		if (chunk_size != 0 && get_le32(header + 0x0c) != chunk_size) {
+			fprintf(stderr, "Store uses a different chunk size\n");
+			pool_close(pool);
+			return NULL;
+		}
+	}
+	pool->chunk_size = get_le32(header + 0x0c);
+
+	/* a chunk without a hash, or the other way round, was left by an
+	interrupted write and will be overwritten */
+	pool->chunk_count = (chunks_stat.st_size - DEDUP_POOL_HEADER_SIZE) / pool->chunk_size;
+	if (pool->chunk_count > (unsigned long long)(hashes_stat.st_size / DEDUP_HASH_SIZE)) {
+		pool->chunk_count = hashes_stat.st_size / DEDUP_HASH_SIZE;
+	}
+
+	if (writeable) {
+		pool->compare_buf = malloc(pool->chunk_size);
+		hashes = malloc(pool->chunk_count * DEDUP_HASH_SIZE + 1);
+		if (!pool->compare_buf || !hashes) {
+			fprintf(stderr, "Out of memory opening store\n");
+			free(hashes);
+			pool_close(pool);
+			return NULL;
+		}
+		if (read_fully(pool->hashes_fd, hashes, pool->chunk_count * DEDUP_HASH_SIZE, 0) == -1) {
+			free(hashes);
+			pool_close(pool);
+			return NULL;
+		}
+		for (i = 0; i < pool->chunk_count; i++) {
+			if (pool_insert(pool, get_le64(hashes + i * DEDUP_HASH_SIZE), i + 1) == -1) {
+				free(hashes);
+				pool_close(pool);
+				return NULL;
+			}
+		}
+		free(hashes);
+	}
+	return pool;
+}
+
+static off_t pool_chunk_offset(dedup_pool *pool, unsigned long long chunk) {
+	return DEDUP_POOL_HEADER_SIZE + (off_t)(chunk - 1) * pool->chunk_size;
+}
+
+/* Find the pool chunk with the given contents, adding it if there isn't one;
+chunks of zeroes aren't stored, and come back as chunk 0 */
+static int pool_store(dedup_pool *pool, unsigned char *data, unsigned long long *chunk) {
+	unsigned long long hash;
+	unsigned char hash_buf[DEDUP_HASH_SIZE];
+	unsigned long i;
+
+	if (buffer_is_zero(data, pool->chunk_size)) {
+		*chunk = 0;
+		return 0;
+	}
+
+	hash = chunk_hash(data, pool->chunk_size);
+	for (i = hash & (pool->slot_count - 1); pool->slot_count != 0 && pool->slots[i].chunk != 0; i = (i + 1) & (pool->slot_count - 1)) {
+		if (pool->slots[i].hash != hash) continue;
+		if (read_fully(pool->chunks_fd, pool->compare_buf, pool->chunk_size,
+			pool_chunk_offset(pool, pool->slots[i].chunk)) == -1) return -1;
+		if (memcmp(pool->compare_buf, data, pool->chunk_size) == 0) {
+			pool->chunks_shared++;
+			*chunk = pool->slots[i].chunk;
+			return 0;
+		}
+	}
+
+	/* the chunk goes in before its hash, so that the hash never refers to
+	something that isn't there */
+	put_le64(hash_buf, hash);
+	if (write_fully(pool->chunks_fd, data, pool->chunk_size, pool_chunk_offset(pool, pool->chunk_count + 1)) == -1
+		|| write_fully(pool->hashes_fd, hash_buf, DEDUP_HASH_SIZE, (off_t)pool->chunk_count * DEDUP_HASH_SIZE) == -1
+		|| pool_insert(pool, hash, pool->chunk_count + 1) == -1) return -1;
+	pool->chunk_count++;
+	pool->chunks_added++;
+	*chunk = pool->chunk_count;
+	return 0;
+}
+
+/* Write out the index entries that have changed since the last time */
+static int write_index(volume_container *v) {
+	dedup_image *image = v->data.image.state;
+	unsigned long i, count;
+	unsigned char *buf;
+	int res;
+
+	if (image->index_dirty_first > image->index_dirty_last) return 0;
+	count = image->index_dirty_last - image->index_dirty_first + 1;
+	buf = malloc(count * DEDUP_INDEX_ENTRY_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Out of memory writing deduplicated image index\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		put_le64(buf + i * DEDUP_INDEX_ENTRY_SIZE, image->index[image->index_dirty_first + i]);
+	}
+	res = write_fully(v->data.image.fd, buf, count * DEDUP_INDEX_ENTRY_SIZE,
+		DEDUP_INDEX_HEADER_SIZE + (off_t)image->index_dirty_first * DEDUP_INDEX_ENTRY_SIZE);
+	free(buf);
+	if (res == -1) return -1;
+
+	image->index_dirty_first = image->chunk_count;
+	image->index_dirty_last = 0;
+	return 0;
+}
+
+/* Point a chunk of the volume at the pool chunk holding the given contents */
+static int set_chunk(dedup_image *image, unsigned long chunk, unsigned char *data) {
+	if (pool_store(image->pool, data, &image->index[chunk]) == -1) return -1;
+	if (chunk < image->index_dirty_first) image->index_dirty_first = chunk;
+	if (chunk > image->index_dirty_last) image->index_dirty_last = chunk;
+	return 0;
+}
+
+static int flush_all(dedup_image *image) {
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) {
+		if (!image->cache[i].dirty) continue;
+		if (set_chunk(image, image->cache[i].chunk, image->cache[i].data) == -1) return -1;
+		image->cache[i].dirty = 0;
+	}
+	return 0;
+}
+
+static dedup_cache_chunk *find_cached(dedup_image *image, unsigned long chunk) {
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) {
+		if (image->cache[i].chunk == chunk) return &image->cache[i];
+	}
+	return NULL;
+}
+
+/* Bring a chunk of the volume into the cache to be modified, evicting the
+least recently used one */
+static dedup_cache_chunk *get_chunk(dedup_image *image, unsigned long chunk) {
+	dedup_cache_chunk *c = NULL;
+	unsigned long long pool_chunk = image->index[chunk];
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) {
+		if (image->cache[i].chunk == chunk) {
+			c = &image->cache[i];
+			c->last_used = ++image->use_counter;
+			return c;
+		}
+		if (c == NULL || image->cache[i].last_used < c->last_used) c = &image->cache[i];
+	}
+
+	if (c->dirty) {
+		if (set_chunk(image, c->chunk, c->data) == -1) return NULL;
+		c->dirty = 0;
+	}
+	c->chunk = NO_CHUNK;
+
+	if (pool_chunk == 0) {
+		memset(c->data, 0, image->chunk_size);
+	} else {
+		if (read_fully(image->pool->chunks_fd, c->data, image->chunk_size,
+			pool_chunk_offset(image->pool, pool_chunk)) == -1) return NULL;
+	}
+	c->chunk = chunk;
+	c->last_used = ++image->use_counter;
+	return c;
+}
+
+static ssize_t dedup_image_read(volume_container *v, off_t position, void *buf, size_t count) {
+	dedup_image *image = v->data.image.state;
+	dedup_cache_chunk *c;
+	size_t done = 0, offset, len;
+	unsigned long chunk;
+	unsigned long long pool_chunk;
+
+	while (done < count) {
+		chunk = (position + done) / image->chunk_size;
+		offset = (position + done) % image->chunk_size;
+		len = image->chunk_size - offset;
+		if (len > count - done) len = count - done;
+
+		c = find_cached(image, chunk);
+		pool_chunk = image->index[chunk];
+		if (c != NULL) {
+			memcpy((char *)buf + done, c->data + offset, len);
+		} else if (pool_chunk == 0) {
+			memset((char *)buf + done, 0, len);
+		} else {
+			/* chunks that were added to the pool in order can be read in
+			one go */
+			while (done + len < count && chunk + 1 < image->chunk_count
+				&& image->index[chunk + 1] == pool_chunk + 1 && find_cached(image, chunk + 1) == NULL) {
+				chunk++;
+				pool_chunk++;
+				len += (count - done - len > image->chunk_size) ? image->chunk_size : count - done - len;
+			}
+			if (read_fully(image->pool->chunks_fd, (char *)buf + done, len,
+				pool_chunk_offset(image->pool, image->index[(position + done) / image->chunk_size]) + offset) == -1) return -1;
+		}
+		done += len;
+	}
+	return done;
+}
+
+static ssize_t dedup_image_write(volume_container *v, off_t position, void *buf, size_t count) {
+	dedup_image *image = v->data.image.state;
+	dedup_cache_chunk *c;
+	size_t done = 0, offset, len;
+	unsigned long chunk;
+
+	if (!image->writeable) {
+		fprintf(stderr, "Deduplicated image is open read-only\n");
+		return -1;
+	}
+	while (done < count) {
+		chunk = (position + done) / image->chunk_size;
+		offset = (position + done) % image->chunk_size;
+		len = image->chunk_size - offset;
+		if (len > count - done) len = count - done;
+
+		if (len == image->chunk_size) {
+			/* the whole chunk is being replaced, so there's no need to
+			hold on to it */
+			c = find_cached(image, chunk);
+			if (c != NULL) {
+				c->chunk = NO_CHUNK;
+				c->dirty = 0;
+			}
+			if (set_chunk(image, chunk, (unsigned char *)buf + done) == -1) return -1;
+		} else {
+			c = get_chunk(image, chunk);
+			if (c == NULL) return -1;
+			memcpy(c->data + offset, (char *)buf + done, len);
+			c->dirty = 1;
+		}
+		done += len;
+	}
+	return done;
+}
+
+static int dedup_image_sync(volume_container *v) {
+	if (flush_all(v->data.image.state) == -1) return -1;
+	return write_index(v);
+}
+
+/* Chunks of zeroes take no space in the store, and count as holes */
+static int dedup_image_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	dedup_image *image = v->data.image.state;
+	off_t end = (off_t)v->sector_count * v->bytes_per_sector;
+	unsigned long chunk;
+
+	if (flush_all(image) == -1) return -1;
+	chunk = position / image->chunk_size;
+	while (chunk < image->chunk_count && image->index[chunk] == 0) chunk++;
+	*data_start = (off_t)chunk * image->chunk_size;
+	while (chunk < image->chunk_count && image->index[chunk] != 0) chunk++;
+	*data_end = (off_t)chunk * image->chunk_size;
+
+	if (*data_start < position) *data_start = position;
+	if (*data_start > end) *data_start = end;
+	if (*data_end > end) *data_end = end;
+	return 0;
+}
+
+static void dedup_image_free(dedup_image *image) {
+	int i;
+
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) free(image->cache[i].data);
+	if (image->pool) pool_close(image->pool);
+	free(image->index);
+	free(image);
+}
+
+static int dedup_image_close(volume_container *v) {
+	int res = 0;
+
+	if (((dedup_image *)v->data.image.state)->writeable) res = dedup_image_sync(v);
+	dedup_image_free(v->data.image.state);
+	close(v->data.image.fd);
+	return res;
+}
+
+/* Read the header of an index file, returning the bytes per sector, sector
+count and chunk size, and the store pathname as a newly allocated string */
+static int read_index_header(int fd, unsigned long *bytes_per_sector, unsigned long long *sector_count,
+	unsigned long *chunk_size, char **store_pathname) {
+	unsigned char header[DEDUP_INDEX_HEADER_SIZE];
+	unsigned long length;
+
+	if (read_fully(fd, header, DEDUP_INDEX_HEADER_SIZE, 0) == -1) return -1;
+	*bytes_per_sector = get_le32(header + 0x0c);
+	*sector_count = get_le64(header + 0x10);
+	*chunk_size = get_le32(header + 0x18);
+	length = get_le32(header + 0x1c);
+	if (memcmp(header, dedup_index_signature, DEDUP_SIGNATURE_LENGTH) != 0
+		|| get_le32(header + 0x08) != DEDUP_VERSION
+		|| *bytes_per_sector == 0 || *chunk_size == 0 || *chunk_size % *bytes_per_sector != 0
+		|| length >= DEDUP_MAX_PATH) {
+		fprintf(stderr, "Unsupported deduplicated image format\n");
+		return -1;
+	}
+	*store_pathname = malloc(length + 1);
+	if (!*store_pathname) {
+		fprintf(stderr, "Out of memory opening deduplicated image\n");
+		return -1;
+	}
+	memcpy(*store_pathname, header + DEDUP_PATH_OFFSET, length);
+	(*store_pathname)[length] = '\0';
+	return 0;
+}
+
+/* Read an index file's entries into a newly allocated array */
+static unsigned long long *read_index(int fd, unsigned long chunk_count) {
+	unsigned long long *index;
+	unsigned char *buf;
+	unsigned long i;
+
+	index = calloc(chunk_count ? chunk_count : 1, sizeof(unsigned long long));
+	buf = malloc(chunk_count * DEDUP_INDEX_ENTRY_SIZE + 1);
+	if (!index || !buf) {
+		fprintf(stderr, "Out of memory opening deduplicated image\n");
+		free(index);
+		free(buf);
+		return NULL;
+	}
+	if (read_fully(fd, buf, chunk_count * DEDUP_INDEX_ENTRY_SIZE, DEDUP_INDEX_HEADER_SIZE) == -1) {
+		free(index);
+		free(buf);
+		return NULL;
+	}
+	for (i = 0; i < chunk_count; i++) {
+		index[i] = get_le64(buf + i * DEDUP_INDEX_ENTRY_SIZE);
+	}
+	free(buf);
+	return index;
+}
+
+/* Set up the container for an open index file, whose entries are read in from
+the file unless it is newly created */
+static int dedup_image_init(volume_container *v, int fd, int writeable, int created, dedup_pool *pool,
+	unsigned int bytes_per_sector, unsigned long long sector_count) {
+	dedup_image *image;
+	unsigned long i;
+
+	image = calloc(1, sizeof(dedup_image));
+	if (!image) {
+		fprintf(stderr, "Out of memory opening deduplicated image\n");
+		pool_close(pool);
+		return -1;
+	}
+	image->writeable = writeable;
+	image->pool = pool;
+	image->chunk_size = pool->chunk_size;
+	image->chunk_count = (sector_count * bytes_per_sector + pool->chunk_size - 1) / pool->chunk_size;
+	image->index_dirty_first = image->chunk_count;
+	image->index_dirty_last = 0;
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) {
+		image->cache[i].chunk = NO_CHUNK;
+		image->cache[i].data = malloc(pool->chunk_size);
+	}
+	for (i = 0; i < DEDUP_CACHE_CHUNKS; i++) {
+		if (!image->cache[i].data) break;
+	}
+	if (i < DEDUP_CACHE_CHUNKS) {
+		fprintf(stderr, "Out of memory opening deduplicated image\n");
+		dedup_image_free(image);
+		return -1;
+	}
+
+	if (created) {
+		image->index = calloc(image->chunk_count ? image->chunk_count : 1, sizeof(unsigned long long));
+		if (!image->index) fprintf(stderr, "Out of memory opening deduplicated image\n");
+	} else {
+		image->index = read_index(fd, image->chunk_count);
+	}
+	if (!image->index) {
+		dedup_image_free(image);
+		return -1;
+	}
+	for (i = 0; i < image->chunk_count; i++) {
+		if (image->index[i] > pool->chunk_count) {
+			fprintf(stderr, "Deduplicated image refers to chunks missing from its store\n");
+			dedup_image_free(image);
+			return -1;
+		}
+	}
+
+	v->data.image.fd = fd;
+	v->data.image.state = image;
+	v->bytes_per_sector = bytes_per_sector;
+	v->sector_count = sector_count;
+	v->read = &dedup_image_read;
+	v->write = &dedup_image_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &dedup_image_close;
+	v->sync = &dedup_image_sync;
+	v->find_data = &dedup_image_find_data;
+	return 0;
+}
+
+int dedup_image_open(volume_container *v, char *pathname, int writeable) {
+	int fd;
+	unsigned long bytes_per_sector, chunk_size;
+	unsigned long long sector_count;
+	char *store_pathname;
+	dedup_pool *pool;
+
+	if ( (fd = open(pathname, writeable ? O_RDWR | O_BINARY : O_RDONLY | O_BINARY)) == -1 ) {
+		perror(writeable ? "open() (RDWR) error" : "open() (RDONLY) error");
+		return -1;
+	}
+	if (read_index_header(fd, &bytes_per_sector, &sector_count, &chunk_size, &store_pathname) == -1) {
+		close(fd);
+		return -1;
+	}
+	pool = pool_open(store_pathname, writeable, 0);
+	free(store_pathname);
+	if (pool == NULL) {
+		close(fd);
+		return -1;
+	}
+	if (pool->chunk_size != chunk_size) {
+		fprintf(stderr, "Deduplicated image doesn't match its store\n");
+		pool_close(pool);
+		close(fd);
+		return -1;
+	}
+	if (dedup_image_init(v, fd, writeable, 0, pool, bytes_per_sector, sector_count) == -1) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Create a new, empty image as the index file at pathname, keeping its
+contents in the store at store_pathname, which is created if necessary */
+int dedup_image_create(volume_container *v, char *pathname, char *store_pathname, unsigned long long sector_count, unsigned int bytes_per_sector) {
+	int fd;
+	unsigned char header[DEDUP_INDEX_HEADER_SIZE];
+	unsigned long long chunk_count;
+	char *full_pathname;
+	size_t length;
+	dedup_pool *pool;
+
+	pool = pool_open(store_pathname, 1, DEDUP_CHUNK_SIZE);
+	if (pool == NULL) return -1;
+
+#ifdef COMPAT_WIN32
+	full_pathname = NULL;
+#else
+	/* record where the store is independently of the current directory */
+	full_pathname = realpath(store_pathname, NULL);
+#endif
+	if (full_pathname != NULL) store_pathname = full_pathname;
+	length = strlen(store_pathname);
+	if (length >= DEDUP_MAX_PATH) {
+		fprintf(stderr, "Store pathname is too long\n");
+		free(full_pathname);
+		pool_close(pool);
+		return -1;
+	}
+
+	memset(header, 0, DEDUP_INDEX_HEADER_SIZE);
+	memcpy(header, dedup_index_signature, DEDUP_SIGNATURE_LENGTH);
+	put_le32(header + 0x08, DEDUP_VERSION);
+	put_le32(header + 0x0c, bytes_per_sector);
+	put_le64(header + 0x10, sector_count);
+	put_le32(header + 0x18, pool->chunk_size);
+	put_le32(header + 0x1c, length);
+	memcpy(header + DEDUP_PATH_OFFSET, store_pathname, length);
+	free(full_pathname);
+
+	if ( (fd = open(pathname,
+			O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 ) {
+		perror("open() (RDWR) error");
+		pool_close(pool);
+		return -1;
+	}
+	if (write_fully(fd, header, DEDUP_INDEX_HEADER_SIZE, 0) == -1) {
+		pool_close(pool);
+		close(fd);
+		return -1;
+	}
+	/* an index of zeroes says that every chunk is empty */
+	chunk_count = (sector_count * bytes_per_sector + pool->chunk_size - 1) / pool->chunk_size;
+	if ( ftruncate(fd, DEDUP_INDEX_HEADER_SIZE + (off_t)chunk_count * DEDUP_INDEX_ENTRY_SIZE) == -1 ) {
+		perror("ftruncate() error");
+		pool_close(pool);
+		close(fd);
+		return -1;
+	}
+
+	if (dedup_image_init(v, fd, 1, 1, pool, bytes_per_sector, sector_count) == -1) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Report how many chunks written to the image so far were new to the store,
+and how many were already there */
+void dedup_image_counts(volume_container *v, unsigned long long *chunks_added, unsigned long long *chunks_shared) {
+	dedup_image *image = v->data.image.state;
+
+	*chunks_added = image->pool->chunks_added;
+	*chunks_shared = image->pool->chunks_shared;
+}
+
+/* Total up the space used by the given images, which must all belong to the
+same store */
+int dedup_image_report(char **pathnames, int count, dedup_report *report) {
+	int fd, i, res = -1;
+	unsigned long bytes_per_sector, chunk_size, chunk_count, j;
+	unsigned long long sector_count, *index;
+	char *store_pathname, *first_store_pathname = NULL;
+	dedup_pool *pool = NULL;
+	unsigned char *seen = NULL;
+
+	memset(report, 0, sizeof(dedup_report));
+	for (i = 0; i < count; i++) {
+		if ( (fd = open(pathnames[i], O_RDONLY | O_BINARY)) == -1 ) {
+			perror(pathnames[i]);
+			goto done;
+		}
+		if (read_index_header(fd, &bytes_per_sector, &sector_count, &chunk_size, &store_pathname) == -1) {
+			close(fd);
+			goto done;
+		}
+
+		if (first_store_pathname == NULL) {
+			first_store_pathname = store_pathname;
+			pool = pool_open(store_pathname, 0, 0);
+			if (pool == NULL) {
+				close(fd);
+				goto done;
+			}
+			report->chunk_size = pool->chunk_size;
+			report->pool_chunks = pool->chunk_count;
+			/* one bit for each pool chunk, to count each only once */
+			seen = calloc(pool->chunk_count / 8 + 1, 1);
+			if (!seen) {
+				fprintf(stderr, "Out of memory\n");
+				close(fd);
+				goto done;
+			}
+		} else {
+			res = strcmp(store_pathname, first_store_pathname);
+			free(store_pathname);
+			if (res != 0) {
+				fprintf(stderr, "%s belongs to a different store\n", pathnames[i]);
+				res = -1;
+				close(fd);
+				goto done;
+			}
+			res = -1;
+		}
+		if (chunk_size != report->chunk_size) {
+			fprintf(stderr, "%s doesn't match its store\n", pathnames[i]);
+			close(fd);
+			goto done;
+		}
+
+		chunk_count = (sector_count * bytes_per_sector + chunk_size - 1) / chunk_size;
+		index = read_index(fd, chunk_count);
+		close(fd);
+		if (index == NULL) goto done;
+		for (j = 0; j < chunk_count; j++) {
+			if (index[j] == 0) continue;
+			if (index[j] > pool->chunk_count) {
+				fprintf(stderr, "%s refers to chunks missing from its store\n", pathnames[i]);
+				free(index);
+				goto done;
+			}
+			report->chunks_used++;
+			if (!(seen[(index[j] - 1) / 8] & (1 << ((index[j] - 1) % 8)))) {
+				seen[(index[j] - 1) / 8] |= 1 << ((index[j] - 1) % 8);
+				report->chunks_unique++;
+			}
+		}
+		free(index);
+		report->image_count++;
+	}
+	res = 0;
+
+done:
+	free(first_store_pathname);
+	free(seen);
+	if (pool) pool_close(pool);
+	return res;
+}
+
+int image_file_is_dedup(char *pathname) {
+	int fd;
+	char actual_signature[DEDUP_SIGNATURE_LENGTH];
+
+	if ( (fd = open(pathname, O_RDONLY | O_BINARY)) == -1 ) {
+		return 0;
+	}
+	if (read(fd, actual_signature, DEDUP_SIGNATURE_LENGTH) != DEDUP_SIGNATURE_LENGTH) {
+		close(fd);
+		return 0; /* EOF or error */
+	}
+	close(fd);
+	return (memcmp(dedup_index_signature, actual_signature, DEDUP_SIGNATURE_LENGTH) == 0);
+}
@@ -0,0 +1,21 @@
+#ifndef __DEDUP_IMAGE_H
+#define __DEDUP_IMAGE_H
+
+#include "volume_container.h"
+
+/* Space taken up by a set of images in one store */
+typedef struct st_dedup_report {
+	int image_count;
+	unsigned long chunk_size;
+	unsigned long long chunks_used; /* non-zero chunks in all the images, counting repeats */
+	unsigned long long chunks_unique; /* distinct pool chunks that they refer to */
+	unsigned long long pool_chunks; /* chunks in the pool altogether */
+} dedup_report;
+
+int dedup_image_open(volume_container *v, char *pathname, int writeable);
+int dedup_image_create(volume_container *v, char *pathname, char *store_pathname, unsigned long long sector_count, unsigned int bytes_per_sector);
+void dedup_image_counts(volume_container *v, unsigned long long *chunks_added, unsigned long long *chunks_shared);
+int dedup_image_report(char **pathnames, int count, dedup_report *report);
+int image_file_is_dedup(char *pathname);
+
+#endif /* #ifdef __DEDUP_IMAGE_H */
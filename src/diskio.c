@@ -1,15 +1,54 @@
 /* Low-level disk operations required by the FAT driver */
 
+#include <config.h>
+
+#include <stdio.h>
 #include <fcntl.h>
 
 #include "diskio.h"
+#include "sector_cache.h"
+#include "readahead.h"
+#include "io_stats.h"
 
 static volume_container *volume_containers[8];
+static unsigned int cache_size = SECTOR_CACHE_DEFAULT_SIZE;
+static int cache_writeback = 0;
+static size_t readahead_window = 0;
+
+/* Set the number of sectors to be cached in front of each volume mapped from
+now on; 0 disables the cache */
+void disk_set_cache_size(unsigned int sector_count)
+{
+	cache_size = sector_count;
+}
+
+/* Choose whether the sector cache of volumes mapped from now on holds on to
+written sectors until the next CTRL_SYNC, rather than writing them through */
+void disk_set_writeback(int enabled)
+{
+	cache_writeback = enabled;
+}
+
+/* Set the number of bytes fetched at a time ahead of sequential reads from
+volumes mapped from now on; 0 disables readahead */
+void disk_set_readahead(size_t window)
+{
+	readahead_window = window;
+}
 
 /* Associate a volume_container structure with a drive number so that it can
-be addressed by the FAT driver */
+be addressed by the FAT driver. The volume is given a sector cache, with
+readahead behind it if chosen, which are disposed of when the volume is
+closed. With statistics enabled, what the FAT driver asks of the drive is
+counted too. */
 int disk_map(BYTE drive_number, volume_container *vol)
 {
+	char name[16];
+	
+	if (readahead_open(vol, readahead_window) == -1) return -1;
+	if (sector_cache_open(vol, cache_size, cache_writeback) == -1) return -1;
+	sprintf(name, "drive %d", drive_number);
+	if (io_stats_open(vol, name) == -1) return -1;
 	volume_containers[drive_number] = vol;
 	return 0;
 }
@@ -43,7 +82,7 @@ DRESULT disk_read (
 	BYTE drv,		/* Physical drive nmuber (0..) */
 	BYTE *buff,		/* Data buffer to store read data */
 	DWORD sector,	/* Sector address (LBA) */
-	BYTE count		/* Number of sectors to read (1..255) */
+	UINT count		/* Number of sectors to read */
 )
 {
 	volume_container *vol;
@@ -51,9 +90,9 @@ DRESULT disk_read (
 	size_t result;
 	
 	vol = volume_containers[drv];
-	size_requested = count * vol->bytes_per_sector;
+	size_requested = (size_t)count * vol->bytes_per_sector;
 	
-	result = vol->read(vol, sector * vol->bytes_per_sector, (void *)buff,
+	result = vol->read(vol, (off_t)sector * vol->bytes_per_sector, (void *)buff,
 		size_requested);
 	
 	if (result == size_requested) {
@@ -65,6 +104,72 @@ DRESULT disk_read (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Vectored Transfer                                                     */
+
+#define DISK_MAX_RUNS	16
+
+/* Perform a list of transfers, which may be scattered across the disk, as a
+single request to the volume container */
+static DRESULT disk_transfer_runs (
+	BYTE drv,				/* Physical drive nmuber (0..) */
+	const DISK_RUN *runs,	/* Sector runs to transfer */
+	UINT run_count,			/* Number of runs */
+	int writing				/* Nonzero to write rather than read */
+)
+{
+	volume_container *vol;
+	volume_io_run io_runs[DISK_MAX_RUNS];
+	size_t size_requested;
+	ssize_t result;
+	UINT i, n;
+	
+	vol = volume_containers[drv];
+	while (run_count) {
+		n = (run_count > DISK_MAX_RUNS) ? DISK_MAX_RUNS : run_count;
+		size_requested = 0;
+		for (i = 0; i < n; i++) {
+			io_runs[i].position = (off_t)runs[i].sector * vol->bytes_per_sector;
+			io_runs[i].buf = (void *)runs[i].buff;
+			io_runs[i].count = (size_t)runs[i].count * vol->bytes_per_sector;
+			size_requested += io_runs[i].count;
+		}
+		
+		if (writing) {
+			result = volume_writev(vol, io_runs, n);
+		} else {
+			result = volume_readv(vol, io_runs, n);
+		}
+		if (result < 0 || (size_t)result != size_requested) return RES_PARERR;
+		
+		runs += n;
+		run_count -= n;
+	}
+	return RES_OK;
+}
+
+DRESULT disk_readv (
+	BYTE drv,				/* Physical drive nmuber (0..) */
+	const DISK_RUN *runs,	/* Sector runs to read */
+	UINT run_count			/* Number of runs */
+)
+{
+	return disk_transfer_runs(drv, runs, run_count, 0);
+}
+
+#if _READONLY == 0
+DRESULT disk_writev (
+	BYTE drv,				/* Physical drive nmuber (0..) */
+	const DISK_RUN *runs,	/* Sector runs to write */
+	UINT run_count			/* Number of runs */
+)
+{
+	return disk_transfer_runs(drv, runs, run_count, 1);
+}
+#endif /* _READONLY */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
 
@@ -73,7 +178,7 @@ DRESULT disk_write (
 	BYTE drv,			/* Physical drive nmuber (0..) */
 	const BYTE *buff,	/* Data to be written */
 	DWORD sector,		/* Sector address (LBA) */
-	BYTE count			/* Number of sectors to write (1..255) */
+	UINT count			/* Number of sectors to write */
 )
 {
 	volume_container *vol;
@@ -81,9 +186,9 @@ DRESULT disk_write (
 	size_t result;
 	
 	vol = volume_containers[drv];
-	size_requested = count * vol->bytes_per_sector;
+	size_requested = (size_t)count * vol->bytes_per_sector;
 	
-	result = vol->write(vol, sector * vol->bytes_per_sector, (void *)buff,
+	result = vol->write(vol, (off_t)sector * vol->bytes_per_sector, (void *)buff,
 		size_requested);
 	
 	if (result == size_requested) {
@@ -107,13 +212,16 @@ DRESULT disk_ioctl (
 {
 	switch (ctrl) {
 		case CTRL_SYNC:
-			/* syncing happens automatically on write */
-			return RES_OK;
+			/* containers without a sync method write straight through */
+			if (volume_containers[drv]->sync == NULL) return RES_OK;
+			return (volume_containers[drv]->sync(volume_containers[drv]) == 0) ? RES_OK : RES_ERROR;
 		case GET_SECTOR_SIZE:
 			*((WORD *)buff) = volume_containers[drv]->bytes_per_sector;
 			return RES_OK;
 		case GET_SECTOR_COUNT:
-			*((DWORD *)buff) = volume_containers[drv]->sector_count;
+			/* FAT can't address more than 2^32 sectors; anything beyond goes unused */
+			*((DWORD *)buff) = (volume_containers[drv]->sector_count > 0xFFFFFFFFUL) ?
+				0xFFFFFFFFUL : (DWORD)volume_containers[drv]->sector_count;
 			return RES_OK;
 		case GET_BLOCK_SIZE:
 			*((DWORD *)buff) = 1;
@@ -23,20 +23,33 @@ typedef enum {
 } DRESULT;
 
 
+/* One run of consecutive sectors within a vectored transfer */
+typedef struct {
+	DWORD sector;	/* Sector address (LBA) */
+	DWORD count;	/* Number of sectors */
+	BYTE *buff;		/* Data buffer */
+} DISK_RUN;
+
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
 BOOL assign_drives (int argc, char *argv[]);
 DSTATUS disk_initialize (BYTE);
 DSTATUS disk_status (BYTE);
-DRESULT disk_read (BYTE, BYTE*, DWORD, BYTE);
+DRESULT disk_read (BYTE, BYTE*, DWORD, UINT);
+DRESULT disk_readv (BYTE, const DISK_RUN*, UINT);
 #if	_READONLY == 0
-DRESULT disk_write (BYTE, const BYTE*, DWORD, BYTE);
+DRESULT disk_write (BYTE, const BYTE*, DWORD, UINT);
+DRESULT disk_writev (BYTE, const DISK_RUN*, UINT);
 #endif
 DRESULT disk_ioctl (BYTE, BYTE, void*);
 
 /* Called by the top-level controlling program: associate a volume_container with a drive number */
 int disk_map(BYTE drive_number, volume_container *vol);
+void disk_set_cache_size(unsigned int sector_count);
+void disk_set_writeback(int enabled);
+void disk_set_readahead(size_t window);
 
 /* Disk Status Bits (DSTATUS) */
 
@@ -82,6 +82,10 @@
 #define sync fatfs_sync	/* rename function to avoid conflict with 'sync' in unistd.h */
 
 #include <ctype.h> /* for toupper() */
+#include <stdlib.h> /* for malloc() */
+#if _USE_FREE_MAP && defined(__SSE2__)
+#include <emmintrin.h> /* for building the free map a vector at a time */
+#endif
 
 /*--------------------------------------------------------------------------
 
@@ -144,6 +148,17 @@ static
 BYTE Drive;				/* Current drive */
 #endif
 
+#define FAT_RUN_BYTES	0x40000	/* Most FAT data read or written by one request */
+
+#if _USE_FAT_CACHE
+static
+DWORD FatCacheLimit;	/* Most memory a FAT may be held in (0:never held) */
+static
+DWORD FatCacheHeld;		/* Memory taken by FATs held so far */
+static
+DWORD FatCacheRefused;	/* Memory that FATs over the limit would have taken */
+#endif
+
 
 #if _USE_LFN == 1	/* LFN with static LFN working buffer */
 static
@@ -266,10 +281,18 @@ FRESULT move_window (
 				return FR_DISK_ERR;
 			fs->wflag = 0;
 			if (wsect < (fs->fatbase + fs->sects_fat)) {	/* In FAT area */
+				DISK_RUN run[4];
+				UINT n = 0;
 				BYTE nf;
 				for (nf = fs->n_fats; nf > 1; nf--) {	/* Refrect the change to all FAT copies */
 					wsect += fs->sects_fat;
-					disk_write(fs->drive, fs->win, wsect, 1);
+					run[n].sector = wsect;
+					run[n].count = 1;
+					run[n].buff = fs->win;
+					if (++n == 4 || nf == 2) {
+						disk_writev(fs->drive, run, n);	/* A failed copy is not an error, as ever */
+						n = 0;
+					}
 				}
 			}
 		}
@@ -287,6 +310,432 @@ FRESULT move_window (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT held in memory - Decode and encode FAT sectors                    */
+/*-----------------------------------------------------------------------*/
+#if _USE_FAT_CACHE
+
+static
+void decode_fat (
+	FATFS *fs,		/* File system object */
+	const BYTE *buf,	/* FAT data, starting at FAT sector sect */
+	DWORD sect,		/* First FAT sector in buf (always 0 on FAT12, which is decoded in one go) */
+	DWORD n			/* Number of sectors in buf */
+)
+{
+	DWORD k, kend, b, bytes, w;
+
+
+	bytes = n * SS(fs);
+	switch (fs->fs_type) {
+	case FS_FAT12 :
+		for (k = 0; k < fs->fat_entries; k++) {
+			b = k + k / 2;
+			w = buf[b];
+			if (b + 1 < bytes) w |= (WORD)buf[b + 1] << 8;	/* Last entry may be cut short */
+			fs->fat_table[k] = (k & 1) ? (w >> 4) : (w & 0xFFF);
+		}
+		break;
+
+	case FS_FAT16 :
+		kend = (sect * SS(fs) + bytes) / 2;
+		for (k = sect * SS(fs) / 2; k < kend; k++, buf += 2)
+			fs->fat_table[k] = LD_WORD(buf);
+		break;
+
+	case FS_FAT32 :
+		kend = (sect * SS(fs) + bytes) / 4;
+		for (k = sect * SS(fs) / 4; k < kend; k++, buf += 4)
+			fs->fat_table[k] = LD_DWORD(buf);
+		break;
+	}
+}
+
+
+#if !_FS_READONLY
+static
+void encode_fat (
+	FATFS *fs,		/* File system object */
+	BYTE *buf,		/* Buffer for n sectors of FAT data */
+	DWORD sect,		/* First FAT sector to encode */
+	DWORD n			/* Number of sectors to encode */
+)
+{
+	DWORD k, kend, b, b0, b1, val;
+	BYTE lo, hi;
+
+
+	b0 = sect * SS(fs);
+	b1 = b0 + n * SS(fs);
+	switch (fs->fs_type) {
+	case FS_FAT12 :
+		/* Entries share bytes, so each one ORs its nibbles in, starting
+		   from the entry that shares the first byte with the one before */
+		mem_set(buf, 0, n * SS(fs));
+		k = b0 * 2 / 3; if (k) k--;
+		kend = b1 * 2 / 3 + 1;
+		if (kend > fs->fat_entries) kend = fs->fat_entries;
+		for ( ; k < kend; k++) {
+			val = fs->fat_table[k];
+			b = k + k / 2;
+			if (k & 1) {
+				lo = (BYTE)(val << 4) & 0xF0; hi = (BYTE)(val >> 4);
+			} else {
+				lo = (BYTE)val; hi = (BYTE)(val >> 8) & 0x0F;
+			}
+			if (b >= b0 && b < b1) buf[b - b0] |= lo;
+			if (b + 1 >= b0 && b + 1 < b1) buf[b + 1 - b0] |= hi;
+		}
+		break;
+
+	case FS_FAT16 :
+		for (k = b0 / 2; k < b1 / 2; k++, buf += 2) {
+			ST_WORD(buf, (WORD)fs->fat_table[k]);
+		}
+		break;
+
+	case FS_FAT32 :
+		for (k = b0 / 4; k < b1 / 4; k++, buf += 4) {
+			ST_DWORD(buf, fs->fat_table[k]);
+		}
+		break;
+	}
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT held in memory - Load the FAT of a newly mounted volume           */
+/*-----------------------------------------------------------------------*/
+
+static
+void free_fat (
+	FATFS *fs		/* File system object */
+)
+{
+	free(fs->fat_table);
+	free(fs->fat_dirty);
+	fs->fat_table = 0;
+	fs->fat_dirty = 0;
+	fs->fat_wflag = 0;
+}
+
+
+static
+FRESULT load_fat (	/* FR_OK: loaded or left on the disk, FR_DISK_ERR: failed */
+	FATFS *fs		/* File system object, with its FAT layout known */
+)
+{
+	DWORD bytes, size, sect, n, run;
+	BYTE *buf;
+
+
+	free_fat(fs);
+	if (!FatCacheLimit) return FR_OK;
+
+	bytes = fs->sects_fat * SS(fs);
+	switch (fs->fs_type) {
+	case FS_FAT12 : fs->fat_entries = (bytes * 2 + 2) / 3; break;
+	case FS_FAT16 : fs->fat_entries = bytes / 2; break;
+	default :		fs->fat_entries = bytes / 4;
+	}
+	if (fs->fat_entries < fs->max_clust) return FR_OK;	/* FAT too short for the volume; leave it be */
+	size = fs->fat_entries * sizeof(uint32_t) + (fs->sects_fat + 7) / 8;
+	if (size > FatCacheLimit) {
+		FatCacheRefused += size;
+		return FR_OK;
+	}
+
+	/* FAT12 is read in one go, as its entries straddle sectors */
+	run = (fs->fs_type == FS_FAT12) ? fs->sects_fat : FAT_RUN_BYTES / SS(fs);
+	if (run > fs->sects_fat) run = fs->sects_fat;
+	fs->fat_table = malloc(fs->fat_entries * sizeof(uint32_t));
+	fs->fat_dirty = calloc((fs->sects_fat + 7) / 8, 1);
+	buf = malloc(run * SS(fs));
+	if (!fs->fat_table || !fs->fat_dirty || !buf) {	/* Not enough memory; do without */
+		free(buf);
+		free_fat(fs);
+		return FR_OK;
+	}
+	for (sect = 0; sect < fs->sects_fat; sect += n) {
+		n = fs->sects_fat - sect;
+		if (n > run) n = run;
+		if (disk_read(fs->drive, buf, fs->fatbase + sect, n) != RES_OK) {
+			free(buf);
+			free_fat(fs);
+			return FR_DISK_ERR;
+		}
+		decode_fat(fs, buf, sect, n);
+	}
+	free(buf);
+	FatCacheHeld += size;
+
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT held in memory - Write changed sectors out to all FAT copies      */
+/*-----------------------------------------------------------------------*/
+#if !_FS_READONLY
+#define FAT_DIRTY(fs,s)	((fs)->fat_dirty[(s) / 8] & (1 << ((s) & 7)))
+
+static
+void mark_fat (
+	FATFS *fs,		/* File system object */
+	DWORD offset	/* Byte offset of a changed byte in the FAT */
+)
+{
+	DWORD s = offset / SS(fs);
+
+	fs->fat_dirty[s / 8] |= 1 << (s & 7);
+	fs->fat_wflag = 1;
+}
+
+
+static
+FRESULT flush_fat (	/* FR_OK: successful, FR_DISK_ERR: failed */
+	FATFS *fs		/* File system object */
+)
+{
+	DISK_RUN run[4];
+	DWORD s, e, maxrun, wsect;
+	BYTE *buf, nf;
+	UINT n;
+
+
+	if (!fs->fat_table || !fs->fat_wflag) return FR_OK;
+
+	maxrun = FAT_RUN_BYTES / SS(fs);
+	buf = malloc(maxrun * SS(fs));
+	if (!buf) return FR_INT_ERR;
+	for (s = 0; s < fs->sects_fat; s = e) {
+		if (!FAT_DIRTY(fs, s)) { e = s + 1; continue; }
+		for (e = s + 1; e < fs->sects_fat && e - s < maxrun && FAT_DIRTY(fs, e); e++) ;
+		encode_fat(fs, buf, s, e - s);
+		wsect = fs->fatbase + s;
+		if (disk_write(fs->drive, buf, wsect, e - s) != RES_OK) {	/* The first copy must be written */
+			free(buf);
+			return FR_DISK_ERR;
+		}
+		n = 0;
+		for (nf = fs->n_fats; nf > 1; nf--) {	/* The same run to each other copy, as one vectored request */
+			wsect += fs->sects_fat;
+			run[n].sector = wsect;
+			run[n].count = e - s;
+			run[n].buff = buf;
+			if (++n == 4 || nf == 2) {
+				disk_writev(fs->drive, run, n);	/* A failed copy is not an error, as in move_window */
+				n = 0;
+			}
+		}
+		for ( ; s < e; s++) fs->fat_dirty[s / 8] &= ~(1 << (s & 7));
+	}
+	free(buf);
+	fs->fat_wflag = 0;
+
+	return FR_OK;
+}
+#endif
+#endif /* _USE_FAT_CACHE */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Build the map from the FAT                         */
+/*-----------------------------------------------------------------------*/
+#if _USE_FREE_MAP && !_FS_READONLY
+#define MAP_BITS	(sizeof(DWORD) * 8)	/* Clusters per word of the free map */
+#define MAP_SET(fs,c)	((fs)->free_map[(c) / MAP_BITS] |= (DWORD)1 << ((c) % MAP_BITS))
+#define MAP_CLR(fs,c)	((fs)->free_map[(c) / MAP_BITS] &= ~((DWORD)1 << ((c) % MAP_BITS)))
+#ifdef __GNUC__
+#define LOWEST_BIT(w)	((DWORD)__builtin_ctzl(w))
+#else
+static
+DWORD LOWEST_BIT (DWORD w) { DWORD n = 0; while (!(w & 1)) { w >>= 1; n++; } return n; }
+#endif
+
+static
+DWORD map_free_entries (	/* Number of free entries found */
+	FATFS *fs,		/* File system object */
+	const BYTE *p,	/* FAT16 or FAT32 entries as stored on the disk */
+	DWORD clst,		/* Cluster# of the first entry, a multiple of 8 */
+	DWORD count		/* Number of entries */
+)
+{
+	DWORD i = 0, n = 0;
+#ifdef __SSE2__
+	DWORD bits;
+	__m128i zero = _mm_setzero_si128();
+	__m128i mask = _mm_set1_epi32(0x0FFFFFFF);
+	__m128i v;
+
+	/* 8 entries at a time into 8 bits of the map, which never straddle a word */
+	if (fs->fs_type == FS_FAT32) {
+		for ( ; i + 8 <= count; i += 8) {
+			v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i * 4)), mask);
+			bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+			v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i * 4 + 16)), mask);
+			bits |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << 4;
+			if (bits) {
+				fs->free_map[(clst + i) / MAP_BITS] |= bits << ((clst + i) % MAP_BITS);
+				for ( ; bits; bits &= bits - 1) n++;
+			}
+		}
+	} else {
+		for ( ; i + 8 <= count; i += 8) {
+			v = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + i * 2)), zero);
+			bits = _mm_movemask_epi8(_mm_packs_epi16(v, zero));
+			if (bits) {
+				fs->free_map[(clst + i) / MAP_BITS] |= bits << ((clst + i) % MAP_BITS);
+				for ( ; bits; bits &= bits - 1) n++;
+			}
+		}
+	}
+#endif
+	for ( ; i < count; i++) {
+		if (fs->fs_type == FS_FAT32 ? (LD_DWORD(p + i * 4) & 0x0FFFFFFF) == 0 : LD_WORD(p + i * 2) == 0) {
+			MAP_SET(fs, clst + i);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+
+static
+FRESULT build_free_map (	/* FR_OK: built or done without, !=0: failed */
+	FATFS *fs		/* File system object */
+)
+{
+	DWORD clst, n, sect, nsect, run, count;
+	BYTE *buf;
+	FRESULT res;
+
+
+	fs->free_map = calloc((fs->max_clust + MAP_BITS - 1) / MAP_BITS, sizeof(DWORD));
+	if (!fs->free_map) return FR_OK;	/* Not enough memory; do without */
+
+	n = 0;
+#if _USE_FAT_CACHE
+	if (fs->fat_table) {			/* FAT held in memory */
+		for (clst = 2; clst < fs->max_clust; clst++) {
+			if ((fs->fat_table[clst] & 0x0FFFFFFF) == 0) {
+				MAP_SET(fs, clst);
+				n++;
+			}
+		}
+	} else
+#endif
+	if (fs->fs_type == FS_FAT12) {	/* A small FAT, with entries straddling sectors */
+		for (clst = 2; clst < fs->max_clust; clst++) {
+			res = FR_OK;
+			switch (get_fat(fs, clst)) {
+			case 0 : MAP_SET(fs, clst); n++; break;
+			case 1 : res = FR_INT_ERR; break;
+			case 0xFFFFFFFF : res = FR_DISK_ERR;
+			}
+			if (res != FR_OK) goto fail;
+		}
+	} else {						/* Read the FAT in long runs, straight from the disk */
+		res = move_window(fs, 0);	/* with any change held in the window written first */
+		if (res != FR_OK) goto fail;
+		run = FAT_RUN_BYTES / SS(fs);
+		buf = malloc(run * SS(fs));
+		if (!buf) { res = FR_OK; goto fail; }
+		for (sect = 0, clst = 0; clst < fs->max_clust && sect < fs->sects_fat; sect += nsect) {
+			nsect = fs->sects_fat - sect;
+			if (nsect > run) nsect = run;
+			if (disk_read(fs->drive, buf, fs->fatbase + sect, nsect) != RES_OK) {
+				free(buf);
+				res = FR_DISK_ERR;
+				goto fail;
+			}
+			count = nsect * SS(fs) / (fs->fs_type == FS_FAT32 ? 4 : 2);
+			if (count > fs->max_clust - clst) count = fs->max_clust - clst;
+			n += map_free_entries(fs, buf, clst, count);
+			clst += count;
+		}
+		free(buf);
+		for (clst = 0; clst < 2; clst++) {	/* The first two entries aren't clusters */
+			if (fs->free_map[0] & ((DWORD)1 << clst)) n--;
+			MAP_CLR(fs, clst);
+		}
+	}
+
+	if (fs->free_clust != n) {		/* Put FSInfo right if it was out */
+		fs->free_clust = n;
+		fs->fsi_flag = 1;
+	}
+	return FR_OK;
+
+fail:
+	free(fs->free_map);
+	fs->free_map = 0;
+	return res;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster map - Find the next free cluster                         */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD scan_map (	/* The first cluster from clst on that is free (or in use), max_clust if none */
+	FATFS *fs,		/* File system object */
+	DWORD clst,		/* Cluster# to start looking at */
+	BYTE free		/* 1: Look for a free cluster, 0: Look for one in use */
+)
+{
+	DWORD i, w, words;
+
+
+	if (clst >= fs->max_clust) return fs->max_clust;
+	words = (fs->max_clust + MAP_BITS - 1) / MAP_BITS;
+	i = clst / MAP_BITS;
+	w = (free ? fs->free_map[i] : ~fs->free_map[i]) & (~(DWORD)0 << (clst % MAP_BITS));
+	for (;;) {
+		if (w) {
+			clst = i * MAP_BITS + LOWEST_BIT(w);
+			return (clst < fs->max_clust) ? clst : fs->max_clust;
+		}
+		if (++i == words) return fs->max_clust;
+		w = free ? fs->free_map[i] : ~fs->free_map[i];
+	}
+}
+
+
+static
+DWORD find_free (	/* 0:No free cluster, >=2: The first free cluster from clst on, wrapping around */
+	FATFS *fs,		/* File system object */
+	DWORD clst		/* Cluster# to start looking at */
+)
+{
+	DWORD ncl;
+
+
+	if (clst < 2) clst = 2;
+	ncl = scan_map(fs, clst, 1);
+	if (ncl >= fs->max_clust) {		/* Wrap around */
+		ncl = scan_map(fs, 2, 1);
+		if (ncl >= fs->max_clust) return 0;
+	}
+
+	return ncl;
+}
+#endif /* _USE_FREE_MAP && !_FS_READONLY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Clean-up cached data                                                  */
 /*-----------------------------------------------------------------------*/
@@ -299,6 +748,10 @@ FRESULT sync (	/* FR_OK: successful, FR_DISK_ERR: failed */
 	FRESULT res;
 
 
+#if _USE_FAT_CACHE
+	res = flush_fat(fs);
+	if (res == FR_OK)
+#endif
 	res = move_window(fs, 0);
 	if (res == FR_OK) {
 		/* Update FSInfo sector if needed */
@@ -342,6 +795,11 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Interal error, Else:Cluster status *
 	if (clst < 2 || clst >= fs->max_clust)	/* Range check */
 		return 1;
 
+#if _USE_FAT_CACHE
+	if (fs->fat_table)	/* FAT held in memory */
+		return fs->fat_table[clst] & 0x0FFFFFFF;
+#endif
+
 	fsect = fs->fatbase;
 	switch (fs->fs_type) {
 	case FS_FAT12 :
@@ -387,6 +845,31 @@ FRESULT put_fat (
 	if (clst < 2 || clst >= fs->max_clust) {	/* Range check */
 		res = FR_INT_ERR;
 
+#if _USE_FAT_CACHE
+	} else if (fs->fat_table) {	/* FAT held in memory; the sectors are written at the next sync */
+		res = FR_OK;
+		switch (fs->fs_type) {
+		case FS_FAT12 :
+			fs->fat_table[clst] = val & 0xFFF;
+			bc = clst; bc += bc / 2;
+			mark_fat(fs, bc);
+			mark_fat(fs, bc + 1);
+			break;
+
+		case FS_FAT16 :
+			fs->fat_table[clst] = val & 0xFFFF;
+			mark_fat(fs, clst * 2);
+			break;
+
+		case FS_FAT32 :
+			fs->fat_table[clst] = (uint32_t)val;
+			mark_fat(fs, clst * 4);
+			break;
+
+		default :
+			res = FR_INT_ERR;
+		}
+#endif
 	} else {
 		fsect = fs->fatbase;
 		switch (fs->fs_type) {
@@ -421,6 +904,12 @@ FRESULT put_fat (
 		}
 		fs->wflag = 1;
 	}
+#if _USE_FREE_MAP
+	if (res == FR_OK && fs->free_map) {	/* Keep the free map in step */
+		if (val == 0) MAP_SET(fs, clst);
+		else MAP_CLR(fs, clst);
+	}
+#endif
 
 	return res;
 }
@@ -495,6 +984,15 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 		scl = clst;
 	}
 
+#if _USE_FREE_MAP
+	if (!fs->free_map && build_free_map(fs) != FR_OK)	/* Build the free map the first time */
+		return 0xFFFFFFFF;
+	if (fs->free_map) {					/* and look the next free cluster up in it */
+		ncl = find_free(fs, scl + 1);
+		if (!ncl) return 0;				/* No free custer */
+	} else
+#endif
+	{
 	ncl = scl;				/* Start cluster */
 	for (;;) {
 		ncl++;							/* Next cluster */
@@ -508,6 +1006,7 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 			return cs;
 		if (ncl == scl) return 0;		/* No free custer */
 	}
+	}
 
 	if (put_fat(fs, ncl, 0x0FFFFFFF))	/* Mark the new cluster "in use" */
 		return 0xFFFFFFFF;
@@ -547,6 +1046,105 @@ DWORD clust2sect (	/* !=0: Sector number, 0: Failed - invalid cluster# */
 
 
 
+#if _USE_FASTSEEK
+/*-----------------------------------------------------------------------*/
+/* File cluster link map - Build the map                                 */
+/*-----------------------------------------------------------------------*/
+/* The table pointed to by fp->cltbl holds its own size in items, followed by
+/  a (run length, start cluster) pair for each run of consecutive clusters in
+/  the chain, and a zero to end the list. */
+
+static
+FRESULT create_linkmap (
+	FIL *fp		/* Pointer to the file object with a link map table */
+)
+{
+	DWORD *tbl, tlen, ulen, ncl, tcl, pcl, cl;
+
+
+	tbl = fp->cltbl;
+	tlen = *tbl++;					/* Given table size */
+	ulen = 2;						/* Table size needed: size item and terminator */
+	cl = fp->org_clust;
+	if (cl) {
+		do {
+			tcl = cl; ncl = 0;		/* Measure the run of consecutive clusters from tcl */
+			do {
+				pcl = cl; ncl++;
+				cl = get_fat(fp->fs, cl);
+				if (cl <= 1) return FR_INT_ERR;
+				if (cl == 0xFFFFFFFF) return FR_DISK_ERR;
+			} while (cl == pcl + 1);
+			ulen += 2;
+			if (ulen <= tlen) {		/* Store the run if there is room */
+				*tbl++ = ncl; *tbl++ = tcl;
+			}
+		} while (cl < fp->fs->max_clust);	/* Until the end of the chain */
+	}
+	*fp->cltbl = ulen;				/* Report the size used, or needed */
+	if (ulen > tlen) {				/* Table too small: go on without it */
+		fp->cltbl = 0;
+		return FR_NOT_ENOUGH_CORE;
+	}
+	*tbl = 0;						/* Terminate the table */
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* File cluster link map - Look up the cluster at a file offset          */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD clmt_clust (	/* 0:Not in the map, >=2:Cluster# */
+	FIL *fp,		/* Pointer to the file object with a link map */
+	DWORD ofs		/* File offset to look up */
+)
+{
+	DWORD cl, ncl, *tbl;
+
+
+	tbl = fp->cltbl + 1;
+	cl = ofs / SS(fp->fs) / fp->fs->csize;	/* Cluster order from top of the file */
+	for (;;) {
+		ncl = *tbl++;
+		if (!ncl) return 0;			/* Beyond the mapped clusters */
+		if (cl < ncl) break;		/* In this run */
+		cl -= ncl; tbl++;			/* Next run */
+	}
+	return cl + *tbl;
+}
+#endif /* _USE_FASTSEEK */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* File cluster chain - Get the cluster following the current one        */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD next_clust (	/* 0xFFFFFFFF:Disk error, 1:Internal error, Else:Cluster status */
+	FIL *fp,		/* Pointer to the file object */
+	DWORD ofs		/* File offset at the top of the next cluster */
+)
+{
+#if _USE_FASTSEEK
+	DWORD clst;
+
+	if (fp->cltbl) {				/* Look it up in the link map if there is one */
+		clst = clmt_clust(fp, ofs);
+		if (clst) return clst;
+	}
+#endif
+	return get_fat(fp->fs, fp->curr_clust);	/* Follow the chain in the FAT */
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Seek directory index                             */
 /*-----------------------------------------------------------------------*/
@@ -1440,6 +2038,27 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Size the access window to the sector size of the drive                */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT alloc_window (	/* FR_OK(0): successful, FR_INT_ERR: out of memory */
+	FATFS *fs	/* File system object, with its sector size set */
+)
+{
+	if (fs->win && fs->win_size == SS(fs)) return FR_OK;
+
+	free(fs->win);
+	fs->win = malloc(SS(fs));
+	fs->win_size = fs->win ? SS(fs) : 0;
+	fs->winsect = 0xFFFFFFFF;	/* Nothing is held in the new window yet */
+	return fs->win ? FR_OK : FR_INT_ERR;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Load boot record and check if it is an FAT boot record                */
 /*-----------------------------------------------------------------------*/
@@ -1526,6 +2145,8 @@ FRESULT chk_mounted (	/* FR_OK(0): successful, !=0: any error occured */
 	if (disk_ioctl(fs->drive, GET_SECTOR_SIZE, &SS(fs)) != RES_OK || SS(fs) > _MAX_SS)
 		return FR_NO_FILESYSTEM;
 #endif
+	if (alloc_window(fs) != FR_OK)		/* Size the window to the sector */
+		return FR_INT_ERR;
 #if !_FS_READONLY
 	if (chk_wp && (stat & STA_PROTECT))	/* Check disk write protection if needed */
 		return FR_WRITE_PROTECTED;
@@ -1588,6 +2209,16 @@ FRESULT chk_mounted (	/* FR_OK(0): successful, !=0: any error occured */
 #endif
 	fs->fs_type = fmt;		/* FAT sub-type */
 	fs->winsect = 0;		/* Invalidate sector cache */
+#if _USE_FREE_MAP && !_FS_READONLY
+	free(fs->free_map);		/* Free map is built when first needed */
+	fs->free_map = 0;
+#endif
+#if _USE_FAT_CACHE
+	if (load_fat(fs) != FR_OK) {	/* Hold the FAT in memory if it's small enough */
+		fs->fs_type = 0;
+		return FR_DISK_ERR;
+	}
+#endif
 #if _FS_RPATH
 	fs->cdir = 0;			/* Current directory (root dir) */
 #endif
@@ -1652,10 +2283,29 @@ FRESULT f_mount (
 		if (!ff_del_syncobj(rfs->sobj)) return FR_INT_ERR;
 #endif
 		rfs->fs_type = 0;			/* Clear old fs object */
+		free(rfs->win);				/* and let its window go */
+		rfs->win = 0;
+#if _USE_FAT_CACHE
+		free_fat(rfs);				/* along with any FAT held in memory */
+#endif
+#if _USE_FREE_MAP && !_FS_READONLY
+		free(rfs->free_map);		/* and free map */
+		rfs->free_map = 0;
+#endif
 	}
 
 	if (fs) {
 		fs->fs_type = 0;			/* Clear new fs object */
+		fs->win = 0;				/* Window is allocated when the volume is mounted */
+		fs->win_size = 0;
+#if _USE_FAT_CACHE
+		fs->fat_table = 0;			/* and the FAT loaded into memory, if at all */
+		fs->fat_dirty = 0;
+		fs->fat_wflag = 0;
+#endif
+#if _USE_FREE_MAP && !_FS_READONLY
+		fs->free_map = 0;			/* and the free map, when first needed */
+#endif
 #if _FS_REENTRANT					/* Create sync object for the new volume */
 		if (!ff_cre_syncobj(vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -1668,6 +2318,38 @@ FRESULT f_mount (
 
 
 
+#if _USE_FAT_CACHE
+/*-----------------------------------------------------------------------*/
+/* Set the Memory Limit for FATs Held in Memory                          */
+/*-----------------------------------------------------------------------*/
+
+void f_fatcache (
+	DWORD limit		/* Most bytes the FAT of a volume mounted from now on may take (0:never hold) */
+)
+{
+	FatCacheLimit = limit;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get Memory Used by FATs Held in Memory                                */
+/*-----------------------------------------------------------------------*/
+
+void f_fatcache_usage (
+	DWORD *held,	/* Pointer to the variable to return the bytes taken by FATs held so far */
+	DWORD *refused	/* Pointer to the variable to return the bytes FATs over the limit would have taken */
+)
+{
+	*held = FatCacheHeld;
+	*refused = FatCacheRefused;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Open or Create a File                                                 */
 /*-----------------------------------------------------------------------*/
@@ -1758,6 +2440,9 @@ FRESULT f_open (
 	fp->fsize = LD_DWORD(dir+DIR_FileSize);	/* File size */
 	fp->fptr = 0; fp->csect = 255;		/* File pointer */
 	fp->dsect = 0;
+#if _USE_FASTSEEK
+	fp->cltbl = 0;						/* No link map */
+#endif
 	fp->fs = dj.fs; fp->id = dj.fs->id;	/* Owner file system object of the file */
 
 	LEAVE_FF(dj.fs, FR_OK);
@@ -1799,7 +2484,7 @@ FRESULT f_read (
 		if ((fp->fptr % SS(fp->fs)) == 0) {			/* On the sector boundary? */
 			if (fp->csect >= fp->fs->csize) {		/* On the cluster boundary? */
 				clst = (fp->fptr == 0) ?			/* On the top of the file? */
-					fp->org_clust : get_fat(fp->fs, fp->curr_clust);
+					fp->org_clust : next_clust(fp, fp->fptr);
 				if (clst <= 1) ABORT(fp->fs, FR_INT_ERR);
 				if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
 				fp->curr_clust = clst;				/* Update current cluster */
@@ -1810,21 +2495,48 @@ FRESULT f_read (
 			sect += fp->csect;
 			cc = btr / SS(fp->fs);					/* When remaining bytes >= sector size, */
 			if (cc) {								/* Read maximum contiguous sectors directly */
-				if (fp->csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
-					cc = fp->fs->csize - fp->csect;
-				if (disk_read(fp->fs->drive, rbuff, sect, (BYTE)cc) != RES_OK)
+				DISK_RUN run[_MAX_RUNS];
+				UINT n = 0, i;
+				DWORD scnt;
+				rcnt = 0;							/* Number of bytes transferred */
+				for (;;) {							/* Gather clusters into one vectored request, merging adjacent ones */
+					scnt = fp->fs->csize - fp->csect;	/* Clip at cluster boundary */
+					if (scnt > cc) scnt = cc;
+					if (n && run[n-1].sector + run[n-1].count == sect) {	/* Physically follows the last run? */
+						run[n-1].count += scnt;		/* Extend it */
+					} else {
+						run[n].sector = sect;		/* Start a new run */
+						run[n].count = scnt;
+						run[n].buff = rbuff + rcnt;
+						n++;
+					}
+					fp->csect += (BYTE)scnt;		/* Next sector address in the cluster */
+					cc -= scnt;
+					rcnt += SS(fp->fs) * scnt;
+					if (!cc) break;
+					clst = next_clust(fp, fp->fptr + rcnt);	/* Follow the chain into the next cluster */
+					if (clst <= 1) ABORT(fp->fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
+					sect = clust2sect(fp->fs, clst);
+					if (!sect) ABORT(fp->fs, FR_INT_ERR);
+					if (n == _MAX_RUNS && run[n-1].sector + run[n-1].count != sect)
+						break;						/* No room for another run; the next pass starts there */
+					fp->curr_clust = clst;
+					fp->csect = 0;
+				}
+				if (disk_readv(fp->fs->drive, run, n) != RES_OK)
 					ABORT(fp->fs, FR_DISK_ERR);
 #if !_FS_READONLY && _FS_MINIMIZE <= 2
+				for (i = 0; i < n; i++) {
 #if _FS_TINY
-				if (fp->fs->wflag && fp->fs->winsect - sect < cc)		/* Replace one of the read sectors with cached data if it contains a dirty sector */
-					mem_cpy(rbuff + ((fp->fs->winsect - sect) * SS(fp->fs)), fp->fs->win, SS(fp->fs));
+					if (fp->fs->wflag && fp->fs->winsect - run[i].sector < run[i].count)	/* Replace one of the read sectors with cached data if it contains a dirty sector */
+						mem_cpy(run[i].buff + ((fp->fs->winsect - run[i].sector) * SS(fp->fs)), fp->fs->win, SS(fp->fs));
 #else
-				if ((fp->flag & FA__DIRTY) && fp->dsect - sect < cc)	/* Replace one of the read sectors with cached data if it contains a dirty sector */
-					mem_cpy(rbuff + ((fp->dsect - sect) * SS(fp->fs)), fp->buf, SS(fp->fs));
+					if ((fp->flag & FA__DIRTY) && fp->dsect - run[i].sector < run[i].count)	/* Replace one of the read sectors with cached data if it contains a dirty sector */
+						mem_cpy(run[i].buff + ((fp->dsect - run[i].sector) * SS(fp->fs)), fp->buf, SS(fp->fs));
 #endif
+				}
 #endif
-				fp->csect += (BYTE)cc;				/* Next sector address in the cluster */
-				rcnt = SS(fp->fs) * cc;				/* Number of bytes transferred */
 				continue;
 			}
 #if !_FS_TINY
@@ -1897,6 +2609,10 @@ FRESULT f_write (
 					if (clst == 0)					/* When there is no cluster chain, */
 						fp->org_clust = clst = create_chain(fp->fs, 0);	/* Create a new cluster chain */
 				} else {							/* Middle or end of the file */
+#if _USE_FASTSEEK
+					clst = fp->cltbl ? clmt_clust(fp, fp->fptr) : 0;	/* Look it up in the link map */
+					if (!clst)
+#endif
 					clst = create_chain(fp->fs, fp->curr_clust);			/* Follow or streach cluster chain */
 				}
 				if (clst == 0) break;				/* Could not allocate a new cluster (disk full) */
@@ -1920,23 +2636,55 @@ FRESULT f_write (
 			sect += fp->csect;
 			cc = btw / SS(fp->fs);					/* When remaining bytes >= sector size, */
 			if (cc) {								/* Write maximum contiguous sectors directly */
-				if (fp->csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
-					cc = fp->fs->csize - fp->csect;
-				if (disk_write(fp->fs->drive, wbuff, sect, (BYTE)cc) != RES_OK)
+				DISK_RUN run[_MAX_RUNS];
+				UINT n = 0, i;
+				DWORD scnt;
+				wcnt = 0;							/* Number of bytes transferred */
+				for (;;) {							/* Gather clusters into one vectored request, merging adjacent ones */
+					scnt = fp->fs->csize - fp->csect;	/* Clip at cluster boundary */
+					if (scnt > cc) scnt = cc;
+					if (n && run[n-1].sector + run[n-1].count == sect) {	/* Physically follows the last run? */
+						run[n-1].count += scnt;		/* Extend it */
+					} else {
+						run[n].sector = sect;		/* Start a new run */
+						run[n].count = scnt;
+						run[n].buff = (BYTE*)wbuff + wcnt;
+						n++;
+					}
+					fp->csect += (BYTE)scnt;		/* Next sector address in the cluster */
+					cc -= scnt;
+					wcnt += SS(fp->fs) * scnt;
+					if (!cc) break;
+#if _USE_FASTSEEK
+					clst = fp->cltbl ? clmt_clust(fp, fp->fptr + wcnt) : 0;	/* Look it up in the link map */
+					if (!clst)
+#endif
+					clst = create_chain(fp->fs, fp->curr_clust);	/* Follow or stretch the chain into the next cluster */
+					if (clst == 0) break;			/* Disk full; the next pass stops at the same place */
+					if (clst == 1) ABORT(fp->fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
+					sect = clust2sect(fp->fs, clst);
+					if (!sect) ABORT(fp->fs, FR_INT_ERR);
+					if (n == _MAX_RUNS && run[n-1].sector + run[n-1].count != sect)
+						break;						/* No room for another run; the next pass follows the chain to it again */
+					fp->curr_clust = clst;
+					fp->csect = 0;
+				}
+				if (disk_writev(fp->fs->drive, run, n) != RES_OK)
 					ABORT(fp->fs, FR_DISK_ERR);
+				for (i = 0; i < n; i++) {
 #if _FS_TINY
-				if (fp->fs->winsect - sect < cc) {	/* Refill sector cache if it gets dirty by the direct write */
-					mem_cpy(fp->fs->win, wbuff + ((fp->fs->winsect - sect) * SS(fp->fs)), SS(fp->fs));
-					fp->fs->wflag = 0;
-				}
+					if (fp->fs->winsect - run[i].sector < run[i].count) {	/* Refill sector cache if it gets dirty by the direct write */
+						mem_cpy(fp->fs->win, run[i].buff + ((fp->fs->winsect - run[i].sector) * SS(fp->fs)), SS(fp->fs));
+						fp->fs->wflag = 0;
+					}
 #else
-				if (fp->dsect - sect < cc) {		/* Refill sector cache if it gets dirty by the direct write */
-					mem_cpy(fp->buf, wbuff + ((fp->dsect - sect) * SS(fp->fs)), SS(fp->fs));
-					fp->flag &= ~FA__DIRTY;
-				}
+					if (fp->dsect - run[i].sector < run[i].count) {		/* Refill sector cache if it gets dirty by the direct write */
+						mem_cpy(fp->buf, run[i].buff + ((fp->dsect - run[i].sector) * SS(fp->fs)), SS(fp->fs));
+						fp->flag &= ~FA__DIRTY;
+					}
 #endif
-				fp->csect += (BYTE)cc;				/* Next sector address in the cluster */
-				wcnt = SS(fp->fs) * cc;				/* Number of bytes transferred */
+				}
 				continue;
 			}
 #if _FS_TINY
@@ -2122,6 +2870,14 @@ FRESULT f_lseek (
 	if (res != FR_OK) LEAVE_FF(fp->fs, res);
 	if (fp->flag & FA__ERROR)			/* Check abort flag */
 		LEAVE_FF(fp->fs, FR_INT_ERR);
+#if _USE_FASTSEEK
+	if (ofs == CREATE_LINKMAP) {		/* Build the cluster link map */
+		if (!fp->cltbl) LEAVE_FF(fp->fs, FR_INVALID_OBJECT);
+		res = create_linkmap(fp);
+		if (res == FR_DISK_ERR || res == FR_INT_ERR) ABORT(fp->fs, res);
+		LEAVE_FF(fp->fs, res);
+	}
+#endif
 	if (ofs > fp->fsize					/* In read-only mode, clip offset with the file size */
 #if !_FS_READONLY
 		 && !(fp->flag & FA_WRITE)
@@ -2132,6 +2888,14 @@ FRESULT f_lseek (
 	fp->fptr = nsect = 0; fp->csect = 255;
 	if (ofs > 0) {
 		bcs = (DWORD)fp->fs->csize * SS(fp->fs);	/* Cluster size (byte) */
+#if _USE_FASTSEEK
+		clst = fp->cltbl ? clmt_clust(fp, ofs - 1) : 0;	/* Look the cluster up in the link map */
+		if (clst) {									/* When it is mapped, */
+			fp->fptr = (ofs - 1) & ~(bcs - 1);		/* go straight to it */
+			ofs -= fp->fptr;
+			fp->curr_clust = clst;
+		} else
+#endif
 		if (ifptr > 0 &&
 			(ofs - 1) / bcs >= (ifptr - 1) / bcs) {	/* When seek to same or following cluster, */
 			fp->fptr = (ifptr - 1) & ~(bcs - 1);	/* start from the current cluster */
@@ -2344,9 +3108,28 @@ FRESULT f_getfree (
 		LEAVE_FF(*fatfs, FR_OK);
 	}
 
+#if _USE_FREE_MAP
+	/* Building the free map counts them */
+	if (!(*fatfs)->free_map) {
+		res = build_free_map(*fatfs);
+		if (res != FR_OK) LEAVE_FF(*fatfs, res);
+	}
+	if ((*fatfs)->free_map) {
+		*nclst = (*fatfs)->free_clust;
+		LEAVE_FF(*fatfs, FR_OK);
+	}
+#endif
+
 	/* Get number of free clusters */
 	fat = (*fatfs)->fs_type;
 	n = 0;
+#if _USE_FAT_CACHE
+	if ((*fatfs)->fat_table) {	/* Count them in memory */
+		for (clst = 2; clst < (*fatfs)->max_clust; clst++) {
+			if (((*fatfs)->fat_table[clst] & 0x0FFFFFFF) == 0) n++;
+		}
+	} else
+#endif
 	if (fat == FS_FAT12) {
 		clst = 2;
 		do {
@@ -2408,6 +3191,9 @@ FRESULT f_truncate (
 	if (fp->fsize > fp->fptr) {
 		fp->fsize = fp->fptr;	/* Set file size to current R/W point */
 		fp->flag |= FA__WRITTEN;
+#if _USE_FASTSEEK
+		fp->cltbl = 0;			/* The link map would go stale; do without it */
+#endif
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 			res = remove_chain(fp->fs, fp->org_clust);
 			fp->org_clust = 0;
@@ -2430,6 +3216,114 @@ FRESULT f_truncate (
 
 
 
+#if _USE_EXPAND && _USE_FREE_MAP
+/*-----------------------------------------------------------------------*/
+/* Choose a Run of Free Clusters for f_expand                            */
+/*-----------------------------------------------------------------------*/
+
+static
+DWORD pick_run (	/* Start cluster# of the run, 0:No free cluster */
+	FATFS *fs,		/* File system object */
+	DWORD ncl,		/* Number of clusters wanted */
+	BYTE best,		/* 0: The first run that fits from last_clust on, 1: The smallest run that fits */
+	DWORD *len		/* Pointer to the variable to return the number of clusters to take from the run */
+)
+{
+	DWORD scl, ecl, after = 0, first = 0, fit = 0, fitlen = 0, large = 0, largelen = 0;
+
+
+	for (scl = scan_map(fs, 2, 1); scl < fs->max_clust; scl = scan_map(fs, ecl, 1)) {
+		ecl = scan_map(fs, scl, 0);	/* End of this run */
+		if (ecl - scl >= ncl) {
+			if (!after && scl > fs->last_clust) after = scl;
+			if (!first) first = scl;
+			if (!fit || ecl - scl < fitlen) { fit = scl; fitlen = ecl - scl; }
+			if (!best && after) break;
+		}
+		if (ecl - scl > largelen) { large = scl; largelen = ecl - scl; }
+	}
+
+	*len = ncl;
+	if (!best && after) return after;
+	if (!best && first) return first;
+	if (fit) return fit;
+	*len = largelen;	/* Nothing fits; take the largest run there is */
+	return large;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Allocate the Clusters of an Empty File in Advance                     */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+	FIL *fp,		/* Pointer to the file object, open for writing and empty */
+	DWORD fsz,		/* File size to allocate clusters for */
+	DWORD *nfrag	/* Pointer to the variable to return the number of runs allocated (0:none) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD ncl, scl, len, c, prev = 0;
+
+
+	*nfrag = 0;
+	res = validate(fp->fs, fp->id);		/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->flag & FA__ERROR)			/* Check abort flag */
+		LEAVE_FF(fp->fs, FR_INT_ERR);
+	if (!(fp->flag & FA_WRITE))			/* Check access mode */
+		LEAVE_FF(fp->fs, FR_DENIED);
+	if (fp->fsize || fp->org_clust)		/* Only an empty file can be expanded */
+		LEAVE_FF(fp->fs, FR_DENIED);
+
+	fs = fp->fs;
+	ncl = (fsz + (DWORD)fs->csize * SS(fs) - 1) / ((DWORD)fs->csize * SS(fs));	/* Number of clusters needed */
+	if (!ncl) LEAVE_FF(fs, FR_OK);
+	if (!fs->free_map) {
+		res = build_free_map(fs);
+		if (res != FR_OK) LEAVE_FF(fs, res);
+		if (!fs->free_map) LEAVE_FF(fs, FR_OK);	/* No map; let the file grow as it's written */
+	}
+	if (fs->free_clust < ncl)			/* Not enough free space */
+		LEAVE_FF(fs, FR_DENIED);
+
+	/* One run if there is one that fits, otherwise the fewest best-fitting runs */
+	while (ncl) {
+		scl = pick_run(fs, ncl, (BYTE)(prev != 0), &len);
+		if (!scl) { res = FR_INT_ERR; break; }
+		if (prev) res = put_fat(fs, prev, scl);	/* Link it on to the run before */
+		else fp->org_clust = scl;
+		for (c = scl; res == FR_OK && c < scl + len; c++) {
+			res = put_fat(fs, c, (c < scl + len - 1) ? c + 1 : 0x0FFFFFFF);
+			if (res == FR_OK) fs->free_clust--;
+		}
+		if (res != FR_OK) break;
+		prev = scl + len - 1;
+		ncl -= len;
+		fs->last_clust = prev;
+		(*nfrag)++;
+	}
+	fs->fsi_flag = 1;
+	if (res != FR_OK) {					/* Give back whatever was allocated */
+		if (fp->org_clust) remove_chain(fs, fp->org_clust);
+		fp->org_clust = 0;
+		*nfrag = 0;
+		ABORT(fs, res);
+	}
+
+	fp->fsize = fsz;					/* The file now takes up fsz bytes, to be written over */
+	fp->flag |= FA__WRITTEN;
+
+	LEAVE_FF(fs, FR_OK);
+}
+#endif /* _USE_EXPAND && _USE_FREE_MAP */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -2751,7 +3645,7 @@ FRESULT f_forward (
 		if ((fp->fptr % SS(fp->fs)) == 0) {			/* On the sector boundary? */
 			if (fp->csect >= fp->fs->csize) {		/* On the cluster boundary? */
 				clst = (fp->fptr == 0) ?			/* On the top of the file? */
-					fp->org_clust : get_fat(fp->fs, fp->curr_clust);
+					fp->org_clust : next_clust(fp, fp->fptr);
 				if (clst <= 1) ABORT(fp->fs, FR_INT_ERR);
 				if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
 				fp->curr_clust = clst;				/* Update current cluster */
@@ -2802,6 +3696,7 @@ FRESULT f_mkfs (
 	DWORD n_part, n_rsv, n_fat, n_dir;		/* Area size */
 	DWORD n_clst, d, n;
 	WORD as;
+	BYTE auto_fmt;
 	FATFS *fs;
 	DSTATUS stat;
 
@@ -2814,6 +3709,13 @@ FRESULT f_mkfs (
 	fs = FatFs[drv];
 	if (!fs) return FR_NOT_ENABLED;
 	fs->fs_type = 0;
+#if _USE_FAT_CACHE
+	free_fat(fs);		/* Any FAT held in memory is about to be replaced */
+#endif
+#if _USE_FREE_MAP
+	free(fs->free_map);	/* as is the free map */
+	fs->free_map = 0;
+#endif
 	drv = LD2PD(drv);
 
 	/* Get disk statics */
@@ -2825,6 +3727,8 @@ FRESULT f_mkfs (
 		|| SS(fs) > _MAX_SS)
 		return FR_MKFS_ABORTED;
 #endif
+	if (alloc_window(fs) != FR_OK)		/* Work area for the new records */
+		return FR_INT_ERR;
 	if (disk_ioctl(drv, GET_SECTOR_COUNT, &n_part) != RES_OK || n_part < MIN_SECTOR)
 		return FR_MKFS_ABORTED;
 	if (n_part > MAX_SECTOR) n_part = MAX_SECTOR;
@@ -2833,8 +3737,8 @@ FRESULT f_mkfs (
 	for (d = 512; d <= 32768U && d != allocsize; d <<= 1) ;	/* Check validity of the allocation unit size */
 	if (d != allocsize) allocsize = 0;
 	if (!allocsize) {					/* Auto selection of cluster size */
-		d = n_part;
-		for (as = SS(fs); as > 512U; as >>= 1) d >>= 1;
+		d = n_part;		/* Size in 512-byte units, which the table goes by */
+		for (as = SS(fs); as > 512U; as >>= 1) d <<= 1;
 		for (n = 0; d < sstbl[n]; n++) ;
 		allocsize = cstbl[n];
 	}
@@ -2842,44 +3746,55 @@ FRESULT f_mkfs (
 
 	allocsize /= SS(fs);		/* Number of sectors per cluster */
 
-	/* Pre-compute number of clusters and FAT type */
-	n_clst = n_part / allocsize;
-	if (fmt == 0) {
-		/* set format automatically based on number of clusters */
-		fmt = FS_FAT12;
-		if (n_clst >= 0xFF5) fmt = FS_FAT16;
-		if (n_clst >= 0xFFF5) fmt = FS_FAT32;
-	}
-
-	/* Determine offset and size of FAT structure */
-	switch (fmt) {
-	case FS_FAT12:
-		n_fat = ((n_clst * 3 + 1) / 2 + 3 + SS(fs) - 1) / SS(fs);
-		n_rsv = 1 + partition;
-		n_dir = N_ROOTDIR * 32 / SS(fs);
-		break;
-	case FS_FAT16:
-		n_fat = ((n_clst * 2) + 4 + SS(fs) - 1) / SS(fs);
-		n_rsv = 1 + partition;
-		n_dir = N_ROOTDIR * 32 / SS(fs);
-		break;
-	default:
-		n_fat = ((n_clst * 4) + 8 + SS(fs) - 1) / SS(fs);
-		n_rsv = 33 - partition;
-		n_dir = 0;
-	}
-	b_fat = b_part + n_rsv;			/* FATs start sector */
-	b_dir = b_fat + n_fat * N_FATS;	/* Directory start sector */
-	b_data = b_dir + n_dir;			/* Data start sector */
-
-	/* Align data start sector to erase block boundary (for flash memory media) */
-	if (disk_ioctl(drv, GET_BLOCK_SIZE, &n) != RES_OK) return FR_MKFS_ABORTED;
-	n = (b_data + n - 1) & ~(n - 1);
-	n_fat += (n - b_data) / N_FATS;
-	/* b_dir and b_data are no longer used below */
-
-	/* Determine number of cluster and final check of validity of the FAT type */
-	n_clst = (n_part - n_rsv - n_fat * N_FATS - n_dir) / allocsize;
+	auto_fmt = (fmt == 0);
+	for (;;) {
+		/* Pre-compute number of clusters and FAT type */
+		n_clst = n_part / allocsize;
+		if (auto_fmt) {
+			/* set format automatically based on number of clusters */
+			fmt = FS_FAT12;
+			if (n_clst >= 0xFF5) fmt = FS_FAT16;
+			if (n_clst >= 0xFFF5) fmt = FS_FAT32;
+		}
+
+		/* Determine offset and size of FAT structure */
+		switch (fmt) {
+		case FS_FAT12:
+			n_fat = ((n_clst * 3 + 1) / 2 + 3 + SS(fs) - 1) / SS(fs);
+			n_rsv = 1 + partition;
+			n_dir = N_ROOTDIR * 32 / SS(fs);
+			break;
+		case FS_FAT16:
+			n_fat = ((n_clst * 2) + 4 + SS(fs) - 1) / SS(fs);
+			n_rsv = 1 + partition;
+			n_dir = N_ROOTDIR * 32 / SS(fs);
+			break;
+		default:
+			n_fat = ((n_clst * 4) + 8 + SS(fs) - 1) / SS(fs);
+			n_rsv = 33 - partition;
+			n_dir = 0;
+		}
+		b_fat = b_part + n_rsv;			/* FATs start sector */
+		b_dir = b_fat + n_fat * N_FATS;	/* Directory start sector */
+		b_data = b_dir + n_dir;			/* Data start sector */
+
+		/* Align data start sector to erase block boundary (for flash memory media) */
+		if (disk_ioctl(drv, GET_BLOCK_SIZE, &n) != RES_OK) return FR_MKFS_ABORTED;
+		n = (b_data + n - 1) & ~(n - 1);
+		n_fat += (n - b_data) / N_FATS;
+		/* b_dir and b_data are no longer used below */
+
+		/* Determine number of cluster and final check of validity of the FAT type */
+		n_clst = (n_part - n_rsv - n_fat * N_FATS - n_dir) / allocsize;
+
+		/* The FAT type goes by the final cluster count, which can fall back below
+		   the threshold for the type chosen once the FAT itself is taken out (a
+		   2GB volume with 32KB clusters, for one); use smaller clusters if so */
+		if (!auto_fmt || allocsize == 1
+			|| !((fmt == FS_FAT32 && n_clst < 0xFFF5) || (fmt == FS_FAT16 && n_clst < 0xFF5)))
+			break;
+		allocsize >>= 1;
+	}
 	/* if (   (fmt == FS_FAT16 && n_clst < 0xFF5)
 		|| (fmt == FS_FAT32 && n_clst < 0xFFF5))
 		return FR_MKFS_ABORTED; */
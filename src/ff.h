@@ -18,6 +18,9 @@
 
 #include "integer.h"	/* Basic integer types */
 #include "ffconf.h"		/* FatFs configuration options */
+#if _USE_FAT_CACHE
+#include <stdint.h>		/* FAT entries held in memory are 32 bits, whatever the size of a DWORD */
+#endif
 
 #if _FATFS != _FFCONFIG
 #error Wrong configuration file (ffconf.h).
@@ -326,7 +329,17 @@ typedef struct _FATFS_ {
 	DWORD	dirbase;	/* Root directory start sector (Cluster# on FAT32) */
 	DWORD	database;	/* Data start sector */
 	DWORD	winsect;	/* Current sector appearing in the win[] */
-	BYTE	win[_MAX_SS];/* Disk access window for Directory/FAT */
+	BYTE*	win;		/* Disk access window for Directory/FAT, one sector long */
+	WORD	win_size;	/* Size allocated for win[] */
+#if _USE_FAT_CACHE
+	uint32_t*	fat_table;	/* Decoded copy of the whole FAT, one entry per cluster (0:not held) */
+	DWORD	fat_entries;	/* Number of entries in fat_table[] */
+	BYTE*	fat_dirty;	/* Bitmap of FAT sectors changed since the last sync */
+	BYTE	fat_wflag;	/* fat_dirty[] has any bits set */
+#endif
+#if _USE_FREE_MAP && !_FS_READONLY
+	DWORD*	free_map;	/* Bitmap of free clusters, bit set if free (0:not built) */
+#endif
 } FATFS;
 
 
@@ -362,6 +375,9 @@ typedef struct _FIL_ {
 	DWORD	org_clust;	/* File start cluster */
 	DWORD	curr_clust;	/* Current cluster */
 	DWORD	dsect;		/* Current data sector */
+#if _USE_FASTSEEK
+	DWORD*	cltbl;		/* Pointer to the cluster link map table (null on file open) */
+#endif
 #if !_FS_READONLY
 	DWORD	dir_sect;	/* Sector containing the directory entry */
 	BYTE*	dir_ptr;	/* Ponter to the directory entry in the window */
@@ -407,7 +423,8 @@ typedef enum {
 	FR_NOT_ENABLED,		/* 12 */
 	FR_NO_FILESYSTEM,	/* 13 */
 	FR_MKFS_ABORTED,	/* 14 */
-	FR_TIMEOUT			/* 15 */
+	FR_TIMEOUT,			/* 15 */
+	FR_NOT_ENOUGH_CORE	/* 16 */
 } FRESULT;
 
 
@@ -434,9 +451,21 @@ FRESULT f_utime (const XCHAR*, const FILINFO*);		/* Change timestamp of the file
 FRESULT f_rename (const XCHAR*, const XCHAR*);		/* Rename/Move a file or directory */
 FRESULT f_forward (FIL*, UINT(*)(const BYTE*,UINT), UINT, UINT*);	/* Forward data to the stream */
 FRESULT f_mkfs (BYTE, BYTE, WORD, char *, BYTE);	/* Create a file system on the drive */
+#if _USE_EXPAND && _USE_FREE_MAP
+FRESULT f_expand (FIL*, DWORD, DWORD*);				/* Allocate the clusters of an empty file in advance */
+#endif
 FRESULT f_chdir (const XCHAR*);						/* Change current directory */
 FRESULT f_chdrive (BYTE);							/* Change current drive */
 
+/* Cluster-level access to a mounted volume, for working below the file level */
+DWORD get_fat (FATFS*, DWORD);						/* Read value of a FAT entry */
+DWORD clust2sect (FATFS*, DWORD);					/* Get sector# from cluster# */
+
+#if _USE_FAT_CACHE
+void f_fatcache (DWORD);							/* Set the memory limit for holding FATs in memory */
+void f_fatcache_usage (DWORD*, DWORD*);				/* Get memory held by FATs, and needed by FATs over the limit */
+#endif
+
 #if _USE_STRFUNC
 int f_putc (int, FIL*);								/* Put a character to the file */
 int f_puts (const char*, FIL*);						/* Put a string to the file */
@@ -502,6 +531,13 @@ void ff_rel_grant(_SYNC_t);
 #define FS_FAT32	3
 
 
+/* Offset that makes f_lseek build the cluster link map instead of seeking */
+
+#if _USE_FASTSEEK
+#define CREATE_LINKMAP	0xFFFFFFFF
+#endif
+
+
 /* File attribute bits for directory entry */
 
 #define	AM_RDO	0x01	/* Read only */
@@ -120,7 +120,7 @@
 /* Number of volumes (logical drives) to be used. */
 
 
-#define	_MAX_SS		512		/* 512, 1024, 2048 or 4096 */
+#define	_MAX_SS		4096	/* 512, 1024, 2048 or 4096 */
 /* Maximum sector size to be handled.
 /  Always set 512 for memory card and hard disk but a larger value may be
 /  required for floppy disk (512/1024) and optical disk (512/2048).
@@ -128,6 +128,41 @@
 /  to the disk_ioctl function. */
 
 
+#define	_MAX_RUNS	16		/* 1 or more */
+/* Maximum number of runs of sectors that f_read and f_write gather into a
+/  single vectored disk request when a transfer spans several clusters.
+/  Clusters that lie next to each other on the disk share a run. */
+
+
+#define	_USE_FAT_CACHE	1		/* 0 or 1 */
+/* When _USE_FAT_CACHE is set to 1, the whole FAT of a volume can be held in
+/  memory from the time it is mounted, so that following a chain never goes to
+/  the disk, and changed FAT sectors are written out to all FAT copies together
+/  at each sync. f_fatcache() sets how much memory a volume's FAT may take;
+/  volumes with larger FATs are worked on through the window as usual. */
+
+
+#define	_USE_FREE_MAP	1		/* 0 or 1 */
+/* When _USE_FREE_MAP is set to 1, a bitmap of the free clusters of a volume is
+/  built from its FAT the first time a cluster is allocated or the free space
+/  is counted, and kept up to date from then on, so that finding a free cluster
+/  skips over whole words of clusters in use at a time. It has no effect when
+/  _FS_READONLY is 1. */
+
+
+#define	_USE_EXPAND		1		/* 0 or 1 */
+/* To enable f_expand, which allocates all the clusters of a file of known size
+/  up front, in one run where there is one, set _USE_EXPAND to 1. It needs the
+/  free map, so _USE_FREE_MAP must be 1 too. */
+
+
+#define	_USE_FASTSEEK	1		/* 0 or 1 */
+/* To enable the cluster link map, set _USE_FASTSEEK to 1. A file given a link
+/  map table (the cltbl member of FIL) and mapped with f_lseek(fp, CREATE_LINKMAP)
+/  is then seeked, read and written by looking its clusters up in the table, as
+/  runs of consecutive clusters, rather than by following the chain in the FAT. */
+
+
 #define	_MULTI_PARTITION	0	/* 0 or 1 */
 /* When _MULTI_PARTITION is set to 0, each volume is bound to the same physical
 / drive number and can mount only first primaly partition. When it is set to 1,
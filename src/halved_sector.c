@@ -0,0 +1,199 @@
+/* Halved HDF images, as used with 8-bit IDE interfaces, keep only the low
+byte of each 16-bit word that passes over the IDE bus, so each 512-byte
+sector is stored as 256 bytes. An 8-bit interface sees just those bytes, one
+after another, so that is also how its filesystem is laid out; a halved
+image is therefore worked on with its stored bytes as they stand, two stored
+sectors making each 512-byte one, and needs nothing from here.
+
+Converting a halved image to a full one spreads each stored byte out into
+the low byte of a word whose high byte is zero, which is what a 16-bit host
+would read from the same drive. The layer here presents such a full image
+the way an 8-bit interface sees it: the low bytes of each pair of sectors
+make up one 512-byte sector. Clone uses it to convert in either direction,
+and images converted from halved ones are opened through it so that their
+filesystem can still be found. Gathering and spreading the low bytes is done
+a vector at a time where the processor allows, so that bulk transfers run at
+memory speed. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "volume_container.h"
+#include "halved_sector.h"
+
+/* Bytes of the full image passed to the underlying container in one transfer */
+#define HALVED_BUFFER_SIZE 131072
+
+typedef struct st_halved_sector {
+	unsigned char *buffer;
+} halved_sector;
+
+/* Expand count bytes at src into 2 * count bytes at dest, as the low bytes of
+words whose high bytes are zero */
+static void halved_expand(unsigned char *dest, const unsigned char *src, size_t count) {
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i data;
+
+	for (; i + 16 <= count; i += 16) {
+		data = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dest + i * 2), _mm_unpacklo_epi8(data, zero));
+		_mm_storeu_si128((__m128i *)(dest + i * 2 + 16), _mm_unpackhi_epi8(data, zero));
+	}
+#endif
+	for (; i < count; i++) {
+		dest[i * 2] = src[i];
+		dest[i * 2 + 1] = 0;
+	}
+}
+
+/* Pack the low bytes of count words at src into count bytes at dest.
+Returns -1 if any of the high bytes was non-zero, and so has been lost */
+static int halved_pack(unsigned char *dest, const unsigned char *src, size_t count) {
+	size_t i = 0;
+	unsigned char high_bytes = 0;
+#ifdef __SSE2__
+	__m128i low_mask = _mm_set1_epi16(0x00ff);
+	__m128i high = _mm_setzero_si128();
+	__m128i lo, hi;
+
+	for (; i + 16 <= count; i += 16) {
+		lo = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		hi = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+		high = _mm_or_si128(high, _mm_andnot_si128(low_mask, _mm_or_si128(lo, hi)));
+		_mm_storeu_si128((__m128i *)(dest + i),
+			_mm_packus_epi16(_mm_and_si128(lo, low_mask), _mm_and_si128(hi, low_mask)));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, _mm_setzero_si128())) != 0xffff) high_bytes = 1;
+#endif
+	for (; i < count; i++) {
+		dest[i] = src[i * 2];
+		high_bytes |= src[i * 2 + 1];
+	}
+	return high_bytes ? -1 : 0;
+}
+
+static ssize_t halved_sector_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	halved_sector *h = v->data.layer.state;
+	unsigned char *out = buf;
+	size_t done = 0, len;
+
+	while (done < count) {
+		len = count - done;
+		if (len > HALVED_BUFFER_SIZE / 2) len = HALVED_BUFFER_SIZE / 2;
+		if (parent->read(parent, (position + done) * 2, h->buffer, len * 2) != (ssize_t)(len * 2)) return -1;
+		if (halved_pack(out + done, h->buffer, len) == -1) {
+			fprintf(stderr, "Image has data in the high bytes of its words, which a halved image can't hold\n");
+			return -1;
+		}
+		done += len;
+	}
+	return done;
+}
+
+static ssize_t halved_sector_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	halved_sector *h = v->data.layer.state;
+	unsigned char *in = buf;
+	size_t done = 0, len;
+
+	while (done < count) {
+		len = count - done;
+		if (len > HALVED_BUFFER_SIZE / 2) len = HALVED_BUFFER_SIZE / 2;
+		halved_expand(h->buffer, in + done, len);
+		if (parent->write(parent, (position + done) * 2, h->buffer, len * 2) != (ssize_t)(len * 2)) return -1;
+		done += len;
+	}
+	return done;
+}
+
+static int halved_sector_sync(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	return (parent->sync == NULL) ? 0 : parent->sync(parent);
+}
+
+/* Holes in the full image are holes here too, at half the offset */
+static int halved_sector_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	volume_container *parent = v->data.layer.parent;
+
+	if (parent->find_data(parent, position * 2, data_start, data_end) == -1) return -1;
+	*data_start /= 2;
+	*data_end = (*data_end + 1) / 2;
+	return 0;
+}
+
+static int halved_sector_close(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	halved_sector *h = v->data.layer.state;
+	int res;
+
+	res = parent->close(parent);
+	free(h->buffer);
+	free(h);
+	free(parent);
+	return res;
+}
+
+/* Whether the full image v holds a volume in the low bytes of its words
+alone, as one converted from a halved image does: its first sector, taken
+from the low bytes of the first two, ends in a boot signature, and the high
+bytes of both are zero. Returns 1 if so, 0 if not and -1 on error */
+int halved_sector_detect(volume_container *v) {
+	unsigned char buf[1024];
+	int i;
+
+	if (v->bytes_per_sector != 512 || v->sector_count < 2) return 0;
+	if (v->read(v, 0, buf, sizeof(buf)) != sizeof(buf)) return -1;
+	for (i = 1; i < (int)sizeof(buf); i += 2) {
+		if (buf[i] != 0) return 0;
+	}
+	return (buf[1020] == 0x55 && buf[1022] == 0xaa);
+}
+
+/* Present the low bytes of the full image v as a disk with half as many
+512-byte sectors, as an 8-bit interface would see it. Reading fails if any
+high byte is non-zero, since that data can't be carried over to a halved
+image; writing zeroes the high bytes. v is modified in place, like
+sector_cache_open. */
+int halved_sector_open(volume_container *v) {
+	volume_container *parent;
+	halved_sector *h;
+
+	if (v->bytes_per_sector != 512) {
+		fprintf(stderr, "Only images with 512-byte sectors can be halved\n");
+		return -1;
+	}
+
+	parent = malloc(sizeof(volume_container));
+	h = malloc(sizeof(halved_sector));
+	if (h) h->buffer = malloc(HALVED_BUFFER_SIZE);
+	if (!parent || !h || !h->buffer) {
+		if (h) free(h->buffer);
+		free(h);
+		free(parent);
+		fprintf(stderr, "Out of memory opening halved image\n");
+		return -1;
+	}
+	*parent = *v;
+
+	v->read = &halved_sector_read;
+	v->write = &halved_sector_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &halved_sector_close;
+	v->sync = &halved_sector_sync;
+	v->find_data = (parent->find_data != NULL) ? &halved_sector_find_data : NULL;
+	v->sector_count = parent->sector_count / 2;
+	v->data.layer.parent = parent;
+	v->data.layer.state = h;
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef __HALVED_SECTOR_H
+#define __HALVED_SECTOR_H
+
+#include "volume_container.h"
+
+int halved_sector_detect(volume_container *v);
+int halved_sector_open(volume_container *v);
+
+#endif /* #ifdef __HALVED_SECTOR_H */
@@ -16,13 +16,18 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
+
 #define DIR FATDIR
 #include "ff.h"
 #undef DIR
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -30,11 +35,40 @@
 
 #include "image_file.h"
 #include "diskio.h"
+#include "sector_cache.h"
+#include "clone.h"
+#include "compressed_image.h"
+#include "overlay_image.h"
+#include "dedup_image.h"
+#include "ram_disk.h"
+#include "mbr.h"
+#include "halved_sector.h"
+#include "readahead.h"
+#include "io_stats.h"
 
 #include "ffconf.h"
 
-#define BUFFER_SIZE 2048
-#define CLONE_BUFFER_SIZE 1048576
+#define BUFFER_SIZE 262144
+#define URING_QUEUE_DEPTH 8
+#define FAT_CACHE_DEFAULT_LIMIT 67108864
+#define LINK_MAP_MAX_SIZE 65536 /* items to allocate for a link map before finding out how many it needs */
+
+/* Global options, which may appear anywhere on the command line */
+static int use_mmap = 0;
+static int use_uring = 0;
+static int use_ram = 0;
+static unsigned long long ram_limit = 0; /* 0 for no limit */
+static int selected_partition = 0; /* 1-4, or 0 for the whole image */
+static int create_halved = 0; /* create HDF images with halved sectors */
+/* Open and create full images through the low bytes of their words, which
+is where a halved image's contents go when it is converted to a full one */
+static int use_low_bytes = 0;
+/* Set by open_container_file when the volume it opened is kept in low bytes
+alone: a halved image, or a full image converted from one */
+static int low_bytes_opened = 0;
+static unsigned int sector_size = 0; /* sector size to format with, or 0 to go by the image */
+/* Set by commands that accept --direct */
+static int use_direct = 0;
 
 /* Print an error message for an error returned from the FAT driver */
 static void fat_perror(char *custom_message, FRESULT result) {
@@ -88,18 +122,179 @@ static void fat_perror(char *custom_message, FRESULT result) {
 		case FR_TIMEOUT:
 			error_message = "Timeout";
 			break;
+		case FR_NOT_ENOUGH_CORE:
+			error_message = "Not enough memory";
+			break;
 		default:
 			error_message = "Unknown error code";
 	}
 	printf("%s: %s\n", custom_message, error_message);
 }
 
-/* Open the file at pathname as an HDF or raw disk image, populating the passed
-volume container and opening it as disk 0 for the FAT driver */
-static int open_image(char *pathname, volume_container *vol, FATFS *fatfs, int writeable) {
+/* Switch a newly opened image file over to the access method chosen by the
+global options */
+static int select_image_access(volume_container *vol, int writeable) {
+	if (use_mmap) {
+		return image_file_map(vol, writeable);
+	}
+	if (use_direct) {
+		return image_file_direct(vol);
+	}
+	if (use_uring) {
+		/* quietly stay with synchronous I/O if io_uring is unavailable */
+		image_file_uring(vol, URING_QUEUE_DEPTH);
+	}
+	return 0;
+}
+
+static int open_container(char *pathname, volume_container *vol, int writeable);
+
+/* Open the overlay file at pathname along with the base image it refers to,
+which is opened writeable only if base_writeable is set */
+static int open_overlay(char *pathname, volume_container *vol, int writeable, int base_writeable) {
+	char *base_pathname;
+	volume_container *base;
+	
+	base_pathname = overlay_image_base(pathname);
+	if (base_pathname == NULL) return -1;
+	
+	base = malloc(sizeof(volume_container));
+	if (!base) {
+		printf("Out of memory\n");
+		free(base_pathname);
+		return -1;
+	}
+	if (open_container(base_pathname, base, base_writeable) == -1) {
+		free(base);
+		free(base_pathname);
+		return -1;
+	}
+	free(base_pathname);
+	
+	if (overlay_image_open(vol, pathname, writeable, base) == -1) {
+		base->close(base);
+		free(base);
+		return -1;
+	}
+	return 0;
+}
+
+/* If pathname ends in @N, with N a partition number, and is not the name of
+an existing file, return the part before the @ as a new string and set
+partition_number to N; otherwise return NULL */
+static char *split_partition_suffix(char *pathname, int *partition_number) {
+	char *at, *end, *image_pathname;
+	struct stat fileinfo;
+	long number;
+	
+	at = strrchr(pathname, '@');
+	if (at == NULL || at[1] == '\0' || stat(pathname, &fileinfo) == 0) return NULL;
+	number = strtol(at + 1, &end, 10);
+	if (*end != '\0' || number < 1 || number > MBR_PARTITION_COUNT) return NULL;
+	
+	image_pathname = malloc(at - pathname + 1);
+	if (!image_pathname) return NULL;
+	memcpy(image_pathname, pathname, at - pathname);
+	image_pathname[at - pathname] = '\0';
+	*partition_number = number;
+	return image_pathname;
+}
+
+/* Narrow an open container down to one of the partitions listed in its
+partition table, numbered from 1 */
+static int open_partition(volume_container *vol, int partition_number) {
+	partition_info table[MBR_PARTITION_COUNT];
+	
+	if (mbr_read_partition_table(vol, table) == -1
+		|| partition_open(vol, &table[partition_number - 1]) == -1) {
+		printf("Cannot open partition %d\n", partition_number);
+		vol->close(vol);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_container_file(char *pathname, volume_container *vol, int writeable);
+
+/* Open the file at pathname as a disk image, populating the passed volume
+container. A name of the form image@N opens partition N of the image */
+static int open_container(char *pathname, volume_container *vol, int writeable) {
+	char *image_pathname;
+	int partition_number, res;
+	
+	image_pathname = split_partition_suffix(pathname, &partition_number);
+	if (image_pathname == NULL) return open_container_file(pathname, vol, writeable);
+	
+	res = open_container_file(image_pathname, vol, writeable);
+	free(image_pathname);
+	if (res == -1) return -1;
+	return open_partition(vol, partition_number);
+}
+
+/* Whether pathname picks out a partition with an @N suffix */
+static int has_partition_suffix(char *pathname) {
+	int partition_number;
+	char *image_pathname;
+	
+	image_pathname = split_partition_suffix(pathname, &partition_number);
+	free(image_pathname);
+	return (image_pathname != NULL);
+}
+
+/* Open a disk image named on the command line, narrowing it down to the
+partition chosen with --partition unless its name picks one itself */
+static int open_selected(char *pathname, volume_container *vol, int writeable) {
+	if (open_container(pathname, vol, writeable) == -1) return -1;
+	
+	if (selected_partition && !has_partition_suffix(pathname)
+		&& open_partition(vol, selected_partition) == -1) return -1;
+	
+	if (io_stats_open(vol, pathname) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	return 0;
+}
+
+/* Whether the image opened by open_selected(pathname) is a single partition */
+static int is_partition_selected(char *pathname) {
+	return (selected_partition || has_partition_suffix(pathname));
+}
+
+/* A full image converted from a halved one keeps its volume in the low bytes
+of its words; work on it through those, as on the halved image itself */
+static int open_low_bytes(volume_container *vol) {
+	int res;
+	
+	if (low_bytes_opened) return 0;
+	res = use_low_bytes ? 1 : halved_sector_detect(vol);
+	if (res == -1 || (res == 1 && halved_sector_open(vol) == -1)) {
+		vol->close(vol);
+		return -1;
+	}
+	low_bytes_opened = res;
+	return 0;
+}
+
+/* Open the file at pathname as an HDF, raw, compressed, deduplicated or overlay
+disk image, populating the passed volume container */
+static int open_container_file(char *pathname, volume_container *vol, int writeable) {
 	int res;
 	
-	if (image_file_is_hdf(pathname)) {
+	low_bytes_opened = 0;
+	if (image_file_is_overlay(pathname)) {
+		/* overlay file found; writes go to the overlay, never the base */
+		return open_overlay(pathname, vol, writeable, 0);
+	} else if (image_file_is_compressed(pathname)) {
+		/* compressed image file found; the choice of access method doesn't
+		apply to these */
+		if (compressed_image_open(vol, pathname, writeable) == -1) return -1;
+		return open_low_bytes(vol);
+	} else if (image_file_is_dedup(pathname)) {
+		/* index file of an image in a deduplicating store */
+		if (dedup_image_open(vol, pathname, writeable) == -1) return -1;
+		return open_low_bytes(vol);
+	} else if (image_file_is_hdf(pathname)) {
 		/* HDF image file found */;
 		res = hdf_image_open(vol, pathname, writeable);
 	} else {
@@ -108,11 +303,66 @@ static int open_image(char *pathname, volume_container *vol, FATFS *fatfs, int w
 	}
 	if (res) return -1;
 	
-	disk_map(0, vol);
+	if (vol->bytes_per_sector == 256) {
+		/* a halved HDF keeps just the low byte of each word, 256 bytes to a
+		sector; an 8-bit interface sees those bytes one after another, so they
+		are worked on as they stand, two stored sectors to each 512-byte one */
+		if (sector_size != 0 && sector_size != 512) {
+			printf("Halved images can only have 512-byte sectors\n");
+			vol->close(vol);
+			return -1;
+		}
+		if (image_file_set_sector_size(vol, 512) == -1) {
+			vol->close(vol);
+			return -1;
+		}
+		low_bytes_opened = 1;
+	} else {
+		/* go by the sector size that the filesystem was laid out with,
+		unless we're about to lay out a new one */
+		if (sector_size == 0) res = volume_detect_sector_size(vol);
+		else res = sector_size;
+		if (res != 0 && (unsigned int)res != vol->bytes_per_sector) {
+			if (image_file_set_sector_size(vol, res) == -1) {
+				vol->close(vol);
+				return -1;
+			}
+			/* a new layout's sector size goes in the HDF header too, so that
+			the image is read back the same way */
+			if (sector_size != 0 && writeable && hdf_image_update_size(vol) == -1) {
+				vol->close(vol);
+				return -1;
+			}
+		}
+	}
+	
+	if (select_image_access(vol, writeable) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	
+	return open_low_bytes(vol);
+}
+
+/* Open the file at pathname as a disk image, populating the passed volume
+container and opening it as disk 0 for the FAT driver */
+static int open_image(char *pathname, volume_container *vol, FATFS *fatfs, int writeable) {
+	if (open_selected(pathname, vol, writeable) == -1) return -1;
+	
+	if (writeable && use_ram && ram_disk_open(vol, ram_limit, 0) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	
+	if (disk_map(0, vol) == -1) {
+		vol->close(vol);
+		return -1;
+	}
 	
 	if (fatfs != NULL) {
 		if (f_mount(0, fatfs) != FR_OK) {
 			printf("mount failed\n");
+			vol->close(vol);
 			return -1;
 		}
 	}
@@ -120,15 +370,71 @@ static int open_image(char *pathname, volume_container *vol, FATFS *fatfs, int w
 	return 0;
 }
 
-static int filename_is_hdf(char *filename) {
-	size_t len;
+static int filename_has_extension(char *filename, char *extension);
+
+/* Create a new image file at pathname, in HDF, compressed or raw format
+according to its filename extension */
+static int create_image(char *pathname, volume_container *vol, unsigned long long sector_count,
+	unsigned int bytes_per_sector) {
+	int res;
+	
+	if (create_halved && (!filename_has_extension(pathname, ".hdf") || bytes_per_sector != 512)) {
+		printf("Only HDF images with 512-byte sectors can be halved\n");
+		return -1;
+	}
+	
+	/* a full image holding a volume in the low bytes of its words needs
+	twice the space */
+	if (use_low_bytes && !create_halved) sector_count *= 2;
+	
+	if (filename_has_extension(pathname, ".hdz")) {
+		if (compressed_image_create(vol, pathname, sector_count, bytes_per_sector) == -1) return -1;
+	} else {
+		if (create_halved) {
+			/* two 256-byte stored sectors to each 512-byte one, as when opening */
+			res = hdf_image_create_halved(vol, pathname, sector_count * 2);
+			if (res == 0 && image_file_set_sector_size(vol, 512) == -1) {
+				vol->close(vol);
+				return -1;
+			}
+		} else if (filename_has_extension(pathname, ".hdf")) {
+			res = hdf_image_create(vol, pathname, sector_count, bytes_per_sector);
+		} else {
+			res = raw_image_create(vol, pathname, sector_count, bytes_per_sector);
+		}
+		if (res) return -1;
+		
+		if (select_image_access(vol, 1) == -1) {
+			vol->close(vol);
+			return -1;
+		}
+	}
+	
+	if (use_low_bytes && !create_halved && halved_sector_open(vol) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	
+	if (io_stats_open(vol, pathname) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	
+	/* a new image is all zeroes, so there's nothing to read back from it */
+	if (use_ram && ram_disk_open(vol, ram_limit, 1) == -1) {
+		vol->close(vol);
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int filename_has_extension(char *filename, char *extension) {
+	size_t len, extension_len;
 	
 	len = strlen(filename);
-	return (
-		(filename[len-3] == 'h' || filename[len-3] == 'H')
-		&& (filename[len-2] == 'd' || filename[len-2] == 'D')
-		&& (filename[len-1] == 'f' || filename[len-1] == 'F')
-	);
+	extension_len = strlen(extension);
+	return (len >= extension_len && strcasecmp(filename + len - extension_len, extension) == 0);
 }
 
 static int fat_path_is_dir(XCHAR *filename) {
@@ -172,6 +478,37 @@ static void strip_trailing_slash(char *path) {
 	if (*path == '\\' || *path == '/') *path = '\0';
 }
 
+/* Parse a sector size given with --sector-size */
+static int parse_sector_size(char *size_string, unsigned int *size) {
+	*size = strtoul(size_string, NULL, 10);
+	if (*size != 512 && *size != 1024 && *size != 2048 && *size != 4096) {
+		printf("Sector size must be 512, 1024, 2048 or 4096 bytes\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse a size such as 64M or 1.5G into a number of bytes */
+static int parse_size(char *size_string, unsigned long long *bytes) {
+	double unconverted_size;
+	char *unit;
+	
+	unconverted_size = strtod(size_string, &unit);
+	if (*unit == 'G' || *unit == 'g') {
+		*bytes = (unsigned long long) (unconverted_size * (1<<30));
+	} else if (*unit == 'M' || *unit == 'm') {
+		*bytes = (unsigned long long) (unconverted_size * (1<<20));
+	} else if (*unit == 'K' || *unit == 'k') {
+		*bytes = (unsigned long long) (unconverted_size * (1<<10));
+	} else if (*unit == 'B' || *unit == 'b' || *unit == 0) {
+		*bytes = (unsigned long long) unconverted_size;
+	} else {
+		printf("Unrecognised size unit specifier: %c\n", *unit);
+		return -1;
+	}
+	return 0;
+}
+
 static int is_directory(char *path) {
 	struct stat fileinfo;
 	
@@ -182,96 +519,210 @@ static int is_directory(char *path) {
 }
 
 static int cmd_clone(int argc, char *argv[]) {
-	char *source_filename;
-	char *destination_filename;
+	char *source_filename = NULL;
+	char *destination_filename = NULL;
 	volume_container source_vol, destination_vol;
-	char buffer[CLONE_BUFFER_SIZE];
-	size_t total_size, transfer_size;
-	off_t position;
+	FATFS fatfs;
+	FATDIR dir;
+	FRESULT result;
+	clone_options options;
+	clone_stats stats;
+	unsigned long long chunk_size = CLONE_DEFAULT_CHUNK_SIZE;
+	int used_only = 0;
+	int i, res;
 	
-	if (argc >= 3) {
-		source_filename = argv[2];
-	} else {
+	options.depth = CLONE_DEFAULT_DEPTH;
+	options.progress = isatty(fileno(stderr));
+	
+	int arg_num = 0;
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "--direct") == 0) {
+			use_direct = 1;
+		} else if (strcmp(argv[i], "--used-only") == 0) {
+			used_only = 1;
+		} else if (strcmp(argv[i], "--halved") == 0) {
+			create_halved = 1;
+		} else if (strcmp(argv[i], "--progress") == 0) {
+			options.progress = 1;
+		} else if (strncmp(argv[i], "--chunk-size=", 13) == 0) {
+			if (parse_size(argv[i] + 13, &chunk_size) == -1) return -1;
+		} else if (strncmp(argv[i], "--depth=", 8) == 0) {
+			options.depth = atoi(argv[i] + 8);
+		} else {
+			switch (arg_num) {
+				case 0:
+					source_filename = argv[i];
+					arg_num++;
+					break;
+				case 1:
+					destination_filename = argv[i];
+					arg_num++;
+					break;
+				default:
+					arg_num++;
+			}
+		}
+	}
+	
+	if (arg_num < 1) {
 		printf("No source image filename supplied\n");
 		return -1;
 	}
 	
-	if (argc >= 4) {
-		destination_filename = argv[3];
-	} else {
+	if (arg_num < 2) {
 		printf("No destination image filename supplied\n");
 		return -1;
 	}
 	
-	if (open_image(source_filename, &source_vol, NULL, 0) == -1) {
+	if (chunk_size < 512 || chunk_size % 512 != 0 || chunk_size > (1 << 30)) {
+		printf("Chunk size must be a multiple of 512 bytes, up to 1G\n");
 		return -1;
 	}
+	options.chunk_size = chunk_size;
 	
-	if (filename_is_hdf(destination_filename)) {
-		if (hdf_image_create(&destination_vol, destination_filename, source_vol.sector_count) == -1) {
-			source_vol.close(&source_vol);
-			return -1;
-		}
+	if (options.depth < 1) {
+		printf("Depth must be at least 1\n");
+		return -1;
+	}
+	
+	/* a halved image can hold only the low bytes of the source, and reading
+	the source through them fails if any of the others are in use */
+	use_low_bytes = create_halved;
+	if (used_only) {
+		if (open_image(source_filename, &source_vol, &fatfs, 0) == -1) return -1;
 	} else {
-		if (raw_image_create(&destination_vol, destination_filename, source_vol.sector_count) == -1) {
+		/* the source is read straight through once, so leave out the caches
+		that open_image would put over it; that also leaves a plain image file
+		as just that, for clone_volume to reflink or copy_file_range from */
+		if (open_selected(source_filename, &source_vol, 0) == -1) return -1;
+	}
+	
+	if (used_only) {
+		/* opening the root directory is enough to mount the filesystem */
+		result = f_opendir(&dir, "0:");
+		if (result == FR_NO_FILESYSTEM) {
+			printf("No FAT filesystem found; copying the whole image\n");
+			used_only = 0;
+		} else if (result != FR_OK) {
+			fat_perror("Error reading filesystem", result);
 			source_vol.close(&source_vol);
 			return -1;
 		}
 	}
 	
-	position = 0;
-	total_size = source_vol.bytes_per_sector * source_vol.sector_count;
+	/* a full copy of a volume kept in low bytes keeps it in low bytes too */
+	use_low_bytes = low_bytes_opened;
+	if (create_image(destination_filename, &destination_vol, source_vol.sector_count, source_vol.bytes_per_sector) == -1) {
+		source_vol.close(&source_vol);
+		return -1;
+	}
 	
-	while (position < total_size) {
-		transfer_size = total_size - position;
-		if (transfer_size > CLONE_BUFFER_SIZE) transfer_size = CLONE_BUFFER_SIZE;
-		if (source_vol.read(&source_vol, position, buffer, transfer_size) < 0) {
-			source_vol.close(&source_vol);
-			destination_vol.close(&destination_vol);
-			return -1;
-		}
-		if (destination_vol.write(&destination_vol, position, buffer, transfer_size) < 0) {
-			source_vol.close(&source_vol);
-			destination_vol.close(&destination_vol);
-			return -1;
-		}
-		position += transfer_size;
+	if (used_only) {
+		res = clone_volume_used(&destination_vol, &source_vol, &fatfs, &options, &stats);
+	} else {
+		res = clone_volume(&destination_vol, &source_vol, &options, &stats);
+	}
+	if (res == -1) {
+		source_vol.close(&source_vol);
+		destination_vol.close(&destination_vol);
+		return -1;
+	}
+	
+	if (stats.reflinked) {
+		printf("Cloned by reflink; no data copied\n");
+	} else {
+		printf("Copied %llu bytes; skipped %llu bytes of holes, zeroes and free space\n",
+			(unsigned long long)stats.bytes_copied, (unsigned long long)stats.bytes_skipped);
 	}
 	
 	source_vol.close(&source_vol);
-	destination_vol.close(&destination_vol);
-	return 0;
+	return destination_vol.close(&destination_vol);
+}
+
+/* Give a file a link map of its clusters, so that seeking and reading within it
+look clusters up in memory rather than following the chain through the FAT.
+Returns the table, to be freed once the file is closed, or NULL to carry on
+without one */
+static DWORD *map_file(FIL *file) {
+	DWORD *table;
+	DWORD cluster_size = (DWORD)SS(file->fs) * file->fs->csize;
+	DWORD table_size;
+	FRESULT result;
+	
+	/* enough for every cluster to be a run of its own, so that the chain
+	only has to be walked once */
+	table_size = 2 * ((file->fsize + cluster_size - 1) / cluster_size) + 2;
+	if (table_size > LINK_MAP_MAX_SIZE) table_size = LINK_MAP_MAX_SIZE;
+	
+	for (;;) {
+		table = malloc(table_size * sizeof(DWORD));
+		if (!table) return NULL;
+		table[0] = table_size;
+		file->cltbl = table;
+		result = f_lseek(file, CREATE_LINKMAP);
+		if (result == FR_OK) return table;
+		
+		/* too fragmented to fit; try again with as much room as it asked for */
+		table_size = table[0];
+		free(table);
+		if (result != FR_NOT_ENOUGH_CORE) return NULL;
+	}
 }
 
 static int cmd_get(int argc, char *argv[]) {
-	char *image_filename;
-	char *source_filename;
+	char *image_filename = NULL;
+	char *source_filename = NULL;
+	char *destination_filename = NULL;
 	
 	volume_container vol;
 	FATFS fatfs;
 	FRESULT result;
 	FIL input_file;
 	FILE *output_stream;
+	DWORD *link_map;
+	unsigned long long offset = 0;
+	unsigned long long length = 0;
+	int have_length = 0;
+	int i;
 	
-	char buffer[BUFFER_SIZE];
-	UINT bytes_read;
+	static char buffer[BUFFER_SIZE];
+	UINT bytes_wanted, bytes_read;
 	
-	if (argc >= 3) {
-		image_filename = argv[2];
-	} else {
+	int arg_num = 0;
+	for (i = 2; i < argc; i++) {
+		if (strncmp(argv[i], "--offset=", 9) == 0) {
+			if (parse_size(argv[i] + 9, &offset) == -1) return -1;
+		} else if (strncmp(argv[i], "--length=", 9) == 0) {
+			if (parse_size(argv[i] + 9, &length) == -1) return -1;
+			have_length = 1;
+		} else {
+			switch (arg_num) {
+				case 0:
+					image_filename = argv[i];
+					break;
+				case 1:
+					source_filename = argv[i];
+					break;
+				case 2:
+					destination_filename = argv[i];
+					break;
+			}
+			arg_num++;
+		}
+	}
+	
+	if (arg_num < 1) {
 		printf("No image filename supplied\n");
 		return -1;
 	}
 
-	if (argc >= 4) {
-		source_filename = argv[3];
-	} else {
+	if (arg_num < 2) {
 		printf("No source filename supplied\n");
 		return -1;
 	}
 	
-	if (argc >= 5) {
-		output_stream = fopen(argv[4], "wb");
+	if (destination_filename) {
+		output_stream = fopen(destination_filename, "wb");
 		if (!output_stream) {
 			perror("Could not open file for writing");
 			return -1;
@@ -287,33 +738,85 @@ static int cmd_get(int argc, char *argv[]) {
 	result = f_open(&input_file, source_filename, FA_READ | FA_OPEN_EXISTING);
 	if (result != FR_OK) {
 		fat_perror("Error opening file", result);
+		vol.close(&vol);
 		return -1;
 	}
-	
-	do {
-		result = f_read(&input_file, buffer, BUFFER_SIZE, &bytes_read);
-		if (result != FR_OK) {
-			fat_perror("Error reading file", result);
-			f_close(&input_file);
-			return -1;
+	link_map = map_file(&input_file);
+	
+	if (offset > input_file.fsize) offset = input_file.fsize;
+	if (!have_length || length > input_file.fsize - offset) length = input_file.fsize - offset;
+	
+	result = f_lseek(&input_file, offset);
+	while (result == FR_OK && length > 0) {
+		bytes_wanted = (length < BUFFER_SIZE) ? length : BUFFER_SIZE;
+		result = f_read(&input_file, buffer, bytes_wanted, &bytes_read);
+		if (result == FR_OK && bytes_read != bytes_wanted) result = FR_INT_ERR;
+		if (result == FR_OK) {
+			fwrite(buffer, 1, bytes_read, output_stream);
+			length -= bytes_read;
 		}
-		fwrite(buffer, 1, bytes_read, output_stream);
-	} while (bytes_read == BUFFER_SIZE);
+	}
+	if (result != FR_OK) {
+		fat_perror("Error reading file", result);
+		f_close(&input_file);
+		free(link_map);
+		vol.close(&vol);
+		return -1;
+	}
 	
 	f_close(&input_file);
+	free(link_map);
 	if (output_stream != stdout) {
 		fclose(output_stream);
 	}
 	
-	return 0;
+	return vol.close(&vol);
+}
+
+/* Allocate all the clusters of a newly created file of known size up front,
+so that it ends up in one piece if there's room for it anywhere, and say so
+if it doesn't */
+static FRESULT preallocate_file(FIL *file, XCHAR *filename, unsigned long long size) {
+	FRESULT result;
+	DWORD fragments;
+	
+	if (size == 0 || size > 0xffffffffULL) return FR_OK;
+	result = f_expand(file, size, &fragments);
+	if (result == FR_DENIED) {
+		/* not enough room; write as much as will go, as before */
+		return FR_OK;
+	}
+	if (result == FR_OK && fragments > 1) {
+		printf("%s: no contiguous space, stored in %lu fragments\n", filename, fragments);
+	}
+	return result;
+}
+
+/* Close a file that couldn't be written in full. Preallocation has already
+given it its full length, so it's first cut back to what was written, to
+keep the rest of it from reading back as whatever its clusters held before.
+Whatever went wrong with the data, the cluster chain itself is sound, so
+an abort flag left by the failure doesn't stop it being cut short; a
+failed write may have left the file's idea of its current cluster ahead of
+its position, so the position is found afresh from the start of the file. */
+static void abandon_file(FIL *file) {
+	DWORD position = file->fptr;
+	
+	file->flag &= ~FA__ERROR;
+	if (f_lseek(file, 0) == FR_OK && f_lseek(file, position) == FR_OK) {
+		f_truncate(file);
+	}
+	f_close(file);
 }
 
 static int put_file(char *source_filename, char *dest_filename) {
 	FILE *input_file;
 	FIL output_file;
 	FRESULT result;
+	struct stat input_stat;
+	DWORD *link_map = NULL;
 	
-	char buffer[BUFFER_SIZE];
+	static char buffer[BUFFER_SIZE];
 	size_t bytes_read;
 	UINT bytes_written;
 	
@@ -361,24 +864,50 @@ static int put_file(char *source_filename, char *dest_filename) {
 			return -1;
 		}
 		
+		if (fstat(fileno(input_file), &input_stat) == 0 && S_ISREG(input_stat.st_mode)) {
+			result = preallocate_file(&output_file, dest_filename, input_stat.st_size);
+			if (result != FR_OK) {
+				fat_perror("Error allocating file", result);
+				abandon_file(&output_file);
+				fclose(input_file);
+				return -1;
+			}
+			/* the clusters are all there now, so writing can step through
+			them without going back to the FAT */
+			link_map = map_file(&output_file);
+		}
+		
 		do {
 			bytes_read = fread(buffer, 1, BUFFER_SIZE, input_file);
 			if (ferror(input_file)) {
 				perror("Error reading file");
+				abandon_file(&output_file);
+				fclose(input_file);
+				free(link_map);
 				return -1;
 			}
 			if (bytes_read != 0) {
 				result = f_write(&output_file, buffer, bytes_read, &bytes_written);
 				if (result != FR_OK) {
 					fat_perror("Error writing file", result);
-					f_close(&output_file);
+					abandon_file(&output_file);
+					fclose(input_file);
+					free(link_map);
 					return -1;
 				}
 			}
 		} while (bytes_read == BUFFER_SIZE);
 		
 		fclose(input_file);
+		/* let go of anything allocated beyond what was written, in case the
+		file shrank while being copied */
+		result = f_truncate(&output_file);
 		f_close(&output_file);
+		free(link_map);
+		if (result != FR_OK) {
+			fat_perror("Error writing file", result);
+			return -1;
+		}
 	}
 
 	return 0;
@@ -409,33 +938,37 @@ static int cmd_put(int argc, char *argv[]) {
 	strip_trailing_slash(dest_path);
 	copying_to_dir = fat_path_is_dir(dest_path);
 	if (copying_to_dir == -1) {
+		vol.close(&vol);
 		return -1;
 	}
 	
 	if (!copying_to_dir) {
 		if (argc > 5) {
 			printf("Destination must be an existing directory when copying multiple files\n");
+			vol.close(&vol);
 			return -1;
 		}
 		
 		source_filename = argv[3];
 		
 		if ( put_file(source_filename, dest_path) == -1 ) {
+			vol.close(&vol);
 			return -1;
 		}
 		
-		return 0;
+		return vol.close(&vol);
 	} else {
 		for (i = 3; i < (argc-1); i++) {
 			dest_filename = concat_filename(dest_path, basename(argv[i]));
 			if (!dest_filename) {
 				printf("Out of memory\n");
+				vol.close(&vol);
 				return -1;
 			}
 			put_file(argv[i], dest_filename);
 			free(dest_filename);
 		}
-		return 0;
+		return vol.close(&vol);
 	}
 }
 
@@ -475,6 +1008,7 @@ static int cmd_ls(int argc, char *argv[]) {
 	
 	if ((result = f_opendir(&dir, dirname)) != FR_OK) {
 		fat_perror("Error opening dir", result);
+		vol_container.close(&vol_container);
 		return -1;
 	}
 	
@@ -485,6 +1019,7 @@ static int cmd_ls(int argc, char *argv[]) {
 	while(1) {
 		if ((result = f_readdir(&dir, &file_info)) != FR_OK) {
 			fat_perror("Error reading dir", result);
+			vol_container.close(&vol_container);
 			return -1;
 		}
 		if (file_info.fname[0] == '\0') break;
@@ -507,9 +1042,7 @@ static int cmd_ls(int argc, char *argv[]) {
 #endif
 	}
 	
-	vol_container.close(&vol_container);
-
-	return 0;
+	return vol_container.close(&vol_container);
 }
 
 static int cmd_format(int argc, char *argv[]) {
@@ -529,6 +1062,8 @@ static int cmd_format(int argc, char *argv[]) {
 			fmt = FS_FAT16;
 		} else if (strcmp(argv[i], "--fat32") == 0) {
 			fmt = FS_FAT32;
+		} else if (strncmp(argv[i], "--sector-size=", 14) == 0) {
+			if (parse_sector_size(argv[i] + 14, &sector_size) == -1) return -1;
 		} else {
 			switch (arg_num) {
 				case 0:
@@ -546,7 +1081,7 @@ static int cmd_format(int argc, char *argv[]) {
 	}
 
 	if (arg_num < 1 || arg_num > 2) {
-		printf("Usage: hdfmonkey format [--fat12|--fat16|--fat32] <imagefile> [volumelabel]\n");
+		printf("Usage: hdfmonkey format [--fat12|--fat16|--fat32] [--sector-size=<n>] <imagefile> [volumelabel]\n");
 		return -1;
 	}
 	
@@ -554,13 +1089,16 @@ static int cmd_format(int argc, char *argv[]) {
 		return -1;
 	}
 	
-	result = f_mkfs(0, 0, 0, volumelabel, fmt);
+	/* a partition gets a plain FAT volume, rather than a partition table of
+	its own */
+	result = f_mkfs(0, is_partition_selected(image_filename) ? 1 : 0, 0, volumelabel, fmt);
 	if (result != FR_OK) {
 		fat_perror("Formatting failed", result);
+		vol.close(&vol);
 		return -1;
 	}
 	
-	return 0;
+	return vol.close(&vol);
 }
 
 static int cmd_create(int argc, char *argv[]) {
@@ -568,9 +1106,8 @@ static int cmd_create(int argc, char *argv[]) {
 	volume_container vol;
 	FATFS fatfs;
 	FRESULT result;
-	double unconverted_size;
-	unsigned long converted_size;
-	char *unit;
+	char *size_string;
+	unsigned long long converted_size;
 	char *volumelabel = NULL;
 	BYTE fmt = 0;
 	int i;
@@ -583,6 +1120,8 @@ static int cmd_create(int argc, char *argv[]) {
 			fmt = FS_FAT16;
 		} else if (strcmp(argv[i], "--fat32") == 0) {
 			fmt = FS_FAT32;
+		} else if (strncmp(argv[i], "--sector-size=", 14) == 0) {
+			if (parse_sector_size(argv[i] + 14, &sector_size) == -1) return -1;
 		} else {
 			switch (arg_num) {
 				case 0:
@@ -590,7 +1129,7 @@ static int cmd_create(int argc, char *argv[]) {
 					arg_num++;
 					break;
 				case 1:
-					unconverted_size = strtod(argv[i], &unit);
+					size_string = argv[i];
 					arg_num++;
 					break;
 				case 2:
@@ -604,34 +1143,24 @@ static int cmd_create(int argc, char *argv[]) {
 	}
 
 	if (arg_num < 2 || arg_num > 3) {
-		printf("Usage: hdfmonkey create [--fat12|--fat16|--fat32] <imagefile> <size> [volumelabel]\n");
+		printf("Usage: hdfmonkey create [--fat12|--fat16|--fat32] [--sector-size=<n>] <imagefile> <size> [volumelabel]\n");
 		return -1;
 	}
 
-	if (*unit == 'G' || *unit == 'g') {
-		converted_size = (unsigned long) (unconverted_size * (1<<30) / 512);
-	} else if (*unit == 'M' || *unit == 'm') {
-		converted_size = (unsigned long) (unconverted_size * (1<<20) / 512);
-	} else if (*unit == 'K' || *unit == 'k') {
-		converted_size = (unsigned long) (unconverted_size * (1<<10) / 512);
-	} else if (*unit == 'B' || *unit == 'b' || *unit == 0) {
-		converted_size = (unsigned long) (unconverted_size / 512);
-	} else {
-		printf("Unrecognised size unit specifier: %c\n", *unit);
+	if (parse_size(size_string, &converted_size) == -1) {
 		return -1;
 	}
+	if (sector_size == 0) sector_size = 512;
+	converted_size /= sector_size;
 	
-	if (filename_is_hdf(image_filename)) {
-		if (hdf_image_create(&vol, image_filename, converted_size) == -1) {
-			return -1;
-		}
-	} else {
-		if (raw_image_create(&vol, image_filename, converted_size) == -1) {
-			return -1;
-		}
+	if (create_image(image_filename, &vol, converted_size, sector_size) == -1) {
+		return -1;
 	}
 	
-	disk_map(0, &vol);
+	if (disk_map(0, &vol) == -1) {
+		vol.close(&vol);
+		return -1;
+	}
 	
 	if (f_mount(0, &fatfs) != FR_OK) {
 		printf("mount failed\n");
@@ -646,8 +1175,7 @@ static int cmd_create(int argc, char *argv[]) {
 		return -1;
 	}
 	
-	vol.close(&vol);
-	return 0;
+	return vol.close(&vol);
 }
 
 static int cmd_mkdir(int argc, char *argv[]) {
@@ -676,10 +1204,11 @@ static int cmd_mkdir(int argc, char *argv[]) {
 	result = f_mkdir(dir_name);
 	if (result != FR_OK) {
 		fat_perror("Directory creation failed", result);
+		vol.close(&vol);
 		return -1;
 	}
 	
-	return 0;
+	return vol.close(&vol);
 }
 
 static int cmd_rm(int argc, char *argv[]) {
@@ -708,10 +1237,11 @@ static int cmd_rm(int argc, char *argv[]) {
 	result = f_unlink(filename);
 	if (result != FR_OK) {
 		fat_perror("Deletion failed", result);
+		vol.close(&vol);
 		return -1;
 	}
 	
-	return 0;
+	return vol.close(&vol);
 }
 
 /* Recursively copy directory contents file-by-file from one filesystem to another.
@@ -719,7 +1249,7 @@ The destination directory must exist. */
 static int copy_dir(XCHAR *source_dirname, XCHAR *destination_dirname) {
 	FIL source_file, destination_file;
 	FRESULT result;
-	char buffer[BUFFER_SIZE];
+	static char buffer[BUFFER_SIZE];
 	UINT bytes_read, bytes_written;
 	FATDIR source_dir;
 	FILINFO file_info;
@@ -784,6 +1314,10 @@ static int copy_dir(XCHAR *source_dirname, XCHAR *destination_dirname) {
 			}
 
 			result = f_open(&destination_file, destination_filename, FA_WRITE | FA_CREATE_ALWAYS);
+			if (result == FR_OK) {
+				result = preallocate_file(&destination_file, destination_filename, source_file.fsize);
+				if (result != FR_OK) abandon_file(&destination_file);
+			}
 			if (result != FR_OK) {
 				fat_perror("Error opening destination file", result);
 				free(source_filename);
@@ -797,7 +1331,7 @@ static int copy_dir(XCHAR *source_dirname, XCHAR *destination_dirname) {
 				if (result != FR_OK) {
 					fat_perror("Error reading file", result);
 					f_close(&source_file);
-					f_close(&destination_file);
+					abandon_file(&destination_file);
 					free(source_filename);
 					free(destination_filename);
 					return -1;
@@ -806,7 +1340,7 @@ static int copy_dir(XCHAR *source_dirname, XCHAR *destination_dirname) {
 				if (result != FR_OK) {
 					fat_perror("Error writing file", result);
 					f_close(&source_file);
-					f_close(&destination_file);
+					abandon_file(&destination_file);
 					free(source_filename);
 					free(destination_filename);
 					return -1;
@@ -814,7 +1348,16 @@ static int copy_dir(XCHAR *source_dirname, XCHAR *destination_dirname) {
 			} while (bytes_read == BUFFER_SIZE);
 
 			f_close(&source_file);
+			/* let go of anything allocated beyond what was written, in case
+			the source turned out shorter than its directory entry said */
+			result = f_truncate(&destination_file);
 			f_close(&destination_file);
+			if (result != FR_OK) {
+				fat_perror("Error writing file", result);
+				free(source_filename);
+				free(destination_filename);
+				return -1;
+			}
 		}
 
 		free(source_filename);
@@ -831,6 +1374,7 @@ static int cmd_rebuild(int argc, char *argv[]) {
 	volume_container source_vol, destination_vol;
 	FATFS source_fatfs, destination_fatfs;
 	FRESULT result;
+	unsigned int destination_sector_size = 0;
 
 	BYTE fmt = 0;
 	int i;
@@ -843,6 +1387,10 @@ static int cmd_rebuild(int argc, char *argv[]) {
 			fmt = FS_FAT16;
 		} else if (strcmp(argv[i], "--fat32") == 0) {
 			fmt = FS_FAT32;
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			use_direct = 1;
+		} else if (strncmp(argv[i], "--sector-size=", 14) == 0) {
+			if (parse_sector_size(argv[i] + 14, &destination_sector_size) == -1) return -1;
 		} else {
 			switch (arg_num) {
 				case 0:
@@ -864,7 +1412,7 @@ static int cmd_rebuild(int argc, char *argv[]) {
 	}
 
 	if (arg_num < 2 || arg_num > 3) {
-		printf("Usage: hdfmonkey rebuild [--fat12|--fat16|--fat32] <source-image-file> <destination-image-file> [volumelabel]\n");
+		printf("Usage: hdfmonkey rebuild [--fat12|--fat16|--fat32] [--direct] [--sector-size=<n>] <source-image-file> <destination-image-file> [volumelabel]\n");
 		return -1;
 	}
 	
@@ -872,19 +1420,19 @@ static int cmd_rebuild(int argc, char *argv[]) {
 		return -1;
 	}
 	
-	if (filename_is_hdf(destination_filename)) {
-		if (hdf_image_create(&destination_vol, destination_filename, source_vol.sector_count) == -1) {
-			source_vol.close(&source_vol);
-			return -1;
-		}
-	} else {
-		if (raw_image_create(&destination_vol, destination_filename, source_vol.sector_count) == -1) {
-			source_vol.close(&source_vol);
-			return -1;
-		}
+	/* the new image is the same size, but can have sectors of a different size */
+	if (destination_sector_size == 0) destination_sector_size = source_vol.bytes_per_sector;
+	if (create_image(destination_filename, &destination_vol,
+		source_vol.sector_count * source_vol.bytes_per_sector / destination_sector_size, destination_sector_size) == -1) {
+		source_vol.close(&source_vol);
+		return -1;
 	}
 	
-	disk_map(1, &destination_vol);
+	if (disk_map(1, &destination_vol) == -1) {
+		source_vol.close(&source_vol);
+		destination_vol.close(&destination_vol);
+		return -1;
+	}
 	
 	if (f_mount(1, &destination_fatfs) != FR_OK) {
 		printf("mount failed\n");
@@ -904,35 +1452,263 @@ static int cmd_rebuild(int argc, char *argv[]) {
 	copy_dir("0:", "1:");
 
 	source_vol.close(&source_vol);
-	destination_vol.close(&destination_vol);
+	return destination_vol.close(&destination_vol);
+}
+
+/* The pathname of an image as an overlay records it, independently of the
+current directory; a partition suffix is resolved along with the image's own
+pathname and kept on the end. Returns a string to be freed by the caller */
+static char *recorded_image_pathname(char *pathname) {
+	char *image_pathname, *full_pathname, *recorded;
+	int partition_number = 0;
+	
+	image_pathname = split_partition_suffix(pathname, &partition_number);
+#ifdef COMPAT_WIN32
+	full_pathname = NULL;
+#else
+	full_pathname = realpath(image_pathname ? image_pathname : pathname, NULL);
+#endif
+	free(image_pathname);
+	if (full_pathname == NULL) full_pathname = strdup(pathname);
+	if (full_pathname == NULL || partition_number == 0) return full_pathname;
+	
+	recorded = malloc(strlen(full_pathname) + 4);
+	if (recorded) sprintf(recorded, "%s@%d", full_pathname, partition_number);
+	free(full_pathname);
+	return recorded;
+}
+
+static int cmd_overlay(int argc, char *argv[]) {
+	char *base_filename;
+	char *overlay_filename;
+	char selected_filename[PATH_MAX + 8];
+	char *recorded_filename;
+	volume_container vol;
+	int res;
+	
+	if (argc < 3) {
+		printf("No base image filename supplied\n");
+		return -1;
+	}
+	base_filename = argv[2];
+	
+	if (argc < 4) {
+		printf("No overlay filename supplied\n");
+		return -1;
+	}
+	overlay_filename = argv[3];
+	
+	if (open_selected(base_filename, &vol, 0) == -1) {
+		return -1;
+	}
+	
+	/* the overlay must remember which partition it sits on */
+	if (selected_partition && !has_partition_suffix(base_filename)) {
+		snprintf(selected_filename, sizeof(selected_filename), "%s@%d", base_filename, selected_partition);
+		base_filename = selected_filename;
+	}
+	
+	recorded_filename = recorded_image_pathname(base_filename);
+	if (recorded_filename == NULL) {
+		printf("Out of memory\n");
+		vol.close(&vol);
+		return -1;
+	}
+	res = overlay_image_create(overlay_filename, recorded_filename, &vol);
+	free(recorded_filename);
+	if (res == -1) {
+		vol.close(&vol);
+		return -1;
+	}
+	
+	return vol.close(&vol);
+}
+
+static int cmd_commit(int argc, char *argv[]) {
+	char *overlay_filename;
+	volume_container vol;
+	
+	if (argc < 3) {
+		printf("No overlay filename supplied\n");
+		return -1;
+	}
+	overlay_filename = argv[2];
+	
+	if (!image_file_is_overlay(overlay_filename)) {
+		printf("%s is not an overlay\n", overlay_filename);
+		return -1;
+	}
+	
+	if (open_overlay(overlay_filename, &vol, 1, 1) == -1) {
+		return -1;
+	}
+	
+	if (overlay_image_commit(&vol) == -1) {
+		vol.close(&vol);
+		return -1;
+	}
+	
+	return vol.close(&vol);
+}
+
+static int cmd_import(int argc, char *argv[]) {
+	char *store_pathname;
+	char *source_filename;
+	char *index_filename;
+	volume_container source_vol, destination_vol;
+	clone_options options;
+	clone_stats stats;
+	unsigned long long chunks_added, chunks_shared;
+	
+	if (argc < 3) {
+		printf("No store directory supplied\n");
+		return -1;
+	}
+	store_pathname = argv[2];
+	
+	if (argc < 4) {
+		printf("No source image filename supplied\n");
+		return -1;
+	}
+	source_filename = argv[3];
+	
+	if (argc < 5) {
+		printf("No index filename supplied\n");
+		return -1;
+	}
+	index_filename = argv[4];
+	
+	options.chunk_size = CLONE_DEFAULT_CHUNK_SIZE;
+	options.depth = CLONE_DEFAULT_DEPTH;
+	options.progress = isatty(fileno(stderr));
+	
+	if (open_selected(source_filename, &source_vol, 0) == -1) {
+		return -1;
+	}
+	
+	if (dedup_image_create(&destination_vol, index_filename, store_pathname, source_vol.sector_count, source_vol.bytes_per_sector) == -1) {
+		source_vol.close(&source_vol);
+		return -1;
+	}
+	
+	if (clone_volume(&destination_vol, &source_vol, &options, &stats) == -1
+		|| destination_vol.sync(&destination_vol) == -1) {
+		source_vol.close(&source_vol);
+		destination_vol.close(&destination_vol);
+		return -1;
+	}
+	
+	dedup_image_counts(&destination_vol, &chunks_added, &chunks_shared);
+	printf("Imported %llu bytes: %llu chunks added to the store, %llu already there\n",
+		(unsigned long long)stats.bytes_copied, chunks_added, chunks_shared);
+	
+	source_vol.close(&source_vol);
+	return destination_vol.close(&destination_vol);
+}
+
+static int cmd_report(int argc, char *argv[]) {
+	dedup_report report;
+	unsigned long long used_bytes, unique_bytes, pool_bytes;
+	int i;
+	
+	if (argc < 3) {
+		printf("No index filename supplied\n");
+		return -1;
+	}
+	
+	for (i = 2; i < argc; i++) {
+		if (!image_file_is_dedup(argv[i])) {
+			printf("%s is not an image in a deduplicating store\n", argv[i]);
+			return -1;
+		}
+	}
+	
+	if (dedup_image_report(argv + 2, argc - 2, &report) == -1) {
+		return -1;
+	}
+	
+	used_bytes = report.chunks_used * report.chunk_size;
+	unique_bytes = report.chunks_unique * report.chunk_size;
+	pool_bytes = report.pool_chunks * report.chunk_size;
+	printf("Images:\t\t\t%d\n", report.image_count);
+	printf("Data in images:\t\t%llu bytes (%llu chunks of %lu bytes)\n", used_bytes, report.chunks_used, report.chunk_size);
+	printf("Data stored:\t\t%llu bytes (%llu chunks)\n", unique_bytes, report.chunks_unique);
+	if (report.chunks_unique) {
+		printf("Dedup ratio:\t\t%.2f:1\n", (double)report.chunks_used / report.chunks_unique);
+	}
+	printf("Space saved:\t\t%llu bytes\n", used_bytes - unique_bytes);
+	printf("Other chunks in store:\t%llu bytes (%llu chunks)\n",
+		pool_bytes - unique_bytes, report.pool_chunks - report.chunks_unique);
 	return 0;
 }
 
 static int cmd_help(int argc, char *argv[]) {
 	if (argc < 3) {
 		printf("hdfmonkey: utility for manipulating HDF disk images\n\n");
-		printf("usage: hdfmonkey <command> [args]\n\n");
+		printf("usage: hdfmonkey [options] <command> [args]\n\n");
 		printf("Type 'hdfmonkey help <command>' for help on a specific command.\n");
 		printf("Available commands:\n");
-		printf("\tclone\n\tcreate\n\tformat\n\tget\n\thelp\n\tls\n\tmkdir\n\tput\n\trebuild\n\trm\n");
+		printf("\tclone\n\tcommit\n\tcreate\n\texport\n\tformat\n\tget\n\thelp\n\timport\n\tls\n\tmkdir\n\toverlay\n\tput\n\trebuild\n\treport\n\trm\n");
+		printf("\nOptions accepted by all commands:\n");
+		printf("\t--mmap\t\tAccess image files through a memory mapping\n");
+		printf("\t--io-uring\tKeep several image reads/writes in flight using io_uring, where available\n");
+		printf("\t--cache=<n>\tKeep up to n recently used sectors in memory (default %d, 0 to disable)\n", SECTOR_CACHE_DEFAULT_SIZE);
+		printf("\t--writeback\tHold written sectors in the cache, writing them out together\n");
+		printf("\t--readahead[=<size>]\tFetch data ahead of sequential reads in the background, <size>\n");
+		printf("\t\t\tbytes at a time (default %dK); helps most on slow storage\n", READAHEAD_DEFAULT_WINDOW >> 10);
+		printf("\t--partition=<n>\tWork on partition n (1-%d) of a partitioned image; the image name\n", MBR_PARTITION_COUNT);
+		printf("\t\t\tcan also pick one itself, as in image.hdf@2\n");
+		printf("\t--ram[=<size>]\tHold all changes to an image in memory and write them out once at the end,\n");
+		printf("\t\t\tor whenever <size> bytes are held if a size is given\n");
+		printf("\t--fat-cache[=<size>]\tHold the whole FAT in memory, writing changes to it out together;\n");
+		printf("\t\t\tskipped for FATs that would take more than <size> bytes (default %dM)\n", FAT_CACHE_DEFAULT_LIMIT >> 20);
+		printf("\t--stats[=text|json]\tReport reads and writes of each image and drive on standard error\n");
+		printf("\t\t\twhen the command finishes: counts, sizes, latencies and how many ran on\n");
+		printf("\t\t\tfrom the one before\n");
 	} else if (strcmp(argv[2], "clone") == 0) {
 		printf("clone: Make a new image file from a disk or image, possibly in a different container format\n");
-		printf("usage: hdfmonkey clone <oldimagefile> <newimagefile>\n");
+		printf("usage: hdfmonkey clone [--direct] [--used-only] [--halved] [--chunk-size=<size>] [--depth=<n>] [--progress] <oldimagefile> <newimagefile>\n");
+		printf("--direct bypasses the operating system's file cache.\n");
+		printf("--used-only copies only the parts of a FAT volume that are in use, leaving free clusters blank.\n");
+		printf("--halved makes a halved HDF, storing only the low byte of each word, as used by 8-bit IDE\n");
+		printf("interfaces; it fails if the source has data in the high bytes. Cloning a halved HDF\n");
+		printf("without it converts it to a full one, with the data in the low bytes.\n");
+		printf("Reading and writing overlap, with up to <n> chunks of <size> bytes (default %d of %dK) in between.\n",
+			CLONE_DEFAULT_DEPTH, CLONE_DEFAULT_CHUNK_SIZE >> 10);
+		printf("Progress is shown on a terminal, or with --progress.\n");
+		printf("Cloning an overlay flattens it into a standalone image.\n");
+	} else if (strcmp(argv[2], "commit") == 0) {
+		printf("commit: Write the changes held in an overlay back to its base image, and empty the overlay\n");
+		printf("usage: hdfmonkey commit <overlayfile>\n");
 	} else if (strcmp(argv[2], "create") == 0) {
 		printf("create: Create a new FAT-formatted image file\n");
-		printf("usage: hdfmonkey create [--fat12|--fat16|--fat32] <imagefile> <size> [volumelabel]\n");
+		printf("usage: hdfmonkey create [--fat12|--fat16|--fat32] [--sector-size=<n>] <imagefile> <size> [volumelabel]\n");
 		printf("Size is given in bytes (B), kilobytes (K), megabytes (M) or gigabytes (G) -\n");
 		printf("e.g. 64M, 1.5G\n");
+		printf("--sector-size sets the sector size to 512 (the default), 1024, 2048 or 4096 bytes.\n");
+		printf("The sector size of an existing image is found from its filesystem.\n");
+	} else if (strcmp(argv[2], "export") == 0) {
+		printf("export: Copy an image out of a deduplicating store into an image file of its own\n");
+		printf("usage: hdfmonkey export [clone options] <indexfile> <imagefile>\n");
+		printf("This is the same as clone, and takes the same options.\n");
 	} else if (strcmp(argv[2], "format") == 0) {
 		printf("format: Formats the entire disk image as a FAT filesystem\n");
-		printf("usage: hdfmonkey format [--fat12|--fat16|--fat32] <imagefile> [volumelabel]\n");
+		printf("usage: hdfmonkey format [--fat12|--fat16|--fat32] [--sector-size=<n>] <imagefile> [volumelabel]\n");
+		printf("--sector-size lays the filesystem out in sectors of 512, 1024, 2048 or 4096 bytes,\n");
+		printf("rather than keeping the image's current sector size.\n");
 	} else if (strcmp(argv[2], "get") == 0) {
 		printf("get: Copy a file from the disk image to a local file\n");
-		printf("usage: hdfmonkey get <imagefile> <sourcefile> [destfile]\n");
+		printf("usage: hdfmonkey get [--offset=<n>] [--length=<n>] <imagefile> <sourcefile> [destfile]\n");
 		printf("Will write the file to standard output if no destination file is specified.\n");
+		printf("--offset and --length copy just that part of the file, rather than all of it.\n");
 	} else if (strcmp(argv[2], "help") == 0) {
 		printf("help: Describe the usage of this program or its commands.\n");
 		printf("usage: hdfmonkey help [command]\n");
+	} else if (strcmp(argv[2], "import") == 0) {
+		printf("import: Add an image to a deduplicating store, which keeps each distinct chunk of data only once\n");
+		printf("usage: hdfmonkey import <storedirectory> <imagefile> <indexfile>\n");
+		printf("The store directory is created if it doesn't exist. The new index file can be used in place of\n");
+		printf("an image file by any other command.\n");
 	} else if (strcmp(argv[2], "ls") == 0) {
 		printf("ls: Show a directory listing\n");
 		printf("usage: hdfmonkey ls <imagefile> [path]\n");
@@ -940,12 +1716,21 @@ static int cmd_help(int argc, char *argv[]) {
 	} else if (strcmp(argv[2], "mkdir") == 0) {
 		printf("mkdir: Create a directory\n");
 		printf("usage: hdfmonkey mkdir <imagefile> <dirname>\n");
+	} else if (strcmp(argv[2], "overlay") == 0) {
+		printf("overlay: Create an overlay file that holds all changes to an image, leaving the image itself untouched\n");
+		printf("usage: hdfmonkey overlay <baseimagefile> <overlayfile>\n");
+		printf("The overlay can then be used in place of an image file by any other command.\n");
 	} else if (strcmp(argv[2], "put") == 0) {
 		printf("put: Copy local files to the disk image\n");
 		printf("usage: hdfmonkey put <image-file> <source-files> <dest-file-or-dir>\n");
 	} else if (strcmp(argv[2], "rebuild") == 0) {
 		printf("rebuild: Copy contents of the source image file-by-file to a new disk image;\n\tensures that the resulting image is unfragmented.\n");
-		printf("usage: hdfmonkey rebuild [--fat12|--fat16|--fat32] <source-image-file> <destination-image-file> [volumelabel]\n");
+		printf("usage: hdfmonkey rebuild [--fat12|--fat16|--fat32] [--direct] [--sector-size=<n>] <source-image-file> <destination-image-file> [volumelabel]\n");
+		printf("--direct bypasses the operating system's file cache.\n");
+		printf("--sector-size gives the new image a different sector size from the source.\n");
+	} else if (strcmp(argv[2], "report") == 0) {
+		printf("report: Show how much space deduplication is saving for images in a store\n");
+		printf("usage: hdfmonkey report <indexfiles>\n");
 	} else if (strcmp(argv[2], "rm") == 0) {
 		printf("rm: Remove a file or directory\n");
 		printf("usage: hdfmonkey rm <imagefile> <filename>\n");
@@ -956,11 +1741,70 @@ static int cmd_help(int argc, char *argv[]) {
 	return 0;
 }
 
-int main(int argc, char *argv[]) {
+/* Remove the global options from argv, recording their settings; returns the
+new argument count, or -1 if an option is invalid */
+static int parse_global_options(int argc, char *argv[]) {
+	unsigned long long readahead_window, fat_cache_limit;
+	int i, j;
+	
+	for (i = 1, j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--mmap") == 0) {
+			use_mmap = 1;
+		} else if (strcmp(argv[i], "--io-uring") == 0) {
+			use_uring = 1;
+		} else if (strcmp(argv[i], "--writeback") == 0) {
+			disk_set_writeback(1);
+		} else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			disk_set_cache_size(strtoul(argv[i] + 8, NULL, 10));
+		} else if (strcmp(argv[i], "--readahead") == 0) {
+			disk_set_readahead(READAHEAD_DEFAULT_WINDOW);
+		} else if (strncmp(argv[i], "--readahead=", 12) == 0) {
+			if (parse_size(argv[i] + 12, &readahead_window) == -1) return -1;
+			disk_set_readahead(readahead_window);
+		} else if (strcmp(argv[i], "--partition") == 0 || strncmp(argv[i], "--partition=", 12) == 0) {
+			if (argv[i][11] == '=') {
+				selected_partition = atoi(argv[i] + 12);
+			} else if (i + 1 < argc) {
+				selected_partition = atoi(argv[++i]);
+			} else {
+				selected_partition = 0;
+			}
+			if (selected_partition < 1 || selected_partition > MBR_PARTITION_COUNT) {
+				printf("Partition number must be from 1 to %d\n", MBR_PARTITION_COUNT);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--fat-cache") == 0) {
+			f_fatcache(FAT_CACHE_DEFAULT_LIMIT);
+		} else if (strncmp(argv[i], "--fat-cache=", 12) == 0) {
+			if (parse_size(argv[i] + 12, &fat_cache_limit) == -1) return -1;
+			f_fatcache(fat_cache_limit);
+		} else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+			io_stats_enable(IO_STATS_TEXT);
+		} else if (strcmp(argv[i], "--stats=json") == 0) {
+			io_stats_enable(IO_STATS_JSON);
+		} else if (strncmp(argv[i], "--stats=", 8) == 0) {
+			printf("Statistics format must be text or json\n");
+			return -1;
+		} else if (strcmp(argv[i], "--ram") == 0) {
+			use_ram = 1;
+		} else if (strncmp(argv[i], "--ram=", 6) == 0) {
+			use_ram = 1;
+			if (parse_size(argv[i] + 6, &ram_limit) == -1) return -1;
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argv[j] = NULL;
+	return j;
+}
+
+static int run_command(int argc, char *argv[]) {
 	if (argc < 2) {
 		/* fall through to help prompt */
-	} else if (strcmp(argv[1], "clone") == 0) {
+	} else if (strcmp(argv[1], "clone") == 0 || strcmp(argv[1], "export") == 0) {
 		return cmd_clone(argc, argv);
+	} else if (strcmp(argv[1], "commit") == 0) {
+		return cmd_commit(argc, argv);
 	} else if (strcmp(argv[1], "create") == 0) {
 		return cmd_create(argc, argv);
 	} else if (strcmp(argv[1], "format") == 0) {
@@ -969,14 +1813,20 @@ int main(int argc, char *argv[]) {
 		return cmd_get(argc, argv);
 	} else if (strcmp(argv[1], "help") == 0) {
 		return cmd_help(argc, argv);
+	} else if (strcmp(argv[1], "import") == 0) {
+		return cmd_import(argc, argv);
 	} else if (strcmp(argv[1], "ls") == 0) {
 		return cmd_ls(argc, argv);
 	} else if (strcmp(argv[1], "mkdir") == 0) {
 		return cmd_mkdir(argc, argv);
+	} else if (strcmp(argv[1], "overlay") == 0) {
+		return cmd_overlay(argc, argv);
 	} else if (strcmp(argv[1], "put") == 0) {
 		return cmd_put(argc, argv);
 	} else if (strcmp(argv[1], "rebuild") == 0) {
 		return cmd_rebuild(argc, argv);
+	} else if (strcmp(argv[1], "report") == 0) {
+		return cmd_report(argc, argv);
 	} else if (strcmp(argv[1], "rm") == 0) {
 		return cmd_rm(argc, argv);
 	} else {
@@ -985,3 +1835,19 @@ int main(int argc, char *argv[]) {
 	printf("Type 'hdfmonkey help' for usage.\n");
 	return 0;
 }
+
+int main(int argc, char *argv[]) {
+	DWORD fat_held, fat_refused;
+	int res;
+	
+	argc = parse_global_options(argc, argv);
+	if (argc == -1) return -1;
+	
+	res = run_command(argc, argv);
+	
+	f_fatcache_usage(&fat_held, &fat_refused);
+	if (fat_held) io_stats_memory("FAT held in memory", fat_held);
+	if (fat_refused) io_stats_memory("FAT over the --fat-cache limit, not held", fat_refused);
+	io_stats_print(stderr);
+	return res;
+}
@@ -1,12 +1,26 @@
+#include <config.h>
+
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "volume_container.h"
 #include "image_file.h"
+#include "image_util.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -14,17 +28,14 @@
 
 static ssize_t image_file_read(volume_container *v, off_t position, void *buf, size_t count) {
 	int fd = v->data.file.fd;
-	int done = 0;
-	int res;
-	
-	if ((res = lseek(fd, position + v->data.file.data_offset, SEEK_SET)) < 0) {
-		return res;
-	}
+	off_t offset = position + v->data.file.data_offset;
+	size_t done = 0;
+	ssize_t res;
 
 	while (count > 0) {
-		res = read(fd, (void *) &(((char *) buf)[done]), count);
+		res = pread(fd, (char *)buf + done, count, offset + done);
 		if (res <= 0) {	// 0 indicates EOF, and it should never happen here.
-			fprintf(stderr,"read() error. line: %d\n",__LINE__);
+			fprintf(stderr,"pread() error. line: %d\n",__LINE__);
 			return -1;
 		} else {
 			done += res;
@@ -37,17 +48,14 @@ static ssize_t image_file_read(volume_container *v, off_t position, void *buf, s
 
 static ssize_t image_file_write(volume_container *v, off_t position, void *buf, size_t count) {
 	int fd = v->data.file.fd;
-	int done = 0;
-	int res;
-	
-	if ((res = lseek(fd, position + v->data.file.data_offset, SEEK_SET)) < 0) {
-		return res;
-	}
+	off_t offset = position + v->data.file.data_offset;
+	size_t done = 0;
+	ssize_t res;
 
 	while (count > 0) {
-		res = write(fd, buf + done, count);
+		res = pwrite(fd, (char *)buf + done, count, offset + done);
 		if (res < 0) {
-			perror("write() error");
+			perror("pwrite() error");
 			return -1;
 		} else {
 			done += res;
@@ -58,11 +66,436 @@ static ssize_t image_file_write(volume_container *v, off_t position, void *buf,
 
 }
 
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+#define IMAGE_FILE_MAX_IOV 64
+
+/* Transfer a set of buffers that are laid out consecutively in the file, from
+offset onwards, picking up again after any partial transfer */
+static ssize_t image_file_transfer_iov(int fd, struct iovec *iov, int iovcnt, off_t offset, int writing) {
+	ssize_t res, done = 0;
+
+	while (iovcnt > 0) {
+		if (writing) {
+			res = pwritev(fd, iov, iovcnt, offset);
+		} else {
+			res = preadv(fd, iov, iovcnt, offset);
+		}
+		if (res <= 0) {	/* includes unexpected EOF on reading */
+			perror(writing ? "pwritev() error" : "preadv() error");
+			return -1;
+		}
+		done += res;
+		offset += res;
+		/* step over the buffers that have been completed */
+		while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+	return done;
+}
+
+/* Runs that follow on from one another in the file are merged into a single
+preadv/pwritev; each gap between runs costs another call */
+static ssize_t image_file_transfer_runs(volume_container *v, volume_io_run *runs, int run_count, int writing) {
+	struct iovec iov[IMAGE_FILE_MAX_IOV];
+	int i, iovcnt;
+	off_t offset, end;
+	ssize_t res, done = 0;
+
+	i = 0;
+	while (i < run_count) {
+		offset = end = runs[i].position + v->data.file.data_offset;
+		iovcnt = 0;
+		while (i < run_count && iovcnt < IMAGE_FILE_MAX_IOV
+			&& runs[i].position + v->data.file.data_offset == end) {
+			if (runs[i].count > 0) {
+				iov[iovcnt].iov_base = runs[i].buf;
+				iov[iovcnt].iov_len = runs[i].count;
+				iovcnt++;
+				end += runs[i].count;
+			}
+			i++;
+		}
+		if (iovcnt == 0) continue;
+		res = image_file_transfer_iov(v->data.file.fd, iov, iovcnt, offset, writing);
+		if (res < 0) return -1;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t image_file_readv(volume_container *v, volume_io_run *runs, int run_count) {
+	return image_file_transfer_runs(v, runs, run_count, 0);
+}
+
+static ssize_t image_file_writev(volume_container *v, volume_io_run *runs, int run_count) {
+	return image_file_transfer_runs(v, runs, run_count, 1);
+}
+#else
+#define image_file_readv NULL
+#define image_file_writev NULL
+#endif
+
+static int image_file_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	off_t end = (off_t)v->sector_count * v->bytes_per_sector;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	int fd = v->data.file.fd;
+	off_t offset = position + v->data.file.data_offset;
+	off_t start, hole = -1;
+
+	start = lseek(fd, offset, SEEK_DATA);
+	if (start == -1 && errno == ENXIO) {
+		/* nothing but hole from here to end of file */
+		*data_start = *data_end = end;
+		return 0;
+	}
+	if (start != -1) hole = lseek(fd, start, SEEK_HOLE);
+	if (start != -1 && hole != -1) {
+		start -= v->data.file.data_offset;
+		hole -= v->data.file.data_offset;
+		*data_start = (start < position) ? position : (start > end ? end : start);
+		*data_end = (hole > end) ? end : hole;
+		return 0;
+	}
+	/* otherwise the filesystem can't tell us, so fall through and treat it
+	all as data */
+#endif
+	*data_start = position;
+	*data_end = end;
+	return 0;
+}
+
+/* Containers whose contents live in an image file of their own, under any of
+the access methods; the plain file operations below are only valid on these */
+static int volume_is_image_file(volume_container *v) {
+	return (v->find_data == &image_file_find_data);
+}
+
+/* Make dest (freshly created, and the same size) a copy of source by sharing
+the source's storage, on filesystems that support it. Only possible between
+raw images, since reflinks have to be block-aligned */
+int image_file_reflink(volume_container *dest, volume_container *source) {
+#if defined(HAVE_LINUX_FS_H) && defined(FICLONE)
+	if (!volume_is_image_file(dest) || !volume_is_image_file(source)) return -1;
+	if (dest->data.file.data_offset != 0 || source->data.file.data_offset != 0) return -1;
+	if (dest->sector_count != source->sector_count || dest->bytes_per_sector != source->bytes_per_sector) return -1;
+	return ioctl(dest->data.file.fd, FICLONE, source->data.file.fd) == -1 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/* Copy count bytes at position from source to dest within the kernel, which
+may share the storage rather than copying it; returns -1 if this isn't
+possible, leaving the caller to copy it by hand. Only attempted between raw
+images: anywhere else the storage can't be shared, and copying by hand at
+least lets runs of zeroes be left out */
+int image_file_copy_range(volume_container *dest, volume_container *source, off_t position, size_t count) {
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t source_offset, dest_offset;
+	ssize_t res;
+
+	if (!volume_is_image_file(dest) || !volume_is_image_file(source)) return -1;
+	if (dest->data.file.data_offset != 0 || source->data.file.data_offset != 0) return -1;
+	/* direct I/O was asked for to keep the copy out of the page cache, which
+	copy_file_range makes no promises about */
+	if (dest->data.file.bounce || source->data.file.bounce) return -1;
+
+	source_offset = position + source->data.file.data_offset;
+	dest_offset = position + dest->data.file.data_offset;
+	while (count > 0) {
+		res = copy_file_range(source->data.file.fd, &source_offset, dest->data.file.fd, &dest_offset, count, 0);
+		if (res <= 0) return -1;
+		count -= res;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 static int image_file_close(volume_container *v) {
 	close(v->data.file.fd);
 	return 0;
 }
 
+#ifdef HAVE_SYS_MMAN_H
+static ssize_t image_file_map_read(volume_container *v, off_t position, void *buf, size_t count) {
+	off_t start = position + v->data.file.data_offset;
+
+	if (position < 0 || start + count > v->data.file.map_length) {
+		fprintf(stderr, "read beyond end of mapped image\n");
+		return -1;
+	}
+	memcpy(buf, v->data.file.map + start, count);
+	return count;
+}
+
+static ssize_t image_file_map_write(volume_container *v, off_t position, void *buf, size_t count) {
+	off_t start = position + v->data.file.data_offset;
+
+	if (position < 0 || start + count > v->data.file.map_length) {
+		fprintf(stderr, "write beyond end of mapped image\n");
+		return -1;
+	}
+	memcpy(v->data.file.map + start, buf, count);
+	return count;
+}
+
+static int image_file_map_sync(volume_container *v) {
+	/* Data written to a shared mapping is already visible to other readers of
+	the file, which is all that a write() would have promised; just start the
+	writeback here and leave waiting for it to close */
+	if (msync(v->data.file.map, v->data.file.map_length, MS_ASYNC) == -1) {
+		perror("msync() error");
+		return -1;
+	}
+	return 0;
+}
+
+static int image_file_map_close(volume_container *v) {
+	int res = 0;
+
+	if (msync(v->data.file.map, v->data.file.map_length, MS_SYNC) == -1) {
+		perror("msync() error");
+		res = -1;
+	}
+	munmap(v->data.file.map, v->data.file.map_length);
+	v->data.file.map = NULL;
+	close(v->data.file.fd);
+	return res;
+}
+#endif
+
+/* Switch an open raw or HDF image over to memory-mapped access: the whole file
+is mapped and sector reads/writes become copies to and from the mapping */
+int image_file_map(volume_container *v, int writeable) {
+#ifdef HAVE_SYS_MMAN_H
+	struct stat file_stat;
+	void *map;
+
+	if ( fstat(v->data.file.fd, &file_stat) == -1 ) {
+		perror("fstat() error");
+		return -1;
+	}
+	if (file_stat.st_size == 0) {
+		fprintf(stderr, "Cannot map an empty image file\n");
+		return -1;
+	}
+	if ((off_t)(size_t)file_stat.st_size != file_stat.st_size) {
+		fprintf(stderr, "Image file is too large to map into memory\n");
+		return -1;
+	}
+
+	map = mmap(NULL, file_stat.st_size, writeable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, v->data.file.fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap() error");
+		return -1;
+	}
+
+	v->data.file.map = map;
+	v->data.file.map_length = file_stat.st_size;
+	v->read = &image_file_map_read;
+	v->write = &image_file_map_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &image_file_map_close;
+	v->sync = &image_file_map_sync;
+	return 0;
+#else
+	fprintf(stderr, "Memory-mapped image access is not supported on this platform\n");
+	return -1;
+#endif
+}
+
+#ifdef O_DIRECT
+/* O_DIRECT transfers must start and end on a multiple of the device's logical
+block size, from a buffer aligned to the same; 4096 covers every device we are
+likely to meet */
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_BUFFER_SIZE 1048576
+
+/* Read an aligned stretch of the file, stopping early only at end of file;
+returns the number of bytes read */
+static ssize_t image_file_direct_pread(int fd, unsigned char *buf, size_t count, off_t offset) {
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < count) {
+		res = pread(fd, buf + done, count - done, offset + done);
+		if (res < 0) {
+			perror("pread() error");
+			return -1;
+		}
+		done += res;
+		/* a short read that isn't block-aligned can only mean end of file */
+		if (res == 0 || res % DIRECT_ALIGNMENT) break;
+	}
+	return done;
+}
+
+static int image_file_direct_pwrite(int fd, unsigned char *buf, size_t count, off_t offset) {
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < count) {
+		res = pwrite(fd, buf + done, count - done, offset + done);
+		if (res < 0) {
+			perror("pwrite() error");
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+/* Fill one block of the bounce buffer from the file, as the starting point for
+a partial overwrite; anything beyond end of file reads as zero */
+static int image_file_direct_fill_block(int fd, unsigned char *block, off_t offset) {
+	ssize_t res = image_file_direct_pread(fd, block, DIRECT_ALIGNMENT, offset);
+
+	if (res < 0) return -1;
+	memset(block + res, 0, DIRECT_ALIGNMENT - res);
+	return 0;
+}
+
+/* Requests that are already block-aligned, in both file and memory, are passed
+straight through; anything else goes by way of the bounce buffer */
+static ssize_t image_file_direct_read(volume_container *v, off_t position, void *buf, size_t count) {
+	int fd = v->data.file.fd;
+	unsigned char *bounce = v->data.file.bounce;
+	off_t offset = position + v->data.file.data_offset;
+	off_t start;
+	size_t done = 0, skip, len, want;
+	ssize_t res;
+
+	while (done < count) {
+		start = (offset + done) & ~(off_t)(DIRECT_ALIGNMENT - 1);
+		skip = (offset + done) - start;
+		if (skip == 0 && count - done >= DIRECT_ALIGNMENT
+			&& ((unsigned long)((char *)buf + done) & (DIRECT_ALIGNMENT - 1)) == 0) {
+			want = (count - done) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+			res = image_file_direct_pread(fd, (unsigned char *)buf + done, want, start);
+			len = want;
+		} else {
+			len = skip + (count - done);
+			if (len > DIRECT_BUFFER_SIZE) len = DIRECT_BUFFER_SIZE;
+			want = (len + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+			res = image_file_direct_pread(fd, bounce, want, start);
+			if (res >= 0 && (size_t)res >= len) {
+				memcpy((char *)buf + done, bounce + skip, len - skip);
+			}
+		}
+		if (res < 0) return -1;
+		if ((size_t)res < len) {	/* unexpected EOF */
+			fprintf(stderr,"pread() error. line: %d\n",__LINE__);
+			return -1;
+		}
+		done += len - skip;
+	}
+	return done;
+}
+
+static ssize_t image_file_direct_write(volume_container *v, off_t position, void *buf, size_t count) {
+	int fd = v->data.file.fd;
+	unsigned char *bounce = v->data.file.bounce;
+	off_t offset = position + v->data.file.data_offset;
+	off_t start;
+	size_t done = 0, skip, len, want;
+
+	while (done < count) {
+		start = (offset + done) & ~(off_t)(DIRECT_ALIGNMENT - 1);
+		skip = (offset + done) - start;
+		if (skip == 0 && count - done >= DIRECT_ALIGNMENT
+			&& ((unsigned long)((char *)buf + done) & (DIRECT_ALIGNMENT - 1)) == 0) {
+			want = (count - done) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+			if (image_file_direct_pwrite(fd, (unsigned char *)buf + done, want, start) == -1) return -1;
+			done += want;
+			continue;
+		}
+
+		len = skip + (count - done);
+		if (len > DIRECT_BUFFER_SIZE) len = DIRECT_BUFFER_SIZE;
+		want = (len + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+		/* read-modify-write the blocks at either end that are only partly covered */
+		if (skip != 0) {
+			if (image_file_direct_fill_block(fd, bounce, start) == -1) return -1;
+		}
+		if (len != want && (skip == 0 || want > DIRECT_ALIGNMENT)) {
+			if (image_file_direct_fill_block(fd, bounce + want - DIRECT_ALIGNMENT,
+				start + want - DIRECT_ALIGNMENT) == -1) return -1;
+		}
+		memcpy(bounce + skip, (char *)buf + done, len - skip);
+		if (image_file_direct_pwrite(fd, bounce, want, start) == -1) return -1;
+
+		/* rounding up to a whole block may have extended the file past its
+		proper end, which for an HDF image is rarely block-aligned */
+		if (start + (off_t)len > v->data.file.length) v->data.file.length = start + len;
+		if (start + (off_t)want > v->data.file.length) {
+			if (ftruncate(fd, v->data.file.length) == -1) {
+				perror("ftruncate() error");
+				return -1;
+			}
+		}
+		done += len - skip;
+	}
+	return done;
+}
+
+static int image_file_direct_close(volume_container *v) {
+	free(v->data.file.bounce);
+	v->data.file.bounce = NULL;
+	close(v->data.file.fd);
+	return 0;
+}
+#endif
+
+/* Switch an open raw or HDF image over to direct I/O, bypassing the page
+cache. Transfers that don't line up with the device's blocks (including
+everything in an HDF image, whose data starts at an odd offset) are carried
+out through an aligned bounce buffer */
+int image_file_direct(volume_container *v) {
+#ifdef O_DIRECT
+	struct stat file_stat;
+	void *bounce;
+	int flags;
+
+	if ( fstat(v->data.file.fd, &file_stat) == -1 ) {
+		perror("fstat() error");
+		return -1;
+	}
+	if ( posix_memalign(&bounce, DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE) != 0 ) {
+		fprintf(stderr, "Out of memory allocating direct I/O buffer\n");
+		return -1;
+	}
+	if ( (flags = fcntl(v->data.file.fd, F_GETFL)) == -1
+		|| fcntl(v->data.file.fd, F_SETFL, flags | O_DIRECT) == -1 ) {
+		perror("Cannot enable direct I/O on image file");
+		free(bounce);
+		return -1;
+	}
+
+	v->data.file.bounce = bounce;
+	v->data.file.length = file_stat.st_size;
+	v->read = &image_file_direct_read;
+	v->write = &image_file_direct_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &image_file_direct_close;
+	return 0;
+#else
+	fprintf(stderr, "Direct I/O is not supported on this platform\n");
+	return -1;
+#endif
+}
+
 int raw_image_open(volume_container *v, char *pathname, int writeable) {
 	int fd;
 	struct stat file_stat;
@@ -85,16 +518,23 @@ int raw_image_open(volume_container *v, char *pathname, int writeable) {
 	}
 
 	v->data.file.fd = fd;
+	v->data.file.map = NULL;
+	v->data.file.uring = NULL;
+	v->data.file.bounce = NULL;
 	v->data.file.data_offset = 0;
 	v->bytes_per_sector = 512;
 	v->sector_count = file_stat.st_size / 512;
 	v->read = &image_file_read;
 	v->write = &image_file_write;
+	v->readv = image_file_readv;
+	v->writev = image_file_writev;
 	v->close = &image_file_close;
+	v->sync = NULL;
+	v->find_data = &image_file_find_data;
 	return 0;
 }
 
-int raw_image_create(volume_container *v, char *pathname, unsigned long sector_count) {
+int raw_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector) {
 	int fd;
 	
 	if ( (fd = open(pathname,
@@ -103,28 +543,54 @@ int raw_image_create(volume_container *v, char *pathname, unsigned long sector_c
 		perror("open() (RDWR) error");
 		return -1;
 	}
-	if ( ftruncate(fd, sector_count * 512) == -1 ) {
+	if ( ftruncate(fd, (off_t)sector_count * bytes_per_sector) == -1 ) {
 		perror("ftruncate() error");
 		return -1;
 	}
 	
 	v->data.file.fd = fd;
+	v->data.file.map = NULL;
+	v->data.file.uring = NULL;
+	v->data.file.bounce = NULL;
 	v->data.file.data_offset = 0;
-	v->bytes_per_sector = 512;
+	v->bytes_per_sector = bytes_per_sector;
 	v->sector_count = sector_count;
 	v->read = &image_file_read;
 	v->write = &image_file_write;
+	v->readv = image_file_readv;
+	v->writev = image_file_writev;
 	v->close = &image_file_close;
+	v->sync = NULL;
+	v->find_data = &image_file_find_data;
+	return 0;
+}
+
+/* Treat the image file v as having sectors of bytes_per_sector bytes, which
+must be a power of two from 512 to 4096; the image itself is unchanged */
+int image_file_set_sector_size(volume_container *v, unsigned int bytes_per_sector) {
+	off_t length = (off_t)v->sector_count * v->bytes_per_sector;
+
+	if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)) != 0) {
+		fprintf(stderr, "Sector size must be 512, 1024, 2048 or 4096 bytes\n");
+		return -1;
+	}
+	v->bytes_per_sector = bytes_per_sector;
+	v->sector_count = length / bytes_per_sector;
 	return 0;
 }
 
 static char *hdf_signature = "RS-IDE\x1a";
 #define HDF_SIGNATURE_LENGTH 7
+/* where the ATA identity block lives in a version 1.1 header */
+#define HDF_IDENTITY_OFFSET 0x16
+#define HDF_IDENTITY_SIZE 0x200
 
 int hdf_image_open(volume_container *v, char *pathname, int writeable) {
 	int fd;
 	struct stat file_stat;
 	unsigned char hdf_header[11];
+	unsigned char identity[HDF_IDENTITY_SIZE];
+	unsigned int words_per_sector;
 
 	if (writeable) {
 		if ( (fd = open(pathname, O_RDWR | O_BINARY)) == -1 ) {
@@ -150,16 +616,33 @@ int hdf_image_open(volume_container *v, char *pathname, int writeable) {
 	}
 
 	v->data.file.fd = fd;
+	v->data.file.map = NULL;
+	v->data.file.uring = NULL;
+	v->data.file.bounce = NULL;
 	v->data.file.data_offset = hdf_header[0x09] | (hdf_header[0x0a] << 8);
 	if (hdf_header[0x08] & 0x01) {
 		v->bytes_per_sector = 256;
 	} else {
 		v->bytes_per_sector = 512;
+		/* word 106 says whether words 117-118 give a logical sector size
+		other than 512 bytes */
+		if (v->data.file.data_offset >= HDF_IDENTITY_OFFSET + HDF_IDENTITY_SIZE
+			&& pread(fd, identity, HDF_IDENTITY_SIZE, HDF_IDENTITY_OFFSET) == HDF_IDENTITY_SIZE
+			&& (identity[213] & 0xd0) == 0x50) {
+			words_per_sector = identity[234] | (identity[235] << 8);
+			if (words_per_sector == 512 || words_per_sector == 1024 || words_per_sector == 2048) {
+				v->bytes_per_sector = words_per_sector * 2;
+			}
+		}
 	}
 	v->sector_count = (file_stat.st_size - v->data.file.data_offset) / v->bytes_per_sector;
 	v->read = &image_file_read;
 	v->write = &image_file_write;
+	v->readv = image_file_readv;
+	v->writev = image_file_writev;
 	v->close = &image_file_close;
+	v->sync = NULL;
+	v->find_data = &image_file_find_data;
 	return 0;
 }
 
@@ -171,17 +654,79 @@ const size_t HDF_HEADER_SIZE = 0x0216;
 static const char *MODEL_NUMBER = "rCaeet dybh fdomknye                    ";
 static const size_t MODEL_NUMBER_LENGTH = 40;
 
-int hdf_write_header(int fd, unsigned long sector_count) {
-	char *header, *identity;
-	unsigned long head_count, cyl_count, sectors_per_head, sectors_per_track;
+/* Fill in the parts of an ATA identity block that give the size of the disk:
+the sector counts for 28- and 48-bit LBA, and the logical sector size */
+static void hdf_identity_set_size(unsigned char *identity, unsigned long long sector_count, unsigned int bytes_per_sector) {
+	unsigned long long lba28_count;
+	int i;
+	
+	/* words 60-61: total number of sectors addressable with 28-bit LBA */
+	lba28_count = (sector_count > 0x0fffffff) ? 0x0fffffff : sector_count;
+	identity[120] = lba28_count & 0xff;
+	identity[121] = (lba28_count >> 8) & 0xff;
+	identity[122] = (lba28_count >> 16) & 0xff;
+	identity[123] = (lba28_count >> 24) & 0xff;
+	
+	if ( bytes_per_sector > 512 ) {
+		/* word 106: words 117-118 are valid (bit 14, with bit 15 clear) and
+		the logical sector is longer than 256 words (bit 12) */
+		identity[213] = 0x50;
+		/* words 117-118: words per logical sector */
+		identity[234] = (bytes_per_sector / 2) & 0xff;
+		identity[235] = (bytes_per_sector / 2) >> 8;
+	} else {
+		identity[213] &= ~0x10;
+		identity[234] = 0;
+		identity[235] = 0;
+	}
+	
+	if ( sector_count > 0x0fffffff || (identity[167] & 0x04) ) {
+		/* words 83 and 86, bit 10: 48-bit LBA supported and enabled */
+		identity[167] |= 0x04;
+		identity[173] |= 0x04;
+		/* words 100-103: total number of sectors addressable with 48-bit LBA */
+		for (i = 0; i < 8; i++) {
+			identity[200 + i] = (i < 6) ? (sector_count >> (i * 8)) & 0xff : 0;
+		}
+	}
+}
+
+/* Bring the identity block in the header of the HDF image v up to date with
+the sector size and count it's now being worked on with, such as after
+formatting it with a different sector size; does nothing for raw images */
+int hdf_image_update_size(volume_container *v) {
+	unsigned char identity[HDF_IDENTITY_SIZE];
+	
+	if (v->data.file.data_offset < HDF_IDENTITY_OFFSET + HDF_IDENTITY_SIZE) return 0;
+	if (pread(v->data.file.fd, identity, HDF_IDENTITY_SIZE, HDF_IDENTITY_OFFSET) != HDF_IDENTITY_SIZE) {
+		perror("Error reading HDF header");
+		return -1;
+	}
+	hdf_identity_set_size(identity, v->sector_count, v->bytes_per_sector);
+	if (pwrite(v->data.file.fd, identity, HDF_IDENTITY_SIZE, HDF_IDENTITY_OFFSET) != HDF_IDENTITY_SIZE) {
+		perror("Error writing HDF header");
+		return -1;
+	}
+	return 0;
+}
+
+int hdf_write_header(int fd, unsigned long long sector_count, unsigned int bytes_per_sector, int halved) {
+	char *header;
+	unsigned char *identity;
+	unsigned long head_count, cyl_count, sectors_per_track;
+	unsigned long long sectors_per_head;
 	int res;
 	int written;
 	
 	header = calloc( 1, HDF_HEADER_SIZE );
 	
 	memcpy( header, HDF_PREAMBLE, HDF_PREAMBLE_LENGTH );
+	if (halved) {
+		/* only the low byte of each word of sector data is stored */
+		header[0x08] |= 0x01;
+	}
 	
-	identity = header + 0x16;
+	identity = (unsigned char *)header + HDF_IDENTITY_OFFSET;
 	if ( sector_count >= 16383 * 16 * 63 ) {
 		/* image > 8GB; use dummy 'large disk' CHS values */
 		cyl_count = 16383;
@@ -221,11 +766,7 @@ int hdf_write_header(int fd, unsigned long sector_count) {
 	/* word 49: Capabilities (bit 9 = 'LBA supported' flag) */
 	identity[99] = 0x02;
 	
-	/* words 60-61: total number of sectors */
-	identity[120] = sector_count & 0xff;
-	identity[121] = (sector_count >> 8) & 0xff;
-	identity[122] = (sector_count >> 16) & 0xff;
-	identity[123] = (sector_count >> 24) & 0xff;
+	hdf_identity_set_size(identity, sector_count, bytes_per_sector);
 	
 	written = 0;
 	while (written < HDF_HEADER_SIZE) {
@@ -243,7 +784,8 @@ int hdf_write_header(int fd, unsigned long sector_count) {
 	return 0;
 }
 
-int hdf_image_create(volume_container *v, char *pathname, unsigned long sector_count) {
+static int hdf_image_create_file(volume_container *v, char *pathname, unsigned long long sector_count,
+	unsigned int bytes_per_sector, int halved) {
 	int fd;
 	
 	if ( (fd = open(pathname,
@@ -252,25 +794,42 @@ int hdf_image_create(volume_container *v, char *pathname, unsigned long sector_c
 		perror("open() (RDWR) error");
 		return -1;
 	}
-	if ( ftruncate(fd, sector_count * 512 + HDF_HEADER_SIZE) == -1 ) {
+	if ( ftruncate(fd, (off_t)sector_count * bytes_per_sector + HDF_HEADER_SIZE) == -1 ) {
 		perror("ftruncate() error");
 		return -1;
 	}
 	
-	if ( hdf_write_header(fd, sector_count) == -1 ) {
+	if ( hdf_write_header(fd, sector_count, halved ? 512 : bytes_per_sector, halved) == -1 ) {
 		return -1;
 	}
 	
 	v->data.file.fd = fd;
+	v->data.file.map = NULL;
+	v->data.file.uring = NULL;
+	v->data.file.bounce = NULL;
 	v->data.file.data_offset = HDF_HEADER_SIZE;
-	v->bytes_per_sector = 512;
+	v->bytes_per_sector = bytes_per_sector;
 	v->sector_count = sector_count;
 	v->read = &image_file_read;
 	v->write = &image_file_write;
+	v->readv = image_file_readv;
+	v->writev = image_file_writev;
 	v->close = &image_file_close;
+	v->sync = NULL;
+	v->find_data = &image_file_find_data;
 	return 0;
 }
 
+int hdf_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector) {
+	return hdf_image_create_file(v, pathname, sector_count, bytes_per_sector, 0);
+}
+
+/* Create a halved HDF image, as used by 8-bit IDE interfaces, with 256 bytes
+stored for each sector */
+int hdf_image_create_halved(volume_container *v, char *pathname, unsigned long long sector_count) {
+	return hdf_image_create_file(v, pathname, sector_count, 256, 1);
+}
+
 int image_file_is_hdf(char *pathname) {
 	int fd;
 	char actual_signature[HDF_SIGNATURE_LENGTH];
@@ -4,11 +4,22 @@
 #include "volume_container.h"
 
 int raw_image_open(volume_container *v, char *pathname, int writeable);
-int raw_image_create(volume_container *v, char *pathname, unsigned long sector_count);
+int raw_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector);
 
 int hdf_image_open(volume_container *v, char *pathname, int writeable);
-int hdf_image_create(volume_container *v, char *pathname, unsigned long sector_count);
+int hdf_image_create(volume_container *v, char *pathname, unsigned long long sector_count, unsigned int bytes_per_sector);
+int hdf_image_create_halved(volume_container *v, char *pathname, unsigned long long sector_count);
+int hdf_image_update_size(volume_container *v);
 int image_file_is_hdf(char *pathname);
 
+int image_file_set_sector_size(volume_container *v, unsigned int bytes_per_sector);
+
+int image_file_map(volume_container *v, int writeable);
+int image_file_direct(volume_container *v);
+int image_file_uring(volume_container *v, unsigned int queue_depth);
+
+int image_file_reflink(volume_container *dest, volume_container *source);
+int image_file_copy_range(volume_container *dest, volume_container *source, off_t position, size_t count);
+
 #endif /* #ifdef __IMAGE_FILE_H */
 
@@ -0,0 +1,405 @@
+/* Asynchronous access to image files through Linux io_uring.
+
+The ring is driven with the raw system calls rather than liburing, so that
+nothing beyond the kernel headers is needed to build it. Each transfer is
+broken up into pieces of at most URING_PIECE_SIZE bytes which are submitted
+together, up to the depth of the ring, so that the device sees several
+requests in flight rather than one at a time. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "volume_container.h"
+#include "image_file.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_UIO_H)
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_UIO_H) \
+	&& defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING 1
+#endif
+
+#ifdef USE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Largest single request placed on the ring */
+#define URING_PIECE_SIZE 131072
+#define URING_PIECE_MAX_IOV 64
+/* Requests smaller than this gain nothing from the ring, and go through pread/pwrite */
+#define URING_MIN_TRANSFER (2 * URING_PIECE_SIZE)
+
+/* One request on the ring: a stretch of the file, gathered from one or more
+buffers */
+typedef struct st_uring_piece {
+	off_t offset;
+	size_t length;
+	int first_iov;
+	int iov_count;
+} uring_piece;
+
+typedef struct st_uring {
+	int ring_fd;
+	unsigned int depth;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* transfer currently being carried out, split into pieces */
+	uring_piece *pieces;
+	int piece_count;
+	int piece_capacity;
+	int *pending; /* stack of pieces waiting to be (re)submitted */
+	struct iovec *iovs;
+	int iov_count;
+	int iov_capacity;
+
+	/* set once io_uring_enter has failed; everything after that goes
+	through the synchronous handlers */
+	int broken;
+
+	/* synchronous handlers, for transfers too small to be worth splitting */
+	ssize_t (*sync_read) (volume_container *v, off_t position, void *buf, size_t count);
+	ssize_t (*sync_write) (volume_container *v, off_t position, void *buf, size_t count);
+	ssize_t (*sync_readv) (volume_container *v, volume_io_run *runs, int run_count);
+	ssize_t (*sync_writev) (volume_container *v, volume_io_run *runs, int run_count);
+} uring;
+
+static void uring_free(uring *u) {
+	if (u->sqes) munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring) munmap(u->sq_ring, u->sq_ring_size);
+	if (u->ring_fd >= 0) close(u->ring_fd);
+	free(u->pieces);
+	free(u->pending);
+	free(u->iovs);
+	free(u);
+}
+
+static uring *uring_new(unsigned int depth) {
+	struct io_uring_params params;
+	uring *u;
+	char *sq, *cq;
+
+	u = calloc(1, sizeof(uring));
+	if (!u) return NULL;
+	u->ring_fd = -1;
+
+	memset(&params, 0, sizeof(params));
+	u->ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (u->ring_fd < 0) {
+		/* ENOSYS, or EPERM where io_uring is disabled by policy */
+		uring_free(u);
+		return NULL;
+	}
+	u->depth = params.sq_entries;
+
+	u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		uring_free(u);
+		return NULL;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			uring_free(u);
+			return NULL;
+		}
+	}
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		uring_free(u);
+		return NULL;
+	}
+
+	sq = u->sq_ring;
+	u->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	cq = u->cq_ring;
+	u->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return u;
+}
+
+/* Add a run to the current transfer. Runs that carry on from where the last
+one finished in the file are gathered into the same piece, and pieces are cut
+off at URING_PIECE_SIZE bytes */
+static int uring_add_run(uring *u, off_t offset, void *buf, size_t count) {
+	uring_piece *piece;
+	size_t len;
+
+	while (count > 0) {
+		if (u->iov_count == u->iov_capacity) {
+			int capacity = u->iov_capacity ? u->iov_capacity * 2 : 64;
+			struct iovec *iovs = realloc(u->iovs, capacity * sizeof(struct iovec));
+			if (!iovs) return -1;
+			u->iovs = iovs;
+			u->iov_capacity = capacity;
+		}
+		piece = u->piece_count ? &u->pieces[u->piece_count - 1] : NULL;
+		if (piece == NULL || piece->offset + (off_t)piece->length != offset
+			|| piece->length == URING_PIECE_SIZE || piece->iov_count == URING_PIECE_MAX_IOV) {
+			/* start a new piece */
+			if (u->piece_count == u->piece_capacity) {
+				int capacity = u->piece_capacity ? u->piece_capacity * 2 : 64;
+				uring_piece *pieces = realloc(u->pieces, capacity * sizeof(uring_piece));
+				int *pending;
+				if (!pieces) return -1;
+				u->pieces = pieces;
+				pending = realloc(u->pending, capacity * sizeof(int));
+				if (!pending) return -1;
+				u->pending = pending;
+				u->piece_capacity = capacity;
+			}
+			piece = &u->pieces[u->piece_count++];
+			piece->offset = offset;
+			piece->length = 0;
+			piece->first_iov = u->iov_count;
+			piece->iov_count = 0;
+		}
+		len = URING_PIECE_SIZE - piece->length;
+		if (len > count) len = count;
+		u->iovs[u->iov_count].iov_base = buf;
+		u->iovs[u->iov_count].iov_len = len;
+		u->iov_count++;
+		piece->iov_count++;
+		piece->length += len;
+		offset += len;
+		buf = (char *)buf + len;
+		count -= len;
+	}
+	return 0;
+}
+
+/* Carry out all pieces of the current transfer, keeping up to the ring depth
+of them in flight; pieces that come back short are resubmitted for the
+remainder. After an error nothing more is submitted, but the requests already
+in flight are waited for before their buffers are handed back */
+static int uring_run(uring *u, int fd, int writing) {
+	int pending_count, in_flight = 0, failed = 0, i, res;
+	unsigned int tail, head, to_submit;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	uring_piece *piece;
+
+	/* submit in ascending order, so pop from the end of a reversed list */
+	for (i = 0; i < u->piece_count; i++) u->pending[i] = u->piece_count - 1 - i;
+	pending_count = u->piece_count;
+
+	while (pending_count > 0 || in_flight > 0) {
+		to_submit = 0;
+		tail = *u->sq_tail;
+		while (pending_count > 0 && in_flight < (int)u->depth) {
+			i = u->pending[--pending_count];
+			piece = &u->pieces[i];
+			sqe = &u->sqes[tail & *u->sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = fd;
+			sqe->off = piece->offset;
+			sqe->addr = (unsigned long)&u->iovs[piece->first_iov];
+			sqe->len = piece->iov_count;
+			sqe->user_data = i;
+			u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+			tail++;
+			to_submit++;
+			in_flight++;
+		}
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+		do {
+			res = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		} while (res < 0 && errno == EINTR);
+		if (res < 0) {
+			/* the ring itself is unusable, so there is no getting the
+			outstanding requests back; fail this transfer and leave the
+			rest to pread/pwrite */
+			perror("io_uring_enter() error");
+			u->broken = 1;
+			return -1;
+		}
+
+		head = *u->cq_head;
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			piece = &u->pieces[cqe->user_data];
+			res = cqe->res;
+			head++;
+			in_flight--;
+			if (failed) continue;
+			if (res <= 0) {	/* includes unexpected EOF on reading */
+				if (res < 0) {
+					errno = -res;
+					perror(writing ? "io_uring write error" : "io_uring read error");
+				} else {
+					fprintf(stderr, "io_uring read error: unexpected end of file\n");
+				}
+				failed = 1;
+				pending_count = 0;
+			} else if ((size_t)res < piece->length) {
+				/* step over the buffers that have been completed, and
+				send the rest again */
+				piece->offset += res;
+				piece->length -= res;
+				while ((size_t)res >= u->iovs[piece->first_iov].iov_len) {
+					res -= u->iovs[piece->first_iov].iov_len;
+					piece->first_iov++;
+					piece->iov_count--;
+				}
+				u->iovs[piece->first_iov].iov_base = (char *)u->iovs[piece->first_iov].iov_base + res;
+				u->iovs[piece->first_iov].iov_len -= res;
+				u->pending[pending_count++] = cqe->user_data;
+			}
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return failed ? -1 : 0;
+}
+
+static ssize_t uring_transfer_runs(volume_container *v, volume_io_run *runs, int run_count, int writing) {
+	uring *u = v->data.file.uring;
+	ssize_t total = 0;
+	int i;
+
+	u->piece_count = 0;
+	u->iov_count = 0;
+	for (i = 0; i < run_count; i++) {
+		if (uring_add_run(u, runs[i].position + v->data.file.data_offset, runs[i].buf, runs[i].count) == -1) {
+			fprintf(stderr, "Out of memory queueing I/O requests\n");
+			return -1;
+		}
+		total += runs[i].count;
+	}
+	if (uring_run(u, v->data.file.fd, writing) == -1) return -1;
+	return total;
+}
+
+/* Carry out a transfer through the synchronous handlers, as the file would
+be without the ring */
+static ssize_t uring_sync_runs(volume_container *v, volume_io_run *runs, int run_count, int writing) {
+	uring *u = v->data.file.uring;
+	ssize_t res, done = 0;
+	int i;
+
+	if (writing && u->sync_writev) return u->sync_writev(v, runs, run_count);
+	if (!writing && u->sync_readv) return u->sync_readv(v, runs, run_count);
+	for (i = 0; i < run_count; i++) {
+		if (writing) res = u->sync_write(v, runs[i].position, runs[i].buf, runs[i].count);
+		else res = u->sync_read(v, runs[i].position, runs[i].buf, runs[i].count);
+		if (res != (ssize_t)runs[i].count) return -1;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t image_uring_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_io_run run;
+
+	uring *u = v->data.file.uring;
+
+	if (count < URING_MIN_TRANSFER || u->broken) return u->sync_read(v, position, buf, count);
+	run.position = position;
+	run.buf = buf;
+	run.count = count;
+	return uring_transfer_runs(v, &run, 1, 0);
+}
+
+static ssize_t image_uring_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_io_run run;
+
+	uring *u = v->data.file.uring;
+
+	if (count < URING_MIN_TRANSFER || u->broken) return u->sync_write(v, position, buf, count);
+	run.position = position;
+	run.buf = buf;
+	run.count = count;
+	return uring_transfer_runs(v, &run, 1, 1);
+}
+
+static ssize_t image_uring_readv(volume_container *v, volume_io_run *runs, int run_count) {
+	uring *u = v->data.file.uring;
+
+	if (u->broken) return uring_sync_runs(v, runs, run_count, 0);
+	return uring_transfer_runs(v, runs, run_count, 0);
+}
+
+static ssize_t image_uring_writev(volume_container *v, volume_io_run *runs, int run_count) {
+	uring *u = v->data.file.uring;
+
+	if (u->broken) return uring_sync_runs(v, runs, run_count, 1);
+	return uring_transfer_runs(v, runs, run_count, 1);
+}
+
+static int image_uring_close(volume_container *v) {
+	uring_free(v->data.file.uring);
+	v->data.file.uring = NULL;
+	close(v->data.file.fd);
+	return 0;
+}
+#endif
+
+/* Switch an open raw or HDF image over to io_uring, with up to queue_depth
+requests in flight. Returns -1, leaving the container on synchronous I/O, if
+io_uring is not available at build time or at run time */
+int image_file_uring(volume_container *v, unsigned int queue_depth) {
+#ifdef USE_IO_URING
+	uring *u;
+
+	if (v->data.file.map != NULL) return -1; /* memory mapping takes precedence */
+	u = uring_new(queue_depth);
+	if (!u) return -1;
+
+	u->sync_read = v->read;
+	u->sync_write = v->write;
+	u->sync_readv = v->readv;
+	u->sync_writev = v->writev;
+	v->data.file.uring = u;
+	v->read = &image_uring_read;
+	v->write = &image_uring_write;
+	v->readv = &image_uring_readv;
+	v->writev = &image_uring_writev;
+	v->close = &image_uring_close;
+	return 0;
+#else
+	return -1;
+#endif
+}
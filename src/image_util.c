@@ -0,0 +1,90 @@
+/* Helpers shared by the image file formats: positional I/O that doesn't stop
+short, little-endian fields, and spotting blocks of zeroes. */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "image_util.h"
+
+#ifndef HAVE_PREAD
+/* Positional I/O for platforms without pread/pwrite. Unlike the real thing,
+these move the file offset */
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+	if (lseek(fd, offset, SEEK_SET) < 0) return -1;
+	return read(fd, buf, count);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	if (lseek(fd, offset, SEEK_SET) < 0) return -1;
+	return write(fd, buf, count);
+}
+#endif
+
+void put_le32(unsigned char *p, unsigned long value) {
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = (value >> 24) & 0xff;
+}
+
+void put_le64(unsigned char *p, unsigned long long value) {
+	put_le32(p, value & 0xffffffff);
+	put_le32(p + 4, value >> 32);
+}
+
+unsigned long get_le32(unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+unsigned long long get_le64(unsigned char *p) {
+	return get_le32(p) | ((unsigned long long)get_le32(p + 4) << 32);
+}
+
+int read_fully(int fd, void *buf, size_t count, off_t offset) {
+	ssize_t res;
+	size_t done = 0;
+
+	while (done < count) {
+		res = pread(fd, (char *)buf + done, count - done, offset + done);
+		if (res < 0) {
+			perror("pread() error");
+			return -1;
+		}
+		if (res == 0) {
+			fprintf(stderr, "Unexpected end of file\n");
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+int write_fully(int fd, void *buf, size_t count, off_t offset) {
+	ssize_t res;
+	size_t done = 0;
+
+	while (done < count) {
+		res = pwrite(fd, (char *)buf + done, count - done, offset + done);
+		if (res < 0) {
+			perror("pwrite() error");
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+/* Test whether a buffer is all zeroes. Once the first 16 bytes are known to be
+zero, comparing the buffer against itself shifted along by 16 bytes covers the
+rest, and lets the C library's vectorised memcmp do the work */
+int buffer_is_zero(const unsigned char *buf, size_t count) {
+	size_t i;
+
+	for (i = 0; i < count && i < 16; i++) {
+		if (buf[i] != 0) return 0;
+	}
+	return (count <= 16 || memcmp(buf, buf + 16, count - 16) == 0);
+}
@@ -0,0 +1,26 @@
+#ifndef __IMAGE_UTIL_H
+#define __IMAGE_UTIL_H
+
+#include <unistd.h> /* for ssize_t */
+
+/* Helpers shared by the image file formats */
+
+#ifndef HAVE_PREAD
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+#endif
+
+/* Little-endian fields in on-disk headers and indexes */
+void put_le32(unsigned char *p, unsigned long value);
+void put_le64(unsigned char *p, unsigned long long value);
+unsigned long get_le32(unsigned char *p);
+unsigned long long get_le64(unsigned char *p);
+
+/* pread/pwrite the whole of count bytes, returning 0 or -1 */
+int read_fully(int fd, void *buf, size_t count, off_t offset);
+int write_fully(int fd, void *buf, size_t count, off_t offset);
+
+/* Nonzero if the count bytes at buf are all zero */
+int buffer_is_zero(const unsigned char *buf, size_t count);
+
+#endif /* #ifdef __IMAGE_UTIL_H */
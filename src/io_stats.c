@@ -0,0 +1,375 @@
+/* A volume_container layered over another one, which passes everything
+straight through while keeping count of what goes by: calls, bytes, how big
+the requests are, how many follow on from the one before, and how long they
+take. Counts are kept in a record that outlives the volume, so that they can
+all be reported together once the command has finished; the record for a
+volume handed to the FAT driver also picks up the counts of the sector cache
+and readahead layers beneath it as it is closed. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "volume_container.h"
+#include "sector_cache.h"
+#include "readahead.h"
+#include "io_stats.h"
+
+/* Histogram buckets: bucket n counts values from 2^(n-1) up to 2^n - 1, with
+bucket 0 for zero and the last bucket for anything larger */
+#define IO_STATS_BUCKETS 24
+
+typedef struct st_io_direction_stats {
+	unsigned long long calls;
+	unsigned long long runs; /* separate runs within vectored calls */
+	unsigned long long bytes;
+	unsigned long long sequential; /* runs starting where the last one ended */
+	unsigned long long time_us;
+	unsigned long long sizes[IO_STATS_BUCKETS]; /* run lengths, in sectors */
+	unsigned long long latencies[IO_STATS_BUCKETS]; /* call times, in microseconds */
+	off_t last_end;
+} io_direction_stats;
+
+typedef struct st_io_stats {
+	struct st_io_stats *next;
+	char *name;
+	unsigned int bytes_per_sector;
+	io_direction_stats read;
+	io_direction_stats write;
+	unsigned long long syncs;
+	int have_cache;
+	unsigned long cache_hits, cache_misses;
+	int have_readahead;
+	unsigned long readahead_hits, readahead_misses;
+} io_stats;
+
+/* Memory taken by something other than a volume, to report alongside them */
+#define IO_STATS_MEMORY_NOTES 4
+
+typedef struct st_memory_note {
+	const char *name;
+	unsigned long long bytes;
+} memory_note;
+
+static int stats_format = IO_STATS_OFF;
+static struct timeval start_time;
+static io_stats *records = NULL;
+static io_stats **records_tail = &records;
+static memory_note memory_notes[IO_STATS_MEMORY_NOTES];
+static int memory_note_count = 0;
+
+/* Start collecting statistics for volumes opened from now on, to be reported
+in the given format */
+void io_stats_enable(int format) {
+	stats_format = format;
+	gettimeofday(&start_time, NULL);
+}
+
+int io_stats_enabled(void) {
+	return (stats_format != IO_STATS_OFF);
+}
+
+static int bucket_for(unsigned long long value) {
+	int bucket = 0;
+
+	while (value != 0 && bucket < IO_STATS_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static unsigned long long microseconds_since(struct timeval *from) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - from->tv_sec) * 1000000ULL + now.tv_usec - from->tv_usec;
+}
+
+static void record_run(io_stats *stats, io_direction_stats *d, off_t position, size_t count) {
+	d->runs++;
+	d->bytes += count;
+	if (position == d->last_end) d->sequential++;
+	d->last_end = position + count;
+	d->sizes[bucket_for(count / stats->bytes_per_sector)]++;
+}
+
+static void record_call(io_direction_stats *d, struct timeval *started) {
+	unsigned long long elapsed = microseconds_since(started);
+
+	d->calls++;
+	d->time_us += elapsed;
+	d->latencies[bucket_for(elapsed)]++;
+}
+
+static ssize_t io_stats_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	io_stats *stats = v->data.layer.state;
+	struct timeval started;
+	ssize_t res;
+
+	gettimeofday(&started, NULL);
+	res = parent->read(parent, position, buf, count);
+	record_call(&stats->read, &started);
+	record_run(stats, &stats->read, position, count);
+	return res;
+}
+
+static ssize_t io_stats_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	io_stats *stats = v->data.layer.state;
+	struct timeval started;
+	ssize_t res;
+
+	gettimeofday(&started, NULL);
+	res = parent->write(parent, position, buf, count);
+	record_call(&stats->write, &started);
+	record_run(stats, &stats->write, position, count);
+	return res;
+}
+
+static ssize_t io_stats_readv(volume_container *v, volume_io_run *runs, int run_count) {
+	volume_container *parent = v->data.layer.parent;
+	io_stats *stats = v->data.layer.state;
+	struct timeval started;
+	ssize_t res;
+	int i;
+
+	gettimeofday(&started, NULL);
+	res = parent->readv(parent, runs, run_count);
+	record_call(&stats->read, &started);
+	for (i = 0; i < run_count; i++) record_run(stats, &stats->read, runs[i].position, runs[i].count);
+	return res;
+}
+
+static ssize_t io_stats_writev(volume_container *v, volume_io_run *runs, int run_count) {
+	volume_container *parent = v->data.layer.parent;
+	io_stats *stats = v->data.layer.state;
+	struct timeval started;
+	ssize_t res;
+	int i;
+
+	gettimeofday(&started, NULL);
+	res = parent->writev(parent, runs, run_count);
+	record_call(&stats->write, &started);
+	for (i = 0; i < run_count; i++) record_run(stats, &stats->write, runs[i].position, runs[i].count);
+	return res;
+}
+
+static int io_stats_sync(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	io_stats *stats = v->data.layer.state;
+
+	stats->syncs++;
+	return (parent->sync == NULL) ? 0 : parent->sync(parent);
+}
+
+static int io_stats_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	volume_container *parent = v->data.layer.parent;
+	return parent->find_data(parent, position, data_start, data_end);
+}
+
+static int io_stats_close(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	volume_container *layer = parent;
+	io_stats *stats = v->data.layer.state;
+	int res;
+
+	/* the layers that disk_map puts in front of a volume have nowhere else
+	to report to, so collect their counts while they're still here */
+	if (volume_is_sector_cache(layer)) {
+		stats->have_cache = 1;
+		sector_cache_stats(layer, &stats->cache_hits, &stats->cache_misses);
+		layer = layer->data.layer.parent;
+	}
+	if (volume_is_readahead(layer)) {
+		stats->have_readahead = 1;
+		readahead_stats(layer, &stats->readahead_hits, &stats->readahead_misses);
+	}
+
+	res = parent->close(parent);
+	free(parent);
+	return res;
+}
+
+/* Note the memory taken by something worth reporting, such as a FAT held in
+memory; name must outlive the report */
+void io_stats_memory(const char *name, unsigned long long bytes) {
+	if (!io_stats_enabled() || memory_note_count == IO_STATS_MEMORY_NOTES) return;
+	memory_notes[memory_note_count].name = name;
+	memory_notes[memory_note_count].bytes = bytes;
+	memory_note_count++;
+}
+
+/* Count everything that passes through the container v, under the given
+name. v is modified in place, like sector_cache_open. Nothing is done unless
+statistics have been enabled. */
+int io_stats_open(volume_container *v, const char *name) {
+	volume_container *parent;
+	io_stats *stats;
+
+	if (!io_stats_enabled()) return 0;
+
+	parent = malloc(sizeof(volume_container));
+	stats = calloc(1, sizeof(io_stats));
+	if (stats) stats->name = strdup(name);
+	if (!parent || !stats || !stats->name) {
+		if (stats) free(stats->name);
+		free(stats);
+		free(parent);
+		fprintf(stderr, "Out of memory setting up statistics\n");
+		return -1;
+	}
+	*parent = *v;
+	stats->bytes_per_sector = v->bytes_per_sector;
+	stats->read.last_end = -1;
+	stats->write.last_end = -1;
+	*records_tail = stats;
+	records_tail = &stats->next;
+
+	v->read = &io_stats_read;
+	v->write = &io_stats_write;
+	v->readv = (parent->readv != NULL) ? &io_stats_readv : NULL;
+	v->writev = (parent->writev != NULL) ? &io_stats_writev : NULL;
+	v->close = &io_stats_close;
+	v->sync = &io_stats_sync;
+	v->find_data = (parent->find_data != NULL) ? &io_stats_find_data : NULL;
+	v->data.layer.parent = parent;
+	v->data.layer.state = stats;
+	return 0;
+}
+
+static void print_histogram_text(FILE *out, const char *title, const char *unit, unsigned long long *buckets) {
+	int i;
+
+	fprintf(out, "    %s:", title);
+	for (i = 0; i < IO_STATS_BUCKETS; i++) {
+		if (buckets[i] == 0) continue;
+		if (i == 0) {
+			fprintf(out, " 0%s: %llu", unit, buckets[i]);
+		} else if (i == 1) {
+			fprintf(out, " 1%s: %llu", unit, buckets[i]);
+		} else if (i == IO_STATS_BUCKETS - 1) {
+			fprintf(out, " %llu+%s: %llu", 1ULL << (i - 1), unit, buckets[i]);
+		} else {
+			fprintf(out, " %llu-%llu%s: %llu", 1ULL << (i - 1), (1ULL << i) - 1, unit, buckets[i]);
+		}
+	}
+	fprintf(out, "\n");
+}
+
+static void print_direction_text(FILE *out, const char *title, io_direction_stats *d) {
+	fprintf(out, "  %s: %llu calls, %llu runs, %llu bytes, %.1f%% sequential, %.3f s\n",
+		title, d->calls, d->runs, d->bytes,
+		d->runs ? d->sequential * 100.0 / d->runs : 0.0, d->time_us / 1000000.0);
+	if (d->runs == 0) return;
+	print_histogram_text(out, "sizes", " sectors", d->sizes);
+	print_histogram_text(out, "latencies", "us", d->latencies);
+}
+
+static void print_histogram_json(FILE *out, const char *title, unsigned long long *buckets) {
+	int i, first = 1;
+
+	fprintf(out, "\"%s\": [", title);
+	for (i = 0; i < IO_STATS_BUCKETS; i++) {
+		if (buckets[i] == 0) continue;
+		fprintf(out, "%s{\"from\": %llu, \"count\": %llu}", first ? "" : ", ",
+			i == 0 ? 0ULL : 1ULL << (i - 1), buckets[i]);
+		first = 0;
+	}
+	fprintf(out, "]");
+}
+
+static void print_direction_json(FILE *out, const char *title, io_direction_stats *d) {
+	fprintf(out, "\"%s\": {\"calls\": %llu, \"runs\": %llu, \"bytes\": %llu, \"sequential_runs\": %llu, \"time_us\": %llu, ",
+		title, d->calls, d->runs, d->bytes, d->sequential, d->time_us);
+	print_histogram_json(out, "sizes_sectors", d->sizes);
+	fprintf(out, ", ");
+	print_histogram_json(out, "latencies_us", d->latencies);
+	fprintf(out, "}");
+}
+
+static void print_json_string(FILE *out, const char *s) {
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(out, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(out, "\\u%04x", *s);
+		} else {
+			fputc(*s, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/* Report the statistics of every volume opened since they were enabled, and
+let the records go */
+void io_stats_print(FILE *out) {
+	io_stats *stats, *next;
+	unsigned long long elapsed;
+	int i;
+
+	if (!io_stats_enabled()) return;
+	elapsed = microseconds_since(&start_time);
+
+	if (stats_format == IO_STATS_JSON) {
+		fprintf(out, "{\"elapsed_us\": %llu, \"volumes\": [", elapsed);
+	} else {
+		fprintf(out, "Elapsed time: %.3f s\n", elapsed / 1000000.0);
+	}
+	for (stats = records; stats != NULL; stats = stats->next) {
+		if (stats_format == IO_STATS_JSON) {
+			fprintf(out, "%s\n  {\"name\": ", stats == records ? "" : ",");
+			print_json_string(out, stats->name);
+			fprintf(out, ", \"bytes_per_sector\": %u, ", stats->bytes_per_sector);
+			print_direction_json(out, "read", &stats->read);
+			fprintf(out, ", ");
+			print_direction_json(out, "write", &stats->write);
+			fprintf(out, ", \"syncs\": %llu", stats->syncs);
+			if (stats->have_cache) {
+				fprintf(out, ", \"sector_cache\": {\"hits\": %lu, \"misses\": %lu}", stats->cache_hits, stats->cache_misses);
+			}
+			if (stats->have_readahead) {
+				fprintf(out, ", \"readahead\": {\"hits\": %lu, \"misses\": %lu}", stats->readahead_hits, stats->readahead_misses);
+			}
+			fprintf(out, "}");
+		} else {
+			fprintf(out, "%s (%u-byte sectors):\n", stats->name, stats->bytes_per_sector);
+			print_direction_text(out, "reads", &stats->read);
+			print_direction_text(out, "writes", &stats->write);
+			fprintf(out, "  syncs: %llu\n", stats->syncs);
+			if (stats->have_cache) {
+				fprintf(out, "  sector cache: %lu hits, %lu misses\n", stats->cache_hits, stats->cache_misses);
+			}
+			if (stats->have_readahead) {
+				fprintf(out, "  readahead: %lu hits, %lu misses\n", stats->readahead_hits, stats->readahead_misses);
+			}
+		}
+	}
+	if (stats_format == IO_STATS_JSON) {
+		fprintf(out, "\n], \"memory\": {");
+		for (i = 0; i < memory_note_count; i++) {
+			fprintf(out, "%s", i ? ", " : "");
+			print_json_string(out, memory_notes[i].name);
+			fprintf(out, ": %llu", memory_notes[i].bytes);
+		}
+		fprintf(out, "}}\n");
+	} else {
+		for (i = 0; i < memory_note_count; i++) {
+			fprintf(out, "%s: %llu bytes\n", memory_notes[i].name, memory_notes[i].bytes);
+		}
+	}
+	memory_note_count = 0;
+
+	for (stats = records; stats != NULL; stats = next) {
+		next = stats->next;
+		free(stats->name);
+		free(stats);
+	}
+	records = NULL;
+	records_tail = &records;
+}
@@ -0,0 +1,18 @@
+#ifndef __IO_STATS_H
+#define __IO_STATS_H
+
+#include <stdio.h>
+
+#include "volume_container.h"
+
+#define IO_STATS_OFF 0
+#define IO_STATS_TEXT 1
+#define IO_STATS_JSON 2
+
+void io_stats_enable(int format);
+int io_stats_enabled(void);
+void io_stats_memory(const char *name, unsigned long long bytes);
+int io_stats_open(volume_container *v, const char *name);
+void io_stats_print(FILE *out);
+
+#endif /* #ifdef __IO_STATS_H */
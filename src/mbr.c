@@ -1,4 +1,7 @@
+#include <config.h>
+
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "volume_container.h"
 #include "mbr.h"
@@ -19,21 +22,74 @@ int volume_is_bootable(volume_container *v) {
 	return (signature[0] == 0x55 && signature[1] == 0xaa);
 }
 
-int mbr_partition_info(volume_container *v, int partition_number, partition_info *p) {
-	unsigned char record_data[16];
-	if (!volume_is_bootable(v)) {
-		perror("Cannot fetch partition info - volume does not have an MBR");
-		return -1;
-	}
-	if (v->read(v, 0x1be + partition_number * 16, record_data, 16) != 16) {
-		perror("Error reading volume boot record");
-		return -1;
+/* The sector size recorded in a FAT boot record, or 0 if record isn't one */
+static unsigned int boot_record_sector_size(unsigned char *record) {
+	unsigned int size = record[0x0b] | (record[0x0c] << 8);
+
+	if (record[0x1fe] != 0x55 || record[0x1ff] != 0xaa) return 0;
+	if (record[0x00] != 0xeb && record[0x00] != 0xe9) return 0;
+	if (size != 512 && size != 1024 && size != 2048 && size != 4096) return 0;
+	return size;
+}
+
+/* Work out the sector size that the FAT volume on v was laid out with, from
+its boot record, or from the boot record of the first partition if v is
+partitioned; returns 0 if there's no FAT volume to go by */
+unsigned int volume_detect_sector_size(volume_container *v) {
+	unsigned char record[0x200];
+	unsigned long start_sector;
+	unsigned int size;
+	off_t volume_length = (off_t)v->sector_count * v->bytes_per_sector;
+
+	if (volume_length < 0x200 || v->read(v, 0, record, 0x200) != 0x200) return 0;
+	size = boot_record_sector_size(record);
+	if (size != 0 || record[0x1fe] != 0x55 || record[0x1ff] != 0xaa || record[0x1be + 0x04] == 0) return size;
+
+	/* partition offsets are in sectors, so try each size until the boot
+	record found there agrees with it */
+	start_sector = record[0x1c6] | (record[0x1c7] << 8) | (record[0x1c8] << 16) | ((unsigned long)record[0x1c9] << 24);
+	for (size = 512; size <= 4096; size <<= 1) {
+		if ((off_t)start_sector * size + 0x200 > volume_length) break;
+		if (v->read(v, (off_t)start_sector * size, record, 0x200) != 0x200) return 0;
+		if (boot_record_sector_size(record) == size) return size;
 	}
+	return 0;
+}
+
+static void mbr_decode_entry(volume_container *v, unsigned char *record_data, partition_info *p) {
 	p->volume = v;
 	p->status = record_data[0x00];
 	p->type = record_data[0x04];
-	p->start_sector = record_data[0x08] | (record_data[0x09] << 8) | (record_data[0x0a] << 16) | (record_data[0x0b] << 24);
-	p->sector_count = record_data[0x0c] | (record_data[0x0d] << 8) | (record_data[0x0e] << 16) | (record_data[0x0f] << 24);
+	p->start_sector = record_data[0x08] | (record_data[0x09] << 8) | (record_data[0x0a] << 16) | ((unsigned long)record_data[0x0b] << 24);
+	p->sector_count = record_data[0x0c] | (record_data[0x0d] << 8) | (record_data[0x0e] << 16) | ((unsigned long)record_data[0x0f] << 24);
+}
+
+/* Read all four primary partition entries with a single read of the boot
+record, so that looking up several of them doesn't go back to the disk */
+int mbr_read_partition_table(volume_container *v, partition_info table[MBR_PARTITION_COUNT]) {
+	unsigned char record[0x200];
+	int i;
+
+	if (v->bytes_per_sector < 0x200 || v->read(v, 0, record, 0x200) != 0x200) {
+		fprintf(stderr, "Error reading volume boot record\n");
+		return -1;
+	}
+	if (record[0x1fe] != 0x55 || record[0x1ff] != 0xaa) {
+		fprintf(stderr, "Cannot fetch partition info - volume does not have an MBR\n");
+		return -1;
+	}
+	for (i = 0; i < MBR_PARTITION_COUNT; i++) {
+		mbr_decode_entry(v, record + 0x1be + i * 16, &table[i]);
+	}
+	return 0;
+}
+
+int mbr_partition_info(volume_container *v, int partition_number, partition_info *p) {
+	partition_info table[MBR_PARTITION_COUNT];
+
+	if (partition_number < 0 || partition_number >= MBR_PARTITION_COUNT) return -1;
+	if (mbr_read_partition_table(v, table) == -1) return -1;
+	*p = table[partition_number];
 	return 0;
 }
 
@@ -42,24 +98,92 @@ int partition_info_is_fat(partition_info *p) {
 	return (p->status == 0x80 && (t == 0x01 || t == 0x04 || t == 0x05 || t == 0x06 || t == 0x0b || t == 0x0c || t == 0x0e));
 }
 
-static ssize_t partition_read(volume_container *partition, off64_t position, void *buf, size_t count) {
+static ssize_t partition_read(volume_container *partition, off_t position, void *buf, size_t count) {
 	volume_container *volume = partition->data.partition.parent;
 	return volume->read(volume, position + partition->data.partition.data_offset, buf, count);
 }
-static ssize_t partition_write(volume_container *partition, off64_t position, void *buf, size_t count) {
+static ssize_t partition_write(volume_container *partition, off_t position, void *buf, size_t count) {
 	volume_container *volume = partition->data.partition.parent;
 	return volume->write(volume, position + partition->data.partition.data_offset, buf, count);
 }
 
-int partition_open(partition_info *p, volume_container *partition) {
-	partition->read = &partition_read;
-	partition->write = &partition_write;
-	partition->bytes_per_sector = p->volume->bytes_per_sector;
-	partition->data.partition.parent = p->volume;
-	partition->data.partition.data_offset = p->start_sector * p->volume->bytes_per_sector;
-	return 0;
+/* Vectored transfers are passed on with the run positions moved along to the
+partition, and put back afterwards */
+static ssize_t partition_transfer_runs(volume_container *partition, volume_io_run *runs, int run_count, int writing) {
+	volume_container *volume = partition->data.partition.parent;
+	ssize_t res;
+	int i;
+
+	for (i = 0; i < run_count; i++) runs[i].position += partition->data.partition.data_offset;
+	res = writing ? volume_writev(volume, runs, run_count) : volume_readv(volume, runs, run_count);
+	for (i = 0; i < run_count; i++) runs[i].position -= partition->data.partition.data_offset;
+	return res;
+}
+static ssize_t partition_readv(volume_container *partition, volume_io_run *runs, int run_count) {
+	return partition_transfer_runs(partition, runs, run_count, 0);
 }
-int partition_close(volume_container *partition) {
+static ssize_t partition_writev(volume_container *partition, volume_io_run *runs, int run_count) {
+	return partition_transfer_runs(partition, runs, run_count, 1);
+}
+
+static int partition_sync(volume_container *partition) {
+	volume_container *volume = partition->data.partition.parent;
+	return (volume->sync == NULL) ? 0 : volume->sync(volume);
+}
+
+static int partition_find_data(volume_container *partition, off_t position, off_t *data_start, off_t *data_end) {
+	volume_container *volume = partition->data.partition.parent;
+	off_t offset = partition->data.partition.data_offset;
+	off_t end = (off_t)partition->sector_count * partition->bytes_per_sector;
+
+	if (volume->find_data(volume, position + offset, data_start, data_end) == -1) return -1;
+	*data_start -= offset;
+	*data_end -= offset;
+	if (*data_start > end) *data_start = end;
+	if (*data_end > end) *data_end = end;
 	return 0;
 }
 
+static int partition_close(volume_container *partition) {
+	volume_container *volume = partition->data.partition.parent;
+	int res;
+
+	res = volume->close(volume);
+	free(volume);
+	return res;
+}
+
+/* Narrow the container v down to the partition p within it. v is modified in
+place, like sector_cache_open, and closing it closes the whole volume */
+int partition_open(volume_container *v, partition_info *p) {
+	volume_container *volume;
+
+	if (p->type == 0 || p->sector_count == 0) {
+		fprintf(stderr, "Partition is empty\n");
+		return -1;
+	}
+	if ((unsigned long long)p->start_sector + p->sector_count > v->sector_count) {
+		fprintf(stderr, "Partition extends beyond the end of the volume\n");
+		return -1;
+	}
+
+	volume = malloc(sizeof(volume_container));
+	if (!volume) {
+		fprintf(stderr, "Out of memory opening partition\n");
+		return -1;
+	}
+	*volume = *v;
+
+	v->read = &partition_read;
+	v->write = &partition_write;
+	v->readv = (volume->readv != NULL) ? &partition_readv : NULL;
+	v->writev = (volume->writev != NULL) ? &partition_writev : NULL;
+	v->close = &partition_close;
+	v->sync = &partition_sync;
+	v->find_data = (volume->find_data != NULL) ? &partition_find_data : NULL;
+	v->sector_count = p->sector_count;
+	v->data.partition.parent = volume;
+	v->data.partition.data_offset = (off_t)p->start_sector * volume->bytes_per_sector;
+	p->volume = volume;
+	return 0;
+}
@@ -3,6 +3,8 @@
 
 #include "volume_container.h"
 
+#define MBR_PARTITION_COUNT 4
+
 typedef struct st_partition_info {
 	volume_container *volume;
 	unsigned char status;
@@ -12,11 +14,11 @@ typedef struct st_partition_info {
 } partition_info;
 
 int volume_is_bootable(volume_container *v);
+unsigned int volume_detect_sector_size(volume_container *v);
+int mbr_read_partition_table(volume_container *v, partition_info table[MBR_PARTITION_COUNT]);
 int mbr_partition_info(volume_container *v, int partition_number, partition_info *p);
 int partition_info_is_fat(partition_info *p);
 
-int partition_open(partition_info *p, volume_container *partition);
-int partition_close(volume_container *v);
+int partition_open(volume_container *v, partition_info *p);
 
 #endif /* #ifdef __MBR_H */
-
@@ -0,0 +1,373 @@
+/* Copy-on-write overlay images.
+
+An overlay presents the contents of a base image, which it never writes to,
+with any sectors that have been written since kept in a delta file of its
+own. The delta file consists of:
+
+	0x000	signature "HDFMO\x1a\0\0"
+	0x008	format version (4 bytes)
+	0x00c	bytes per sector (4 bytes)
+	0x010	sector count (8 bytes)
+	0x018	length of the base image's pathname (4 bytes)
+	0x020	base image pathname, up to OVERLAY_HEADER_SIZE
+	0x1000	sector records: sector number (8 bytes) followed by the sector data
+
+All values are little-endian. Records are appended as sectors are first
+written, and rewritten in place after that; the index from sector number to
+record is built up in memory when the overlay is opened. */
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "volume_container.h"
+#include "overlay_image.h"
+#include "image_util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static char *overlay_signature = "HDFMO\x1a\0\0";
+#define OVERLAY_SIGNATURE_LENGTH 8
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_SIZE 0x1000
+#define OVERLAY_PATH_OFFSET 0x20
+#define OVERLAY_MAX_PATH (OVERLAY_HEADER_SIZE - OVERLAY_PATH_OFFSET)
+#define OVERLAY_RECORD_HEADER_SIZE 8
+
+/* Open-addressed hash table from sector number to record offset */
+typedef struct st_overlay_slot {
+	off_t sector;
+	off_t record; /* 0 for an empty slot */
+} overlay_slot;
+
+typedef struct st_overlay {
+	int fd;
+	int writeable;
+	overlay_slot *slots;
+	unsigned long slot_count; /* a power of two */
+	unsigned long record_count;
+	off_t file_end;
+	unsigned char *sector_buf; /* one sector, for partial writes */
+} overlay;
+
+static unsigned long overlay_hash(overlay *o, off_t sector) {
+	return (unsigned long)((unsigned long long)sector * 2654435761UL) & (o->slot_count - 1);
+}
+
+static overlay_slot *overlay_lookup(overlay *o, off_t sector) {
+	unsigned long i;
+
+	if (o->slot_count == 0) return NULL;
+	i = overlay_hash(o, sector);
+	while (o->slots[i].record != 0) {
+		if (o->slots[i].sector == sector) return &o->slots[i];
+		i = (i + 1) & (o->slot_count - 1);
+	}
+	return NULL;
+}
+
+static int overlay_insert(overlay *o, off_t sector, off_t record) {
+	overlay_slot *old_slots = o->slots, *slot;
+	unsigned long old_count = o->slot_count, i;
+
+	/* keep the table no more than half full */
+	if ((o->record_count + 1) * 2 > o->slot_count) {
+		o->slot_count = o->slot_count ? o->slot_count * 2 : 1024;
+		o->slots = calloc(o->slot_count, sizeof(overlay_slot));
+		if (!o->slots) {
+			o->slots = old_slots;
+			o->slot_count = old_count;
+			fprintf(stderr, "Out of memory indexing overlay\n");
+			return -1;
+		}
+		o->record_count = 0;
+		for (i = 0; i < old_count; i++) {
+			if (old_slots[i].record != 0) overlay_insert(o, old_slots[i].sector, old_slots[i].record);
+		}
+		free(old_slots);
+	}
+
+	i = overlay_hash(o, sector);
+	while (o->slots[i].record != 0 && o->slots[i].sector != sector) {
+		i = (i + 1) & (o->slot_count - 1);
+	}
+	slot = &o->slots[i];
+	if (slot->record == 0) o->record_count++;
+	slot->sector = sector;
+	slot->record = record;
+	return 0;
+}
+
+static ssize_t overlay_read(volume_container *v, off_t position, void *buf, size_t count) {
+	overlay *o = v->data.layer.state;
+	volume_container *base = v->data.layer.parent;
+	unsigned int bps = v->bytes_per_sector;
+	overlay_slot *slot;
+	size_t done = 0, run, offset, len;
+	off_t sector;
+
+	while (done < count) {
+		sector = (position + done) / bps;
+		offset = (position + done) % bps;
+		len = bps - offset;
+		if (len > count - done) len = count - done;
+
+		slot = overlay_lookup(o, sector);
+		if (slot != NULL) {
+			if (read_fully(o->fd, (char *)buf + done, len, slot->record + OVERLAY_RECORD_HEADER_SIZE + offset) == -1) return -1;
+			done += len;
+			continue;
+		}
+
+		/* read the whole run of sectors that aren't in the overlay from the
+		base in one go */
+		run = len;
+		while (done + run < count && overlay_lookup(o, (position + done + run) / bps) == NULL) {
+			run += (count - done - run > bps) ? bps : count - done - run;
+		}
+		if (base->read(base, position + done, (char *)buf + done, run) < 0) return -1;
+		done += run;
+	}
+	return done;
+}
+
+static ssize_t overlay_write(volume_container *v, off_t position, void *buf, size_t count) {
+	overlay *o = v->data.layer.state;
+	unsigned int bps = v->bytes_per_sector;
+	overlay_slot *slot;
+	unsigned char record_header[OVERLAY_RECORD_HEADER_SIZE];
+	unsigned char *data;
+	size_t done = 0, offset, len;
+	off_t sector;
+
+	if (!o->writeable) {
+		fprintf(stderr, "Overlay is open read-only\n");
+		return -1;
+	}
+	while (done < count) {
+		sector = (position + done) / bps;
+		offset = (position + done) % bps;
+		len = bps - offset;
+		if (len > count - done) len = count - done;
+
+		slot = overlay_lookup(o, sector);
+		if (slot != NULL) {
+			if (write_fully(o->fd, (char *)buf + done, len, slot->record + OVERLAY_RECORD_HEADER_SIZE + offset) == -1) return -1;
+			done += len;
+			continue;
+		}
+
+		/* first write to this sector: copy it up, filling in anything the
+		caller isn't writing from the base */
+		data = (unsigned char *)buf + done;
+		if (len != bps) {
+			if (overlay_read(v, (off_t)sector * bps, o->sector_buf, bps) < 0) return -1;
+			memcpy(o->sector_buf + offset, data, len);
+			data = o->sector_buf;
+		}
+		put_le64(record_header, sector);
+		if (write_fully(o->fd, record_header, OVERLAY_RECORD_HEADER_SIZE, o->file_end) == -1
+			|| write_fully(o->fd, data, bps, o->file_end + OVERLAY_RECORD_HEADER_SIZE) == -1) return -1;
+		if (overlay_insert(o, sector, o->file_end) == -1) return -1;
+		o->file_end += OVERLAY_RECORD_HEADER_SIZE + bps;
+		done += len;
+	}
+	return done;
+}
+
+static int overlay_close(volume_container *v) {
+	overlay *o = v->data.layer.state;
+	volume_container *base = v->data.layer.parent;
+	int res;
+
+	close(o->fd);
+	free(o->slots);
+	free(o->sector_buf);
+	free(o);
+	res = base->close(base);
+	free(base);
+	return res;
+}
+
+/* Read the base image's pathname out of an overlay file; returns a newly
+allocated string, or NULL on failure */
+char *overlay_image_base(char *pathname) {
+	int fd;
+	unsigned char header[OVERLAY_HEADER_SIZE];
+	unsigned long length;
+	char *base_pathname;
+
+	if ( (fd = open(pathname, O_RDONLY | O_BINARY)) == -1 ) {
+		perror("open() (RDONLY) error");
+		return NULL;
+	}
+	if (read_fully(fd, header, OVERLAY_HEADER_SIZE, 0) == -1) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	length = get_le32(header + 0x18);
+	if (memcmp(header, overlay_signature, OVERLAY_SIGNATURE_LENGTH) != 0
+		|| get_le32(header + 0x08) != OVERLAY_VERSION || length >= OVERLAY_MAX_PATH) {
+		fprintf(stderr, "Unsupported overlay format\n");
+		return NULL;
+	}
+	base_pathname = malloc(length + 1);
+	if (!base_pathname) return NULL;
+	memcpy(base_pathname, header + OVERLAY_PATH_OFFSET, length);
+	base_pathname[length] = '\0';
+	return base_pathname;
+}
+
+/* Create an empty overlay file at pathname on top of the base image at
+base_pathname, which has been opened as base. base_pathname is recorded as it
+stands, so it should not depend on the current directory */
+int overlay_image_create(char *pathname, char *base_pathname, volume_container *base) {
+	int fd;
+	unsigned char header[OVERLAY_HEADER_SIZE];
+	size_t length;
+
+	length = strlen(base_pathname);
+	if (length >= OVERLAY_MAX_PATH) {
+		fprintf(stderr, "Base image pathname is too long\n");
+		return -1;
+	}
+
+	memset(header, 0, OVERLAY_HEADER_SIZE);
+	memcpy(header, overlay_signature, OVERLAY_SIGNATURE_LENGTH);
+	put_le32(header + 0x08, OVERLAY_VERSION);
+	put_le32(header + 0x0c, base->bytes_per_sector);
+	put_le64(header + 0x10, base->sector_count);
+	put_le32(header + 0x18, length);
+	memcpy(header + OVERLAY_PATH_OFFSET, base_pathname, length);
+
+	if ( (fd = open(pathname,
+			O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 ) {
+		perror("open() (RDWR) error");
+		return -1;
+	}
+	if (write_fully(fd, header, OVERLAY_HEADER_SIZE, 0) == -1) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Open the overlay file at pathname on top of base, a heap-allocated container
+holding its base image that the overlay takes over and closes along with
+itself */
+int overlay_image_open(volume_container *v, char *pathname, int writeable, volume_container *base) {
+	int fd;
+	unsigned char header[OVERLAY_HEADER_SIZE];
+	unsigned char record_header[OVERLAY_RECORD_HEADER_SIZE];
+	struct stat file_stat;
+	overlay *o;
+	off_t record, record_size;
+
+	if ( (fd = open(pathname, writeable ? O_RDWR | O_BINARY : O_RDONLY | O_BINARY)) == -1 ) {
+		perror(writeable ? "open() (RDWR) error" : "open() (RDONLY) error");
+		return -1;
+	}
+	if (read_fully(fd, header, OVERLAY_HEADER_SIZE, 0) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (get_le32(header + 0x0c) != base->bytes_per_sector || get_le64(header + 0x10) != base->sector_count) {
+		fprintf(stderr, "Base image has changed size since the overlay was created\n");
+		close(fd);
+		return -1;
+	}
+	if ( fstat(fd, &file_stat) == -1 ) {
+		perror("fstat() error");
+		close(fd);
+		return -1;
+	}
+
+	o = calloc(1, sizeof(overlay));
+	if (o) o->sector_buf = malloc(base->bytes_per_sector);
+	if (!o || !o->sector_buf) {
+		fprintf(stderr, "Out of memory opening overlay\n");
+		free(o);
+		close(fd);
+		return -1;
+	}
+	o->fd = fd;
+	o->writeable = writeable;
+
+	/* index the records; a partial one at the end, left by an interrupted
+	write, is ignored and will be overwritten */
+	record_size = OVERLAY_RECORD_HEADER_SIZE + base->bytes_per_sector;
+	for (record = OVERLAY_HEADER_SIZE; record + record_size <= file_stat.st_size; record += record_size) {
+		if (read_fully(fd, record_header, OVERLAY_RECORD_HEADER_SIZE, record) == -1
+			|| overlay_insert(o, get_le64(record_header), record) == -1) {
+			free(o->slots);
+			free(o->sector_buf);
+			free(o);
+			close(fd);
+			return -1;
+		}
+	}
+	o->file_end = record;
+
+	v->bytes_per_sector = base->bytes_per_sector;
+	v->sector_count = base->sector_count;
+	v->read = &overlay_read;
+	v->write = &overlay_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &overlay_close;
+	v->sync = NULL;
+	v->find_data = NULL;
+	v->data.layer.parent = base;
+	v->data.layer.state = o;
+	return 0;
+}
+
+/* Write every sector held in the overlay back to the base image (which must
+have been opened writeable), leaving the overlay empty */
+int overlay_image_commit(volume_container *v) {
+	overlay *o = v->data.layer.state;
+	volume_container *base = v->data.layer.parent;
+	unsigned long i;
+
+	for (i = 0; i < o->slot_count; i++) {
+		if (o->slots[i].record == 0) continue;
+		if (read_fully(o->fd, o->sector_buf, v->bytes_per_sector, o->slots[i].record + OVERLAY_RECORD_HEADER_SIZE) == -1) return -1;
+		if (base->write(base, o->slots[i].sector * v->bytes_per_sector, o->sector_buf, v->bytes_per_sector) < 0) return -1;
+	}
+	if (base->sync != NULL && base->sync(base) == -1) return -1;
+
+	if ( ftruncate(o->fd, OVERLAY_HEADER_SIZE) == -1 ) {
+		perror("ftruncate() error");
+		return -1;
+	}
+	memset(o->slots, 0, o->slot_count * sizeof(overlay_slot));
+	o->record_count = 0;
+	o->file_end = OVERLAY_HEADER_SIZE;
+	return 0;
+}
+
+int image_file_is_overlay(char *pathname) {
+	int fd;
+	char actual_signature[OVERLAY_SIGNATURE_LENGTH];
+
+	if ( (fd = open(pathname, O_RDONLY | O_BINARY)) == -1 ) {
+		return 0;
+	}
+	if (read(fd, actual_signature, OVERLAY_SIGNATURE_LENGTH) != OVERLAY_SIGNATURE_LENGTH) {
+		close(fd);
+		return 0; /* EOF or error */
+	}
+	close(fd);
+	return (memcmp(overlay_signature, actual_signature, OVERLAY_SIGNATURE_LENGTH) == 0);
+}
@@ -0,0 +1,12 @@
+#ifndef __OVERLAY_IMAGE_H
+#define __OVERLAY_IMAGE_H
+
+#include "volume_container.h"
+
+int overlay_image_create(char *pathname, char *base_pathname, volume_container *base);
+int overlay_image_open(volume_container *v, char *pathname, int writeable, volume_container *base);
+int overlay_image_commit(volume_container *v);
+char *overlay_image_base(char *pathname);
+int image_file_is_overlay(char *pathname);
+
+#endif /* #ifdef __OVERLAY_IMAGE_H */
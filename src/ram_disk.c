@@ -0,0 +1,239 @@
+/* A volume_container layered over another one, which holds everything written
+to it in memory and writes it out to the underlying container in a single
+sequential pass when closed. Memory is taken a page at a time as pages are
+first written, so only the parts of the volume that change take up space;
+pages that are never written are never written out either. With a limit set,
+the pages held are written out and dropped whenever they reach the limit,
+so that memory use stays bounded at the cost of a pass per spill. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "volume_container.h"
+#include "ram_disk.h"
+
+#define RAM_DISK_PAGE_SIZE 4096
+/* Pages are allocated this many at a time */
+#define RAM_DISK_SLAB_PAGES 256
+/* Runs handed to the underlying container in one vectored write */
+#define RAM_DISK_MAX_RUNS 64
+
+typedef struct st_ram_slab {
+	struct st_ram_slab *next;
+	unsigned int pages_used;
+	unsigned char *data;
+} ram_slab;
+
+typedef struct st_ram_disk {
+	unsigned char **pages; /* NULL for a page that isn't held */
+	unsigned long page_count;
+	ram_slab *slabs;
+	size_t limit; /* bytes to hold before spilling, or 0 for no limit */
+	size_t held;
+	int blank; /* nothing has been written to the underlying container */
+} ram_disk;
+
+/* Write out every page held, in order, merging pages that are next to each
+other both on the volume and in memory into single runs; then let them go */
+static int ram_disk_write_out(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	ram_disk *ram = v->data.layer.state;
+	volume_io_run runs[RAM_DISK_MAX_RUNS];
+	int run_count = 0;
+	unsigned long page;
+	off_t volume_length = (off_t)v->sector_count * v->bytes_per_sector, position;
+	size_t count;
+	ram_slab *slab;
+
+	for (page = 0; page < ram->page_count; page++) {
+		if (ram->pages[page] == NULL) continue;
+		position = (off_t)page * RAM_DISK_PAGE_SIZE;
+		count = (volume_length - position < RAM_DISK_PAGE_SIZE) ? volume_length - position : RAM_DISK_PAGE_SIZE;
+
+		if (run_count > 0
+			&& runs[run_count - 1].position + (off_t)runs[run_count - 1].count == position
+			&& (unsigned char *)runs[run_count - 1].buf + runs[run_count - 1].count == ram->pages[page]) {
+			runs[run_count - 1].count += count;
+			continue;
+		}
+		if (run_count == RAM_DISK_MAX_RUNS) {
+			if (volume_writev(parent, runs, run_count) < 0) return -1;
+			run_count = 0;
+		}
+		runs[run_count].position = position;
+		runs[run_count].buf = ram->pages[page];
+		runs[run_count].count = count;
+		run_count++;
+	}
+	if (run_count > 0 && volume_writev(parent, runs, run_count) < 0) return -1;
+
+	memset(ram->pages, 0, ram->page_count * sizeof(unsigned char *));
+	while (ram->slabs != NULL) {
+		slab = ram->slabs;
+		ram->slabs = slab->next;
+		free(slab->data);
+		free(slab);
+	}
+	ram->held = 0;
+	ram->blank = 0;
+	return 0;
+}
+
+/* Take a page of memory for the given page of the volume, spilling everything
+held so far if that would go over the limit */
+static unsigned char *ram_disk_new_page(volume_container *v, unsigned long page) {
+	ram_disk *ram = v->data.layer.state;
+	ram_slab *slab = ram->slabs;
+
+	if (ram->limit != 0 && ram->held + RAM_DISK_PAGE_SIZE > ram->limit) {
+		if (ram_disk_write_out(v) == -1) return NULL;
+		slab = NULL;
+	}
+	if (slab == NULL || slab->pages_used == RAM_DISK_SLAB_PAGES) {
+		slab = malloc(sizeof(ram_slab));
+		if (slab) slab->data = malloc((size_t)RAM_DISK_SLAB_PAGES * RAM_DISK_PAGE_SIZE);
+		if (!slab || !slab->data) {
+			free(slab);
+			fprintf(stderr, "Out of memory holding image in RAM; try a limit with --ram=<size>\n");
+			return NULL;
+		}
+		slab->pages_used = 0;
+		slab->next = ram->slabs;
+		ram->slabs = slab;
+	}
+	ram->pages[page] = slab->data + (size_t)slab->pages_used * RAM_DISK_PAGE_SIZE;
+	slab->pages_used++;
+	ram->held += RAM_DISK_PAGE_SIZE;
+	return ram->pages[page];
+}
+
+static ssize_t ram_disk_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	ram_disk *ram = v->data.layer.state;
+	size_t done = 0, offset, len, run;
+	unsigned long page;
+
+	while (done < count) {
+		page = (position + done) / RAM_DISK_PAGE_SIZE;
+		offset = (position + done) % RAM_DISK_PAGE_SIZE;
+		len = RAM_DISK_PAGE_SIZE - offset;
+		if (len > count - done) len = count - done;
+
+		if (ram->pages[page] != NULL) {
+			memcpy((char *)buf + done, ram->pages[page] + offset, len);
+			done += len;
+			continue;
+		}
+
+		/* read the whole run of pages that aren't held in one go */
+		run = len;
+		while (done + run < count && ram->pages[(position + done + run) / RAM_DISK_PAGE_SIZE] == NULL) {
+			run += (count - done - run > RAM_DISK_PAGE_SIZE) ? RAM_DISK_PAGE_SIZE : count - done - run;
+		}
+		if (ram->blank) {
+			memset((char *)buf + done, 0, run);
+		} else if (parent->read(parent, position + done, (char *)buf + done, run) < 0) {
+			return -1;
+		}
+		done += run;
+	}
+	return done;
+}
+
+static ssize_t ram_disk_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	ram_disk *ram = v->data.layer.state;
+	size_t done = 0, offset, len;
+	unsigned long page;
+	unsigned char *data;
+	off_t page_start, volume_length = (off_t)v->sector_count * v->bytes_per_sector;
+
+	while (done < count) {
+		page = (position + done) / RAM_DISK_PAGE_SIZE;
+		offset = (position + done) % RAM_DISK_PAGE_SIZE;
+		len = RAM_DISK_PAGE_SIZE - offset;
+		if (len > count - done) len = count - done;
+
+		data = ram->pages[page];
+		if (data == NULL) {
+			data = ram_disk_new_page(v, page);
+			if (data == NULL) return -1;
+			if (len != RAM_DISK_PAGE_SIZE) {
+				/* fill in the rest of the page from underneath */
+				page_start = (off_t)page * RAM_DISK_PAGE_SIZE;
+				if (ram->blank) {
+					memset(data, 0, RAM_DISK_PAGE_SIZE);
+				} else if (parent->read(parent, page_start, data,
+					(volume_length - page_start < RAM_DISK_PAGE_SIZE) ? volume_length - page_start : RAM_DISK_PAGE_SIZE) < 0) {
+					return -1;
+				}
+			}
+		}
+		memcpy(data + offset, (char *)buf + done, len);
+		done += len;
+	}
+	return done;
+}
+
+/* Nothing goes out before the volume is closed (or the limit is reached), so
+that it is all written in one pass */
+static int ram_disk_sync(volume_container *v) {
+	(void)v;
+	return 0;
+}
+
+static int ram_disk_close(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	ram_disk *ram = v->data.layer.state;
+	int res;
+
+	res = ram_disk_write_out(v);
+	if (res == 0 && parent->sync != NULL) res = parent->sync(parent);
+	if (parent->close(parent) != 0) res = -1;
+	free(ram->pages);
+	free(ram);
+	free(parent);
+	return res;
+}
+
+/* Hold everything written to the container v in memory until it is closed,
+or until limit bytes are held if limit is non-zero. blank says that the
+underlying container is known to hold nothing but zeroes, as a newly created
+image does, so that it needn't be read. v is modified in place, like
+sector_cache_open. */
+int ram_disk_open(volume_container *v, size_t limit, int blank) {
+	volume_container *parent;
+	ram_disk *ram;
+	unsigned long long page_count;
+
+	page_count = (v->sector_count * v->bytes_per_sector + RAM_DISK_PAGE_SIZE - 1) / RAM_DISK_PAGE_SIZE;
+
+	parent = malloc(sizeof(volume_container));
+	ram = calloc(1, sizeof(ram_disk));
+	if (parent) *parent = *v;
+	if (ram) ram->pages = calloc(page_count ? page_count : 1, sizeof(unsigned char *));
+	if (!parent || !ram || !ram->pages) {
+		if (ram) free(ram->pages);
+		free(ram);
+		free(parent);
+		fprintf(stderr, "Out of memory setting up RAM disk\n");
+		return -1;
+	}
+	ram->page_count = page_count;
+	ram->limit = (limit != 0 && limit < RAM_DISK_PAGE_SIZE) ? RAM_DISK_PAGE_SIZE : limit;
+	ram->blank = blank;
+
+	v->read = &ram_disk_read;
+	v->write = &ram_disk_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &ram_disk_close;
+	v->sync = &ram_disk_sync;
+	v->find_data = NULL;
+	v->data.layer.parent = parent;
+	v->data.layer.state = ram;
+	return 0;
+}
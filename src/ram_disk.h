@@ -0,0 +1,10 @@
+#ifndef __RAM_DISK_H
+#define __RAM_DISK_H
+
+#include <stddef.h>
+
+#include "volume_container.h"
+
+int ram_disk_open(volume_container *v, size_t limit, int blank);
+
+#endif /* #ifdef __RAM_DISK_H */
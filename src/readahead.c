@@ -0,0 +1,354 @@
+/* A volume_container layered over another one, which spots reads that follow
+on from each other and fetches the data beyond them on a thread of its own,
+so that by the time the next read arrives it is already in memory. The data
+comes in a window at a time, into one of two buffers: reads are served from
+one while the other is filled with the window after it. Any write throws
+away everything fetched, along with any fetch still under way, so that
+nothing stale is ever returned.
+
+The underlying container is only ever used by one thread at a time, so none
+of the containers below need to know about threads. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "volume_container.h"
+#include "readahead.h"
+
+#ifdef HAVE_PTHREAD
+
+/* Reads in a row that must follow on from each other before fetching starts */
+#define READAHEAD_TRIGGER 2
+
+typedef struct st_readahead {
+	volume_container *parent;
+	size_t window;
+	off_t volume_length;
+
+	/* data ready to be read */
+	unsigned char *current;
+	off_t current_start;
+	size_t current_length;
+
+	/* data being fetched, or fetched and waiting to be needed */
+	unsigned char *next;
+	off_t next_start;
+	size_t next_length;
+	int fetching; /* the worker has a fetch to do or under way */
+	int next_ready;
+	unsigned long generation; /* bumped by every write, to spot stale fetches */
+	unsigned long fetch_generation;
+
+	off_t last_end; /* where the last read finished */
+	int streak; /* number of reads in a row that followed on */
+
+	unsigned long hits;
+	unsigned long misses;
+
+	int stopping;
+	pthread_t worker;
+	pthread_mutex_t lock; /* everything above */
+	pthread_cond_t fetch_wanted;
+	pthread_cond_t fetch_done;
+	pthread_mutex_t parent_lock; /* use of the underlying container */
+} readahead;
+
+static void *readahead_worker(void *arg) {
+	readahead *ra = arg;
+	volume_container *parent = ra->parent;
+	off_t start;
+	size_t length;
+	ssize_t res;
+
+	pthread_mutex_lock(&ra->lock);
+	for (;;) {
+		while (!ra->fetching && !ra->stopping) {
+			pthread_cond_wait(&ra->fetch_wanted, &ra->lock);
+		}
+		if (ra->stopping) break;
+		start = ra->next_start;
+		length = ra->next_length;
+		pthread_mutex_unlock(&ra->lock);
+
+		pthread_mutex_lock(&ra->parent_lock);
+		res = parent->read(parent, start, ra->next, length);
+		pthread_mutex_unlock(&ra->parent_lock);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->fetching = 0;
+		/* a failed fetch is left for the reader to run into for itself */
+		if (res == (ssize_t)length && ra->fetch_generation == ra->generation) {
+			ra->next_ready = 1;
+		}
+		pthread_cond_broadcast(&ra->fetch_done);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/* Wait for any fetch under way to finish; called with the lock held */
+static void readahead_wait(readahead *ra) {
+	while (ra->fetching) pthread_cond_wait(&ra->fetch_done, &ra->lock);
+}
+
+/* Hand the worker the window that starts at position; called with the lock
+held and no fetch under way */
+static void readahead_fetch(readahead *ra, off_t position) {
+	if (position >= ra->volume_length) return;
+	ra->next_start = position;
+	ra->next_length = (ra->volume_length - position < (off_t)ra->window) ? (size_t)(ra->volume_length - position) : (size_t)ra->window;
+	ra->next_ready = 0;
+	ra->fetch_generation = ra->generation;
+	ra->fetching = 1;
+	pthread_cond_signal(&ra->fetch_wanted);
+}
+
+static ssize_t readahead_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	size_t done = 0, len;
+	off_t p;
+	unsigned char *swap;
+	ssize_t res;
+
+	pthread_mutex_lock(&ra->lock);
+	while (done < count) {
+		p = position + done;
+		if (p >= ra->current_start && p < ra->current_start + (off_t)ra->current_length) {
+			len = ra->current_start + ra->current_length - p;
+			if (len > count - done) len = count - done;
+			memcpy((char *)buf + done, ra->current + (p - ra->current_start), len);
+			done += len;
+			continue;
+		}
+		if ((ra->fetching || ra->next_ready)
+			&& p >= ra->next_start && p < ra->next_start + (off_t)ra->next_length) {
+			/* the window we want is on its way */
+			readahead_wait(ra);
+			if (ra->next_ready) {
+				swap = ra->current;
+				ra->current = ra->next;
+				ra->next = swap;
+				ra->current_start = ra->next_start;
+				ra->current_length = ra->next_length;
+				ra->next_ready = 0;
+				continue;
+			}
+		}
+		break;
+	}
+
+	if (done < count) {
+		/* not fetched in time (or at all); go to the container directly */
+		ra->misses++;
+		pthread_mutex_unlock(&ra->lock);
+		pthread_mutex_lock(&ra->parent_lock);
+		res = parent->read(parent, position + done, (char *)buf + done, count - done);
+		pthread_mutex_unlock(&ra->parent_lock);
+		if (res != (ssize_t)(count - done)) return -1;
+		pthread_mutex_lock(&ra->lock);
+	} else {
+		ra->hits++;
+	}
+
+	/* keep a window ahead of a reader that's working its way along; single
+	sectors read from elsewhere on the way, such as from the FAT, don't
+	count as leaving the stream */
+	if (position == ra->last_end) {
+		ra->streak++;
+		ra->last_end = position + count;
+	} else if (count > v->bytes_per_sector) {
+		ra->streak = 0;
+		ra->last_end = position + count;
+	}
+	if (ra->streak >= READAHEAD_TRIGGER && !ra->fetching && !ra->next_ready) {
+		p = ra->last_end;
+		if (p >= ra->current_start && p < ra->current_start + (off_t)ra->current_length) {
+			p = ra->current_start + ra->current_length;
+		}
+		readahead_fetch(ra, p);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return count;
+}
+
+/* Forget everything fetched so far, including anything still arriving;
+called with the lock held */
+static void readahead_invalidate(readahead *ra) {
+	ra->generation++;
+	ra->current_length = 0;
+	ra->next_ready = 0;
+	ra->streak = 0;
+}
+
+static ssize_t readahead_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	ssize_t res;
+
+	pthread_mutex_lock(&ra->lock);
+	readahead_invalidate(ra);
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_mutex_lock(&ra->parent_lock);
+	res = parent->write(parent, position, buf, count);
+	pthread_mutex_unlock(&ra->parent_lock);
+	return res;
+}
+
+static ssize_t readahead_writev(volume_container *v, volume_io_run *runs, int run_count) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	ssize_t res;
+
+	pthread_mutex_lock(&ra->lock);
+	readahead_invalidate(ra);
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_mutex_lock(&ra->parent_lock);
+	res = volume_writev(parent, runs, run_count);
+	pthread_mutex_unlock(&ra->parent_lock);
+	return res;
+}
+
+static int readahead_sync(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	int res;
+
+	if (parent->sync == NULL) return 0;
+	pthread_mutex_lock(&ra->parent_lock);
+	res = parent->sync(parent);
+	pthread_mutex_unlock(&ra->parent_lock);
+	return res;
+}
+
+static int readahead_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	int res;
+
+	pthread_mutex_lock(&ra->parent_lock);
+	res = parent->find_data(parent, position, data_start, data_end);
+	pthread_mutex_unlock(&ra->parent_lock);
+	return res;
+}
+
+static int readahead_close(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	readahead *ra = v->data.layer.state;
+	int res;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stopping = 1;
+	pthread_cond_signal(&ra->fetch_wanted);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->worker, NULL);
+
+	res = parent->close(parent);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_mutex_destroy(&ra->parent_lock);
+	pthread_cond_destroy(&ra->fetch_wanted);
+	pthread_cond_destroy(&ra->fetch_done);
+	free(ra->current);
+	free(ra->next);
+	free(ra);
+	free(parent);
+	return res;
+}
+
+/* Fetch data ahead of sequential reads from the container v, window bytes at
+a time. v is modified in place, like sector_cache_open. Without threads
+there's nothing to be gained, so v is left as it is. */
+int readahead_open(volume_container *v, size_t window) {
+	volume_container *parent;
+	readahead *ra;
+
+	if (window == 0) return 0;
+
+	parent = malloc(sizeof(volume_container));
+	ra = calloc(1, sizeof(readahead));
+	if (parent) *parent = *v;
+	if (ra) {
+		ra->current = malloc(window);
+		ra->next = malloc(window);
+	}
+	if (!parent || !ra || !ra->current || !ra->next) {
+		if (ra) {
+			free(ra->current);
+			free(ra->next);
+		}
+		free(ra);
+		free(parent);
+		fprintf(stderr, "Out of memory allocating readahead buffers\n");
+		return -1;
+	}
+	ra->parent = parent;
+	ra->window = window;
+	ra->volume_length = (off_t)v->sector_count * v->bytes_per_sector;
+	ra->last_end = -1;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_mutex_init(&ra->parent_lock, NULL);
+	pthread_cond_init(&ra->fetch_wanted, NULL);
+	pthread_cond_init(&ra->fetch_done, NULL);
+
+	v->read = &readahead_read;
+	v->write = &readahead_write;
+	v->readv = NULL;
+	v->writev = &readahead_writev;
+	v->close = &readahead_close;
+	v->sync = &readahead_sync;
+	v->find_data = (parent->find_data != NULL) ? &readahead_find_data : NULL;
+	v->data.layer.parent = parent;
+	v->data.layer.state = ra;
+
+	if (pthread_create(&ra->worker, NULL, readahead_worker, ra) != 0) {
+		/* quietly carry on without */
+		*v = *parent;
+		pthread_mutex_destroy(&ra->lock);
+		pthread_mutex_destroy(&ra->parent_lock);
+		pthread_cond_destroy(&ra->fetch_wanted);
+		pthread_cond_destroy(&ra->fetch_done);
+		free(ra->current);
+		free(ra->next);
+		free(ra);
+		free(parent);
+	}
+	return 0;
+}
+
+int volume_is_readahead(volume_container *v) {
+	return (v->close == &readahead_close);
+}
+
+void readahead_stats(volume_container *v, unsigned long *hits, unsigned long *misses) {
+	readahead *ra = v->data.layer.state;
+
+	pthread_mutex_lock(&ra->lock);
+	*hits = ra->hits;
+	*misses = ra->misses;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+#else
+
+int readahead_open(volume_container *v, size_t window) {
+	return 0;
+}
+
+int volume_is_readahead(volume_container *v) {
+	return 0;
+}
+
+void readahead_stats(volume_container *v, unsigned long *hits, unsigned long *misses) {
+	*hits = 0;
+	*misses = 0;
+}
+
+#endif
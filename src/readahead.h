@@ -0,0 +1,14 @@
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include <stddef.h>
+
+#include "volume_container.h"
+
+#define READAHEAD_DEFAULT_WINDOW 1048576
+
+int readahead_open(volume_container *v, size_t window);
+int volume_is_readahead(volume_container *v);
+void readahead_stats(volume_container *v, unsigned long *hits, unsigned long *misses);
+
+#endif /* #ifdef __READAHEAD_H */
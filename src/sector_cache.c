@@ -0,0 +1,370 @@
+/* A volume_container layered over another one, which keeps the most recently
+used sectors in memory. By default writes go straight through to the
+underlying container, updating any cached copy on the way; in write-back mode,
+single-sector writes are held in the cache until it is synced or closed, or
+runs out of room, and then written out in order with neighbouring sectors
+merged into single transfers. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "volume_container.h"
+#include "sector_cache.h"
+
+/* Transfers longer than this are taken to be file data rather than FAT or
+directory sectors; they are served from the cache where possible, but do not
+push anything else out of it */
+#define SECTOR_CACHE_MAX_INSERT 1
+
+typedef struct st_cache_entry {
+	off_t sector;
+	unsigned char *data;
+	struct st_cache_entry *hash_next;
+	struct st_cache_entry *lru_prev; /* towards the most recently used */
+	struct st_cache_entry *lru_next; /* towards the least recently used */
+	int dirty;
+} cache_entry;
+
+typedef struct st_sector_cache {
+	unsigned int capacity;
+	cache_entry *entries;
+	unsigned char *data;
+	cache_entry **hash;
+	unsigned int hash_mask;
+	cache_entry *lru_head;
+	cache_entry *lru_tail;
+	cache_entry *free_entries;
+	int writeback;
+	unsigned int dirty_count;
+	cache_entry **flush_list; /* work area for sorting dirty entries */
+	volume_io_run *flush_runs;
+	unsigned long hits;
+	unsigned long misses;
+} sector_cache;
+
+static unsigned int cache_hash(sector_cache *cache, off_t sector) {
+	return ((unsigned int)sector * 2654435761U) & cache->hash_mask;
+}
+
+static cache_entry *cache_lookup(sector_cache *cache, off_t sector) {
+	cache_entry *e;
+
+	for (e = cache->hash[cache_hash(cache, sector)]; e != NULL; e = e->hash_next) {
+		if (e->sector == sector) return e;
+	}
+	return NULL;
+}
+
+static void lru_unlink(sector_cache *cache, cache_entry *e) {
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		cache->lru_head = e->lru_next;
+	}
+	if (e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		cache->lru_tail = e->lru_prev;
+	}
+}
+
+static void lru_push_head(sector_cache *cache, cache_entry *e) {
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = e;
+	} else {
+		cache->lru_tail = e;
+	}
+	cache->lru_head = e;
+}
+
+static void cache_touch(sector_cache *cache, cache_entry *e) {
+	if (cache->lru_head != e) {
+		lru_unlink(cache, e);
+		lru_push_head(cache, e);
+	}
+}
+
+static void hash_unlink(sector_cache *cache, cache_entry *e) {
+	cache_entry **p = &cache->hash[cache_hash(cache, e->sector)];
+
+	while (*p != e) p = &(*p)->hash_next;
+	*p = e->hash_next;
+}
+
+/* Remove an entry from the cache, returning it to the free list */
+static void cache_discard(sector_cache *cache, cache_entry *e) {
+	hash_unlink(cache, e);
+	lru_unlink(cache, e);
+	e->hash_next = cache->free_entries;
+	cache->free_entries = e;
+}
+
+static int compare_entry_sectors(const void *a, const void *b) {
+	off_t sa = (*(cache_entry **)a)->sector;
+	off_t sb = (*(cache_entry **)b)->sector;
+	return (sa < sb) ? -1 : (sa > sb);
+}
+
+/* Write out all dirty sectors in ascending order, as a single vectored write
+in which consecutive sectors form consecutive runs */
+static int cache_flush(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	sector_cache *cache = v->data.layer.state;
+	unsigned int bps = v->bytes_per_sector;
+	unsigned int i, n;
+	size_t total;
+
+	if (cache->dirty_count == 0) return 0;
+
+	n = 0;
+	for (i = 0; i < cache->capacity; i++) {
+		if (cache->entries[i].dirty) cache->flush_list[n++] = &cache->entries[i];
+	}
+	qsort(cache->flush_list, n, sizeof(cache_entry *), compare_entry_sectors);
+
+	for (i = 0; i < n; i++) {
+		cache->flush_runs[i].position = cache->flush_list[i]->sector * bps;
+		cache->flush_runs[i].buf = cache->flush_list[i]->data;
+		cache->flush_runs[i].count = bps;
+	}
+	total = (size_t)n * bps;
+	if (volume_writev(parent, cache->flush_runs, n) != (ssize_t)total) {
+		fprintf(stderr, "Error writing back cached sectors\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) cache->flush_list[i]->dirty = 0;
+	cache->dirty_count = 0;
+	return 0;
+}
+
+/* Store a copy of a sector, evicting the least recently used one if the cache
+is full. If that one has not been written back yet, everything outstanding is
+written back first. */
+static int cache_insert(volume_container *v, off_t sector, void *data, int dirty) {
+	sector_cache *cache = v->data.layer.state;
+	cache_entry *e;
+	unsigned int h;
+
+	if (cache->free_entries) {
+		e = cache->free_entries;
+		cache->free_entries = e->hash_next;
+	} else {
+		e = cache->lru_tail;
+		if (e->dirty && cache_flush(v) == -1) return -1;
+		hash_unlink(cache, e);
+		lru_unlink(cache, e);
+	}
+
+	e->sector = sector;
+	memcpy(e->data, data, v->bytes_per_sector);
+	e->dirty = dirty;
+	if (dirty) cache->dirty_count++;
+	h = cache_hash(cache, sector);
+	e->hash_next = cache->hash[h];
+	cache->hash[h] = e;
+	lru_push_head(cache, e);
+	return 0;
+}
+
+static ssize_t sector_cache_read(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	sector_cache *cache = v->data.layer.state;
+	unsigned int bps = v->bytes_per_sector;
+	off_t first;
+	size_t i, j, n;
+	cache_entry *e;
+
+	if (position % bps || count % bps) {
+		/* odd-sized access, such as reading the partition table; bring the
+		parent up to date and pass it on */
+		if (cache_flush(v) == -1) return -1;
+		return parent->read(parent, position, buf, count);
+	}
+
+	first = position / bps;
+	n = count / bps;
+	i = 0;
+	while (i < n) {
+		e = cache_lookup(cache, first + i);
+		if (e) {
+			memcpy((char *)buf + i * bps, e->data, bps);
+			cache_touch(cache, e);
+			cache->hits++;
+			i++;
+			continue;
+		}
+
+		/* fetch the whole run of missing sectors in one go */
+		for (j = i + 1; j < n && cache_lookup(cache, first + j) == NULL; j++);
+		if (parent->read(parent, position + i * bps, (char *)buf + i * bps, (j - i) * bps) != (ssize_t)((j - i) * bps)) {
+			return -1;
+		}
+		cache->misses += j - i;
+		if (n <= SECTOR_CACHE_MAX_INSERT) {
+			for (; i < j; i++) {
+				if (cache_insert(v, first + i, (char *)buf + i * bps, 0) == -1) return -1;
+			}
+		}
+		i = j;
+	}
+	return count;
+}
+
+static ssize_t sector_cache_write(volume_container *v, off_t position, void *buf, size_t count) {
+	volume_container *parent = v->data.layer.parent;
+	sector_cache *cache = v->data.layer.state;
+	unsigned int bps = v->bytes_per_sector;
+	off_t sector, first, last;
+	size_t n;
+	cache_entry *e;
+	ssize_t res;
+	int hold;
+
+	if (position % bps || count % bps) {
+		/* odd-sized access; drop any sectors it touches rather than patch them */
+		if (cache_flush(v) == -1) return -1;
+		res = parent->write(parent, position, buf, count);
+		if (res != (ssize_t)count) return res;
+		last = (position + count + bps - 1) / bps;
+		for (sector = position / bps; sector < last; sector++) {
+			if ((e = cache_lookup(cache, sector)) != NULL) cache_discard(cache, e);
+		}
+		return count;
+	}
+
+	first = position / bps;
+	n = count / bps;
+
+	/* longer writes are file data, which is written through even in write-back
+	mode as it's already a single large transfer */
+	hold = (cache->writeback && n <= SECTOR_CACHE_MAX_INSERT);
+	if (!hold) {
+		res = parent->write(parent, position, buf, count);
+		if (res != (ssize_t)count) return res;
+	}
+
+	for (sector = first; sector < first + (off_t)n; sector++) {
+		e = cache_lookup(cache, sector);
+		if (e) {
+			memcpy(e->data, (char *)buf + (sector - first) * bps, bps);
+			if (hold && !e->dirty) cache->dirty_count++;
+			if (!hold && e->dirty) cache->dirty_count--;
+			e->dirty = hold;
+			cache_touch(cache, e);
+		} else if (n <= SECTOR_CACHE_MAX_INSERT) {
+			if (cache_insert(v, sector, (char *)buf + (sector - first) * bps, hold) == -1) return -1;
+		}
+	}
+	return count;
+}
+
+static int sector_cache_sync(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+
+	if (cache_flush(v) == -1) return -1;
+	return (parent->sync == NULL) ? 0 : parent->sync(parent);
+}
+
+static int sector_cache_find_data(volume_container *v, off_t position, off_t *data_start, off_t *data_end) {
+	volume_container *parent = v->data.layer.parent;
+
+	/* held writes aren't part of the parent's idea of where the data is yet */
+	if (cache_flush(v) == -1) return -1;
+	if (parent->find_data == NULL) {
+		*data_start = position;
+		*data_end = (off_t)v->sector_count * v->bytes_per_sector;
+		return 0;
+	}
+	return parent->find_data(parent, position, data_start, data_end);
+}
+
+static int sector_cache_close(volume_container *v) {
+	volume_container *parent = v->data.layer.parent;
+	sector_cache *cache = v->data.layer.state;
+	int res;
+
+	res = cache_flush(v);
+	if (parent->close(parent) != 0) res = -1;
+	free(cache->flush_list);
+	free(cache->flush_runs);
+	free(cache->hash);
+	free(cache->data);
+	free(cache->entries);
+	free(cache);
+	free(parent);
+	return res;
+}
+
+/* Put a cache of up to sector_count sectors in front of the container v. v is
+modified in place, so that anything already holding a pointer to it picks up
+the cache; closing it writes back any outstanding sectors and closes the
+original container too. */
+int sector_cache_open(volume_container *v, unsigned int sector_count, int writeback) {
+	volume_container *parent;
+	sector_cache *cache;
+	unsigned int i, hash_size;
+
+	if (sector_count == 0) return 0;
+
+	parent = malloc(sizeof(volume_container));
+	cache = calloc(1, sizeof(sector_cache));
+	if (parent) *parent = *v;
+	if (cache) {
+		for (hash_size = 1; hash_size < sector_count * 2; hash_size <<= 1);
+		cache->capacity = sector_count;
+		cache->writeback = writeback;
+		cache->flush_list = malloc(sector_count * sizeof(cache_entry *));
+		cache->flush_runs = malloc(sector_count * sizeof(volume_io_run));
+		cache->hash_mask = hash_size - 1;
+		cache->hash = calloc(hash_size, sizeof(cache_entry *));
+		cache->entries = calloc(sector_count, sizeof(cache_entry));
+		cache->data = malloc((size_t)sector_count * v->bytes_per_sector);
+	}
+	if (!parent || !cache || !cache->hash || !cache->entries || !cache->data
+		|| !cache->flush_list || !cache->flush_runs) {
+		if (cache) {
+			free(cache->flush_list);
+			free(cache->flush_runs);
+			free(cache->hash);
+			free(cache->entries);
+			free(cache->data);
+		}
+		free(cache);
+		free(parent);
+		fprintf(stderr, "Out of memory allocating sector cache\n");
+		return -1;
+	}
+
+	for (i = 0; i < sector_count; i++) {
+		cache->entries[i].data = cache->data + (size_t)i * v->bytes_per_sector;
+		cache->entries[i].hash_next = cache->free_entries;
+		cache->free_entries = &cache->entries[i];
+	}
+
+	v->read = &sector_cache_read;
+	v->write = &sector_cache_write;
+	v->readv = NULL;
+	v->writev = NULL;
+	v->close = &sector_cache_close;
+	v->sync = &sector_cache_sync;
+	v->find_data = &sector_cache_find_data;
+	v->data.layer.parent = parent;
+	v->data.layer.state = cache;
+	return 0;
+}
+
+int volume_is_sector_cache(volume_container *v) {
+	return (v->close == &sector_cache_close);
+}
+
+void sector_cache_stats(volume_container *v, unsigned long *hits, unsigned long *misses) {
+	sector_cache *cache = v->data.layer.state;
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
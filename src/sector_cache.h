@@ -0,0 +1,12 @@
+#ifndef __SECTOR_CACHE_H
+#define __SECTOR_CACHE_H
+
+#include "volume_container.h"
+
+#define SECTOR_CACHE_DEFAULT_SIZE 1024
+
+int sector_cache_open(volume_container *v, unsigned int sector_count, int writeback);
+int volume_is_sector_cache(volume_container *v);
+void sector_cache_stats(volume_container *v, unsigned long *hits, unsigned long *misses);
+
+#endif /* #ifdef __SECTOR_CACHE_H */
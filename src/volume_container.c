@@ -0,0 +1,33 @@
+#include <config.h>
+
+#include "volume_container.h"
+
+/* Vectored read on any container: use its own readv method if it has one,
+otherwise fall back on a read per run */
+ssize_t volume_readv(volume_container *v, volume_io_run *runs, int run_count) {
+	ssize_t res, done = 0;
+	int i;
+
+	if (v->readv != NULL) return v->readv(v, runs, run_count);
+
+	for (i = 0; i < run_count; i++) {
+		res = v->read(v, runs[i].position, runs[i].buf, runs[i].count);
+		if (res != (ssize_t)runs[i].count) return -1;
+		done += res;
+	}
+	return done;
+}
+
+ssize_t volume_writev(volume_container *v, volume_io_run *runs, int run_count) {
+	ssize_t res, done = 0;
+	int i;
+
+	if (v->writev != NULL) return v->writev(v, runs, run_count);
+
+	for (i = 0; i < run_count; i++) {
+		res = v->write(v, runs[i].position, runs[i].buf, runs[i].count);
+		if (res != (ssize_t)runs[i].count) return -1;
+		done += res;
+	}
+	return done;
+}
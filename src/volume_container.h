@@ -3,26 +3,64 @@
 
 #include <unistd.h> /* for ssize_t */
 
+/* One contiguous transfer within a vectored read or write */
+typedef struct st_volume_io_run {
+	off_t position;
+	void *buf;
+	size_t count;
+} volume_io_run;
+
 /* An abstract representation of something acting as a disk; a resource with
 data chunks that can be read/written. */
 
 typedef struct st_volume_container {
 	ssize_t (*read) (struct st_volume_container *v, off_t position, void *buf, size_t count);
 	ssize_t (*write) (struct st_volume_container *v, off_t position, void *buf, size_t count);
+	/* Transfer a list of runs, which need not be adjacent, returning the total
+	number of bytes transferred; NULL if the container has no better way of
+	doing this than a read/write per run (use volume_readv/volume_writev) */
+	ssize_t (*readv) (struct st_volume_container *v, volume_io_run *runs, int run_count);
+	ssize_t (*writev) (struct st_volume_container *v, volume_io_run *runs, int run_count);
 	int (*close) (struct st_volume_container *v);
+	/* Push any buffered writes out to the underlying storage; NULL if writes
+	are always passed straight through */
+	int (*sync) (struct st_volume_container *v);
+	/* Find the first stretch of data at or after position, setting data_start
+	and data_end (equal to each other if there is nothing but zeroes from
+	position to the end); NULL if the container can't tell holes from data */
+	int (*find_data) (struct st_volume_container *v, off_t position, off_t *data_start, off_t *data_end);
 	unsigned int bytes_per_sector;
-	unsigned long sector_count;
+	unsigned long long sector_count;
 	union {
 		struct st_volume_container_file {
 			int fd;
 			off_t data_offset;
+			unsigned char *map; /* file contents, if memory-mapped */
+			size_t map_length;
+			void *uring; /* io_uring state, if using asynchronous I/O */
+			unsigned char *bounce; /* aligned buffer, if using direct I/O */
+			off_t length; /* size of the file, if using direct I/O */
 		} file;
 		struct st_volume_container_partition {
 			struct st_volume_container *parent;
 			off_t data_offset;
 		} partition;
+		/* an image file in a format of our own, such as a compressed image */
+		struct st_volume_container_image {
+			int fd;
+			void *state;
+		} image;
+		/* a container stacked on top of another one, adding behaviour such
+		as caching */
+		struct st_volume_container_layer {
+			struct st_volume_container *parent;
+			void *state;
+		} layer;
 	} data;
 } volume_container;
 
+ssize_t volume_readv(volume_container *v, volume_io_run *runs, int run_count);
+ssize_t volume_writev(volume_container *v, volume_io_run *runs, int run_count);
+
 #endif /* #ifdef __VOLUME_CONTAINER_H */
 
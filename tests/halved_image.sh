@@ -0,0 +1,45 @@
+#!/bin/sh
+# Format a halved HDF, as used with 8-bit IDE interfaces, and put and get
+# files on it; then check that they survive converting it to a full image and
+# back, and that an image using the high bytes of its words refuses to be
+# halved.
+
+HDFMONKEY=${HDFMONKEY:-../src/hdfmonkey}
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/hdfmonkey-test.XXXXXX") || exit 1
+trap 'rm -rf "$WORKDIR"' EXIT
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# check that $2 on image $1 reads back the same as local file $3
+check_file() {
+	rm -f "$WORKDIR/copy"
+	"$HDFMONKEY" get "$1" "$2" "$WORKDIR/copy" || fail "get $2 from $1"
+	cmp -s "$3" "$WORKDIR/copy" || fail "$2 read back differently from $1"
+}
+
+dd if=/dev/urandom of="$WORKDIR/data" bs=65536 count=40 2>/dev/null
+
+# the only way to make a halved image is to clone one from something else
+dd if=/dev/zero of="$WORKDIR/blank.img" bs=1048576 count=0 seek=16 2>/dev/null
+"$HDFMONKEY" clone --halved "$WORKDIR/blank.img" "$WORKDIR/halved.hdf" > /dev/null || fail "clone --halved"
+"$HDFMONKEY" format "$WORKDIR/halved.hdf" > /dev/null || fail "format halved image"
+"$HDFMONKEY" mkdir "$WORKDIR/halved.hdf" /dir || fail "mkdir on halved image"
+"$HDFMONKEY" put "$WORKDIR/halved.hdf" "$WORKDIR/data" /dir/data || fail "put on halved image"
+check_file "$WORKDIR/halved.hdf" /dir/data "$WORKDIR/data"
+
+"$HDFMONKEY" clone "$WORKDIR/halved.hdf" "$WORKDIR/full.hdf" > /dev/null || fail "clone to full image"
+check_file "$WORKDIR/full.hdf" /dir/data "$WORKDIR/data"
+"$HDFMONKEY" put "$WORKDIR/full.hdf" "$WORKDIR/data" /more || fail "put on full image"
+
+"$HDFMONKEY" clone --halved "$WORKDIR/full.hdf" "$WORKDIR/again.hdf" > /dev/null || fail "clone back to halved image"
+check_file "$WORKDIR/again.hdf" /more "$WORKDIR/data"
+
+"$HDFMONKEY" create "$WORKDIR/ordinary.hdf" 16M > /dev/null || fail "create ordinary image"
+if "$HDFMONKEY" clone --halved "$WORKDIR/ordinary.hdf" "$WORKDIR/lossy.hdf" > /dev/null 2>&1; then
+	fail "an ordinary image was halved, losing its high bytes"
+fi
+
+exit 0
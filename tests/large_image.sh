@@ -0,0 +1,71 @@
+#!/bin/sh
+# Write files near the end of a 32 GB sparse image and read them back, so that
+# sector offsets past 4 GB get exercised all the way through the I/O stack.
+# FatFs allocates from the free cluster hint in the FSInfo sector, so pointing
+# that hint near the last cluster puts the files there without having to fill
+# the rest of the image first.
+
+HDFMONKEY=${HDFMONKEY:-../src/hdfmonkey}
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/hdfmonkey-test.XXXXXX") || exit 1
+trap 'rm -rf "$WORKDIR"' EXIT
+IMAGE=$WORKDIR/large.img
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# read a little-endian value of $3 bytes at byte offset $2 of file $1
+read_le() {
+	od -A n -t u1 -j "$2" -N "$3" "$1" | awk '{
+		for (i = NF; i >= 1; i--) value = value * 256 + $i
+	} END { printf "%.0f\n", value }'
+}
+
+# write the 32-bit little-endian value $3 at byte offset $2 of file $1
+write_le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+		$(($3 & 255)) $(($3 >> 8 & 255)) $(($3 >> 16 & 255)) $(($3 >> 24 & 255)))" |
+		dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+"$HDFMONKEY" create "$IMAGE" 32G > /dev/null || fail "cannot create image"
+
+# find the FAT32 volume through the first partition entry
+volume=$(( $(read_le "$IMAGE" 454 4) * 512 ))
+[ "$(read_le "$IMAGE" $((volume + 82)) 4)" = 861159750 ] || fail "no FAT32 volume in new image" # "FAT3"
+bytes_per_sector=$(read_le "$IMAGE" $((volume + 11)) 2)
+sectors_per_cluster=$(read_le "$IMAGE" $((volume + 13)) 1)
+reserved_sectors=$(read_le "$IMAGE" $((volume + 14)) 2)
+fat_count=$(read_le "$IMAGE" $((volume + 16)) 1)
+total_sectors=$(read_le "$IMAGE" $((volume + 32)) 4)
+fat_size=$(read_le "$IMAGE" $((volume + 36)) 4)
+fsinfo_sector=$(read_le "$IMAGE" $((volume + 48)) 2)
+data_start=$((reserved_sectors + fat_count * fat_size))
+last_cluster=$(( (total_sectors - data_start) / sectors_per_cluster + 1 ))
+
+# leave room for the test files, plus a directory, before the last cluster
+hint=$(( last_cluster - (8 << 20) / (bytes_per_sector * sectors_per_cluster) - 4 ))
+write_le32 "$IMAGE" $((volume + fsinfo_sector * bytes_per_sector + 492)) $hint
+
+dd if=/dev/urandom of="$WORKDIR/small" bs=1000 count=3 2>/dev/null
+dd if=/dev/urandom of="$WORKDIR/large" bs=65536 count=64 2>/dev/null
+
+for options in "" "--cache=0"; do
+	dir=/dir${options#--cache=}
+	"$HDFMONKEY" $options mkdir "$IMAGE" $dir || fail "mkdir $options"
+	for name in small large; do
+		"$HDFMONKEY" $options put "$IMAGE" "$WORKDIR/$name" $dir/$name || fail "put $name $options"
+		rm -f "$WORKDIR/copy"
+		"$HDFMONKEY" $options get "$IMAGE" $dir/$name "$WORKDIR/copy" || fail "get $name $options"
+		cmp -s "$WORKDIR/$name" "$WORKDIR/copy" || fail "$name read back differently $options"
+	done
+done
+
+# the first thing allocated, the directory's cluster, should be the one after the hint
+offset=$(( volume + (data_start + (hint + 1 - 2) * sectors_per_cluster) * bytes_per_sector ))
+[ $offset -ge $(( (32 << 30) - (64 << 20) )) ] || fail "hint cluster is not near the end of the image"
+[ "$(dd if="$IMAGE" bs=1 skip=$offset count=1 2>/dev/null)" = "." ] ||
+	fail "files were not written near the end of the image"
+
+exit 0